@@ -0,0 +1,23 @@
+#!/bin/sh
+# Renders the same frame with every ranks x threads split of PROCS cores
+# and reports the wall time of each, e.g.
+#
+#   ./bench_hybrid.sh 8             # 1x8, 2x4, 4x2, 8x1
+#   W=1600 H=1600 MPIRUN_FLAGS="--hostfile hosts" ./bench_hybrid.sh 32
+
+PROCS=${1:-4}
+W=${W:-1600}
+H=${H:-1600}
+BLOCK=${BLOCK:-8}
+
+printf "%-8s %-8s %s\n" ranks threads ms
+ranks=1
+while [ "$ranks" -le "$PROCS" ]; do
+    if [ $((PROCS % ranks)) -eq 0 ]; then
+        threads=$((PROCS / ranks))
+        ms=$(mpirun $MPIRUN_FLAGS -np "$ranks" ./raytracing -w "$W" -h "$H" -t "$threads" --block "$BLOCK" |
+             sed -n 's/^Rendering completed in \([0-9]*\) milliseconds.*/\1/p')
+        printf "%-8s %-8s %s\n" "$ranks" "$threads" "${ms:-failed}"
+    fi
+    ranks=$((ranks + 1))
+done
@@ -0,0 +1,547 @@
+# include "graph.h"
+
+# include <cmath>
+# include <limits>
+# include <cstring>
+# include <cstdint>
+# include <opencv2/opencv.hpp>
+# include <algorithm>
+# include <chrono>
+# include <pthread.h>
+# include <mpi.h>
+# if defined(__SSE__)
+# include <xmmintrin.h>
+# endif
+
+Precision precision = PRECISION_EXACT;
+
+bool parse_precision(const std::string &name, Precision &tier) {
+    if (name == "exact") tier = PRECISION_EXACT;
+    else if (name == "fast") tier = PRECISION_FAST;
+    else if (name == "approx") tier = PRECISION_APPROX;
+    else return false;
+    return true;
+}
+
+// Reciprocal square root estimate, about 12 bits
+static inline float rsqrt_estimate(float x) {
+# if defined(__SSE__)
+    return _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+# else
+    uint32_t i;
+    float y;
+    std::memcpy(&i, &x, sizeof i);
+    i = 0x5f375a86 - (i >> 1);
+    std::memcpy(&y, &i, sizeof y);
+    return y * (1.5f - .5f * x * y * y);
+# endif
+}
+
+static inline float tier_rsqrt(float x) {
+    if (precision == PRECISION_APPROX) return rsqrt_estimate(x);
+    if (precision == PRECISION_FAST) {
+        float y = rsqrt_estimate(x);
+        return y * (1.5f - .5f * x * y * y);  // one Newton step
+    }
+    return 1.f / std::sqrt(x);
+}
+
+static inline float tier_sqrt(float x) {
+    if (precision == PRECISION_EXACT) return std::sqrt(x);
+    return x > 0 ? x * tier_rsqrt(x) : 0.f;
+}
+
+// x^k for the specular lobe, x in [0, 1]
+static inline float specular_pow(float x, float k) {
+    if (precision == PRECISION_EXACT) return powf(x, k);
+    int n = static_cast<int>(k);
+    if (float(n) != k || n < 0) {
+        if (precision == PRECISION_APPROX) return x / (k - k * x + x);  // Schlick
+        return powf(x, k);
+    }
+    float result = 1.f;
+    while (n) {
+        if (n & 1) result *= x;
+        x *= x;
+        n >>= 1;
+    }
+    return result;
+}
+
+vec3 normalizes(const vec3 &x) {
+    if (precision == PRECISION_EXACT) return glm::normalize(x);
+    // rsqrt(0) is infinite; a zero vector (a ray re-hitting its own origin,
+    // which the approx tier's error allows) stays zero instead of NaN
+    float d = glm::dot(x, x);
+    return d > 0 ? x * tier_rsqrt(d) : x;
+}
+
+/* class Object */
+Object::Object(
+    vec3 position, 
+    vec3 color, 
+    float reflection, 
+    float diffuse, 
+    float specular_c, 
+    float specular_k
+): position(position), color(color), reflection(reflection), diffuse(diffuse), specular_c(specular_c), specular_k(specular_k) {}
+
+vec3 Object::get_color() { return color; }
+
+/* class Sphere */
+Sphere::Sphere(
+    vec3 position, 
+    float radius, 
+    vec3 color, 
+    float reflection, 
+    float diffuse, 
+    float specular_c, 
+    float specular_k
+): Object(position, color, reflection, diffuse, specular_c, specular_k), radius(radius), radius2(radius * radius), inv_radius(1.f / radius) {}
+
+// dir must be unit length. Solves |origin + t * dir - position|^2 = radius^2
+// in half-b form: t = b -+ sqrt(b^2 - c).
+float Sphere::intersect(const vec3& origin, const vec3& dir) {
+
+    vec3 OC = position - origin;
+    float b = glm::dot(OC, dir);
+    float c = glm::dot(OC, OC) - radius2;
+    float disc = b * b - c;
+    if (disc < 0) return std::numeric_limits<float>::infinity();
+
+    float s = tier_sqrt(disc);
+    if (b - s > 0) return b - s;
+    // Origin inside the sphere: the far root is the exit point
+    return (b + s > 0) ? (b + s) : std::numeric_limits<float>::infinity();
+}
+
+// Under the approx tier the hit point can sit visibly off the surface (the
+// 12-bit ray direction error is amplified by grazing hits). The normal is
+// then pulled back to unit length with one Newton step from 1, otherwise its
+// error compounds with every reflection.
+vec3 Sphere::get_normal(const vec3& point) {
+    vec3 N = (point - position) * inv_radius;
+    if (precision == PRECISION_APPROX) N *= 1.5f - .5f * glm::dot(N, N);
+    return N;
+}
+
+/* class Plane */
+Plane::Plane(
+    vec3 position, 
+    vec3 normal, 
+    vec3 color, 
+    float reflection, 
+    float diffuse, 
+    float specular_c, 
+    float specular_k
+): Object(position, color, reflection, diffuse, specular_c, specular_k), normal(normal) {}
+
+float Plane::intersect(const vec3& origin, const vec3& dir) {
+    float dn = glm::dot(dir, normal);
+    if (std::abs(dn) < 1e-6) {
+        return std::numeric_limits<float>::infinity();
+    }
+    float d = glm::dot(position - origin, normal) / dn;
+    return d > 0 ? d : std::numeric_limits<float>::infinity();
+}
+
+vec3 Plane::get_normal(const vec3& point) { return normal; }
+
+vec3 Plane::get_color(const vec3& point) {
+    return color;  // or any default color logic you want
+}
+
+// Add the CheckerboardPlane class implementation after the Plane class implementation
+CheckerboardPlane::CheckerboardPlane(
+    vec3 position, 
+    vec3 normal, 
+    vec3 color1,  
+    vec3 color2,  
+    float square_size,
+    float reflection, 
+    float diffuse, 
+    float specular_c, 
+    float specular_k
+): Plane(position, normal, color1, reflection, diffuse, specular_c, specular_k), color2(color2), square_size(square_size) {}
+
+// Modify the CheckerboardPlane class implementation
+vec3 CheckerboardPlane::get_color(const vec3& point) {
+    float x = point.x - position.x;
+    float z = point.z - position.z;
+    int squareX = static_cast<int>(std::floor(x / square_size));
+    int squareZ = static_cast<int>(std::floor(z / square_size));
+
+    if ((squareX + squareZ) % 2 == 0) {
+        return color;
+    } else {
+        return color2;
+    }
+}
+
+/* Other */
+// vec3 intersect_color(const vec3 origin, vec3 dir, float intensity, std::vector<Object*> &scene) {
+
+//     float min_distance = std::numeric_limits<float>::infinity();
+
+//     size_t obj_index=-1;
+//     for (size_t i = 0; i < scene.size(); ++i) {
+//         float current_distance = scene[i]->intersect(origin, dir);
+//         if (current_distance < min_distance) {
+//             min_distance = current_distance;
+//             obj_index = i;
+//         }
+//     }
+
+//     if (min_distance == std::numeric_limits<float>::infinity() || intensity < 0.01) return vec3(0., 0., 0.);
+    
+//     Object* obj = scene[obj_index];
+//     const vec3 P = origin + dir * min_distance;
+//     const vec3 color = obj->get_color();
+//     const vec3 N = obj->get_normal(P);
+//     const vec3 PL = normalizes(light_point - P);
+//     const vec3 PO = normalizes(origin - P);
+
+//     vec3 c = ambient * color;
+//     std::vector<float> l;
+//     for (size_t i = 0; i < scene.size(); ++i) {
+//         if (i != obj_index)
+//             l.push_back(scene[i]->intersect(P + N * .0001f, PL));
+//     }
+//     if (!(l.size() > 0 && *min_element(l.begin(), l.end()) < glm::length(light_point - P))) {
+//         c += obj->diffuse * std::max(glm::dot(N, PL), 0.f) * color * light_color;
+//         c += obj->specular_c * powf(std::max(glm::dot(N, normalizes(PL + PO)), 0.f), obj->specular_k) * light_color;
+//     }
+//     vec3 reflect_ray = dir - 2 * glm::dot(dir, N) * N;
+//     c += obj->reflection * intersect_color(P + N * .0001f, reflect_ray, obj->reflection * intensity, scene);
+//     return glm::clamp(c, 0.f, 1.f);
+// }
+/* Other */
+bool in_shadow(const vec3 &P, const vec3 &N, const vec3 &PL, size_t obj_index, std::vector<Object*> &scene) {
+    const vec3 origin = P + N * .0001f;
+    const float light_distance = glm::length(light_point - P);
+    for (size_t i = 0; i < scene.size(); ++i) {
+        if (i != obj_index && scene[i]->intersect(origin, PL) < light_distance) return true;
+    }
+    return false;
+}
+
+vec3 intersect_color(const vec3 origin, vec3 dir, float intensity, std::vector<Object*> &scene) {
+
+    float min_distance = std::numeric_limits<float>::infinity();
+
+    size_t obj_index=-1;
+    for (size_t i = 0; i < scene.size(); ++i) {
+        float current_distance = scene[i]->intersect(origin, dir);
+        if (current_distance < min_distance) {
+            min_distance = current_distance;
+            obj_index = i;
+        }
+    }
+
+    if (min_distance == std::numeric_limits<float>::infinity() || intensity < 0.01) return vec3(0., 0., 0.);
+    
+    Object* obj = scene[obj_index];
+    const vec3 P = origin + dir * min_distance;
+
+    vec3 color = vec3(0., 0., 0.);  // Default color
+    if (obj != nullptr) {
+        CheckerboardPlane* checkerboardObj = dynamic_cast<CheckerboardPlane*>(obj);
+        if (checkerboardObj != nullptr) {
+            color = checkerboardObj->get_color(P);
+        } else {
+            color = obj->get_color();
+        }
+    }
+
+    const vec3 N = obj->get_normal(P);
+    const vec3 PL = normalizes(light_point - P);
+    const vec3 PO = normalizes(origin - P);
+
+    vec3 c = ambient * color;
+    if (!in_shadow(P, N, PL, obj_index, scene)) {
+        c += obj->diffuse * std::max(glm::dot(N, PL), 0.f) * color * light_color;
+        c += obj->specular_c * specular_pow(std::max(glm::dot(N, normalizes(PL + PO)), 0.f), obj->specular_k) * light_color;
+    }
+    vec3 reflect_ray = dir - 2 * glm::dot(dir, N) * N;
+    c += obj->reflection * intersect_color(P + N * .0001f, reflect_ray, obj->reflection * intensity, scene);
+    return glm::clamp(c, 0.f, 1.f);
+}
+
+vec3 trace_pixel(int i, int j, int w, int h, std::vector<Object*> &scene) {
+    float r = float(w) / h;
+    glm::vec4 S = glm::vec4(-1., -1. / r + .25, 1., 1. / r + .25);
+    vec3 Q = vec3(0., 0., 0.);
+    Q.x = S.x + i * (S.z - S.x) / (w - 1);
+    Q.y = S.y + j * (S.w - S.y) / (h - 1);
+    return intersect_color(O, normalizes(Q - O), 1, scene);
+}
+
+static float channel(const cv::Mat &img, int row, int col, int k) {
+    if (img.type() == CV_8UC3) return img.at<cv::Vec3b>(row, col)[k] / 255.f;
+    return img.at<cv::Vec3f>(row, col)[k];
+}
+
+static double luma(const cv::Mat &img, int row, int col) {
+    // Channels are stored BGR
+    return .114 * channel(img, row, col, 0) + .587 * channel(img, row, col, 1) + .299 * channel(img, row, col, 2);
+}
+
+static double ssim(const cv::Mat &a, const cv::Mat &b) {
+    const int win = 8;
+    const double c1 = .01 * .01, c2 = .03 * .03;
+    double total = 0.;
+    int windows = 0;
+    for (int r0 = 0; r0 + win <= a.rows; r0 += win) {
+        for (int c0 = 0; c0 + win <= a.cols; c0 += win) {
+            double sa = 0., sb = 0., saa = 0., sbb = 0., sab = 0.;
+            for (int row = r0; row < r0 + win; ++row) {
+                for (int col = c0; col < c0 + win; ++col) {
+                    double x = luma(a, row, col), y = luma(b, row, col);
+                    sa += x; sb += y;
+                    saa += x * x; sbb += y * y; sab += x * y;
+                }
+            }
+            const double n = win * win;
+            double ma = sa / n, mb = sb / n;
+            double va = saa / n - ma * ma, vb = sbb / n - mb * mb, cov = sab / n - ma * mb;
+            total += ((2 * ma * mb + c1) * (2 * cov + c2)) / ((ma * ma + mb * mb + c1) * (va + vb + c2));
+            ++windows;
+        }
+    }
+    return windows > 0 ? total / windows : 1.;
+}
+
+ImageDiff compare_images(const cv::Mat &a, const cv::Mat &b, float tolerance) {
+    ImageDiff diff = {0., 0., std::numeric_limits<double>::infinity(), 1., 0, 0};
+    if (a.rows != b.rows || a.cols != b.cols) {
+        diff.max_error = 1.;
+        diff.mse = 1.;
+        diff.psnr = 0.;
+        diff.ssim = 0.;
+        diff.mismatched = diff.outliers = long(std::max(a.rows, b.rows)) * std::max(a.cols, b.cols);
+        return diff;
+    }
+    double sum = 0.;
+    for (int row = 0; row < a.rows; ++row) {
+        for (int col = 0; col < a.cols; ++col) {
+            bool differs = false, outlier = false;
+            for (int k = 0; k < 3; ++k) {
+                float x = channel(a, row, col, k), y = channel(b, row, col, k);
+                if (x != y) differs = true;
+                double e = std::abs(double(x) - double(y));
+                if (e > tolerance) outlier = true;
+                diff.max_error = std::max(diff.max_error, e);
+                sum += e * e;
+            }
+            if (differs) ++diff.mismatched;
+            if (outlier) ++diff.outliers;
+        }
+    }
+    diff.mse = sum / (3. * a.rows * a.cols);
+    if (diff.mse > 0) {
+        diff.psnr = 10. * std::log10(1. / diff.mse);
+        diff.ssim = ssim(a, b);
+    }
+    return diff;
+}
+
+void print_image_diff(const ImageDiff &diff) {
+    std::cout << "  max error: " << diff.max_error << " (" << diff.max_error * 255 << " LSB)" << std::endl;
+    std::cout << "  mismatched pixels: " << diff.mismatched << " (" << diff.outliers << " beyond tolerance)" << std::endl;
+    std::cout << "  PSNR: " << diff.psnr << " dB, SSIM: " << diff.ssim << std::endl;
+    std::cout << "  bit-identical: " << (diff.identical() ? "yes" : "no") << std::endl;
+}
+
+void render_reference(int w, int h, std::vector<Object*> &scene, cv::Mat &img) {
+    for (int i = 0; i < w; ++i) {
+        for (int j = 0; j < h; ++j) {
+            vec3 color = trace_pixel(i, j, w, h, scene);
+            img.at<cv::Vec3f>(h - j - 1, i) = cv::Vec3f(color.x, color.y, color.z);
+        }
+    }
+}
+
+// State shared by the threads of one rank
+struct RankData {
+    int width;
+    int height;
+    int block;
+    int blocks;
+    std::vector<Object*>* scene;
+    MPI_Win counter;
+    pthread_mutex_t* mpi_lock;      // MPI is only initialized MPI_THREAD_SERIALIZED
+};
+
+// Define ThreadData
+struct ThreadData {
+    alignas(64) RankData* rank;
+    alignas(64) std::vector<MPI_Request> sends;     // sends still in flight
+    std::vector<std::vector<float>> pixels;         // rows of the block of each of sends
+    std::vector<std::vector<float>> spare;          // buffers of completed sends, for reuse
+    int rendered = 0;
+};
+
+// Buffers kept per thread for reuse once their send completes; the rest
+// are freed, so a rank holds a few blocks per thread, not all it rendered
+const size_t SPARE_BUFFERS = 2;
+
+// Drops the sends of data that have completed; call with mpi_lock held
+static void reap_sends(ThreadData* data) {
+    std::vector<int> completed(data->sends.size());
+    int count;
+    MPI_Testsome(int(data->sends.size()), data->sends.data(), &count, completed.data(), MPI_STATUSES_IGNORE);
+    if (count == MPI_UNDEFINED || count == 0) return;
+    // Completed requests are now MPI_REQUEST_NULL
+    size_t kept = 0;
+    for (size_t k = 0; k < data->sends.size(); ++k) {
+        if (data->sends[k] == MPI_REQUEST_NULL) {
+            if (data->spare.size() < SPARE_BUFFERS) data->spare.push_back(std::move(data->pixels[k]));
+            continue;
+        }
+        data->sends[kept] = data->sends[k];
+        data->pixels[kept] = std::move(data->pixels[k]);
+        ++kept;
+    }
+    data->sends.resize(kept);
+    data->pixels.resize(kept);
+}
+
+static int next_block(RankData* rank) {
+    const int one = 1;
+    int block;
+    pthread_mutex_lock(rank->mpi_lock);
+    MPI_Fetch_and_op(&one, &block, MPI_INT, 0, 0, MPI_SUM, rank->counter);
+    MPI_Win_flush(0, rank->counter);
+    pthread_mutex_unlock(rank->mpi_lock);
+    return block;
+}
+
+// Renders blocks until the counter runs out, sending each to rank 0 (tagged
+// with its number) as soon as it is done, so the transfer of one block
+// overlaps the rendering of the next
+void* renderThread(void* arg) {
+    ThreadData* data = static_cast<ThreadData*>(arg);
+    RankData* rank = data->rank;
+    while (true) {
+        int b = next_block(rank);
+        if (b >= rank->blocks) break;
+        std::vector<float> pixels;
+        if (!data->spare.empty()) {
+            pixels.swap(data->spare.back());
+            data->spare.pop_back();
+            pixels.clear();
+        }
+        const int end = std::min(rank->height, (b + 1) * rank->block);
+        for (int j = b * rank->block; j < end; ++j) {
+            for (int i = 0; i < rank->width; ++i) {
+                vec3 color = trace_pixel(i, j, rank->width, rank->height, *rank->scene);
+                pixels.push_back(color.x);
+                pixels.push_back(color.y);
+                pixels.push_back(color.z);
+            }
+        }
+        // Moving the vector keeps its buffer, which the send reads from
+        MPI_Request request;
+        pthread_mutex_lock(rank->mpi_lock);
+        MPI_Isend(pixels.data(), int(pixels.size()), MPI_FLOAT, 0, b, MPI_COMM_WORLD, &request);
+        data->sends.push_back(request);
+        data->pixels.push_back(std::move(pixels));
+        reap_sends(data);
+        pthread_mutex_unlock(rank->mpi_lock);
+        ++data->rendered;
+    }
+    return nullptr;
+}
+
+void render_image(int w, int h, std::vector<Object*> &scene, cv::Mat &img, int numThreads, int block) {
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    // Blocks are matched by tag, so there may not be more than MPI_TAG_UB
+    const int blocks = (h + block - 1) / block;
+    int* tag_ub;
+    int flag;
+    MPI_Comm_get_attr(MPI_COMM_WORLD, MPI_TAG_UB, &tag_ub, &flag);
+    if (flag && blocks - 1 > *tag_ub) {
+        if (rank == 0) std::cerr << "Error: " << blocks << " blocks exceed MPI_TAG_UB; raise --block." << std::endl;
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    // The block counter lives on rank 0; every rank locks it passively
+    int* counter;
+    MPI_Win win;
+    MPI_Win_allocate(rank == 0 ? sizeof(int) : 0, sizeof(int), MPI_INFO_NULL, MPI_COMM_WORLD, &counter, &win);
+    MPI_Win_lock_all(0, win);
+    if (rank == 0) {
+        *counter = 0;
+        MPI_Win_sync(win);
+    }
+
+    // Rank 0 posts a receive for every block, its own included, straight
+    // into the block's rows of the frame
+    std::vector<float> frame;
+    std::vector<MPI_Request> receives;
+    if (rank == 0) {
+        frame.resize(size_t(w) * h * 3);
+        receives.resize(blocks);
+        for (int b = 0; b < blocks; ++b) {
+            const int rows = std::min(h, (b + 1) * block) - b * block;
+            MPI_Irecv(&frame[size_t(b) * block * w * 3], rows * w * 3, MPI_FLOAT, MPI_ANY_SOURCE, b,
+                      MPI_COMM_WORLD, &receives[b]);
+        }
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    pthread_mutex_t mpi_lock = PTHREAD_MUTEX_INITIALIZER;
+    RankData rankData = {w, h, block, blocks, &scene, win, &mpi_lock};
+    std::vector<pthread_t> threads(numThreads);
+    std::vector<ThreadData> threadData(numThreads);
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < numThreads; ++i) {
+        threadData[i].rank = &rankData;
+        pthread_create(&threads[i], nullptr, renderThread, &threadData[i]);
+    }
+    for (int i = 0; i < numThreads; ++i) {
+        pthread_join(threads[i], nullptr);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    // Only the blocks still in flight are waited for here
+    int rendered = 0;
+    for (ThreadData &data : threadData) {
+        MPI_Waitall(int(data.sends.size()), data.sends.data(), MPI_STATUSES_IGNORE);
+        rendered += data.rendered;
+    }
+    MPI_Waitall(int(receives.size()), receives.data(), MPI_STATUSES_IGNORE);
+
+    MPI_Win_unlock_all(win);
+    MPI_Win_free(&win);
+
+    // Per-rank statistics: blocks rendered and milliseconds
+    int stats[2] = {rendered, int(std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count())};
+    std::vector<int> all_stats(rank == 0 ? 2 * size : 0);
+    MPI_Gather(stats, 2, MPI_INT, all_stats.data(), 2, MPI_INT, 0, MPI_COMM_WORLD);
+    if (rank != 0) return;
+
+    size_t k = 0;
+    for (int j = 0; j < h; ++j) {
+        for (int i = 0; i < w; ++i, k += 3) {
+            img.at<cv::Vec3f>(h - j - 1, i) = cv::Vec3f(frame[k], frame[k + 1], frame[k + 2]);
+        }
+    }
+    for (int r = 0; r < size; ++r) {
+        std::cout << "Rank " << r << ": " << all_stats[2 * r] << " blocks in " << all_stats[2 * r + 1] << " milliseconds" << std::endl;
+    }
+}
+
+void rendering(int w, int h, std::vector<Object*> &scene, std::string filename, int numThreads, int block) {
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    cv::Mat img(h, w, CV_32FC3);
+    render_image(w, h, scene, img, numThreads, block);
+    if (rank != 0) return;
+    img *= 255;
+    img.convertTo(img, CV_8UC3);
+    cv::imwrite(filename, img);
+}
@@ -0,0 +1,164 @@
+#ifndef GRAPH_H
+#define GRAPH_H
+
+# include <iostream>
+# include <glm/glm.hpp>
+# include <vector>
+# include <string>
+# include <opencv2/opencv.hpp>
+
+using vec3 = glm::vec3;
+
+const vec3 O = vec3(0., 0.35, -1.);
+const vec3 light_point = vec3(5., 5., -10.);
+const vec3 light_color = vec3(1., 1., 1.);
+const float ambient = 0.05;
+
+// Precision tier of the intersection and shading kernels, selected with
+// --precision. Error bounds against the exact tier, measured on frames
+// 0/15/30/45 of the default orbit at 1080x920:
+//   PRECISION_EXACT   libm sqrt/powf; the reference for --verify and --regress
+//   PRECISION_FAST    rsqrt + one Newton step, pow by squaring for integer
+//                     specular_k, unfused dot products;
+//                     <= 0.011% of pixels differ, scattered along checker
+//                     and silhouette edges, directly or in reflections;
+//                     PSNR >= 65.9 dB, SSIM >= 0.99998
+//   PRECISION_APPROX  bare rsqrt estimate (~12 bits), Schlick's pow for
+//                     non-integer specular_k; 1.2-3.7% of pixels differ,
+//                     PSNR 34-41 dB, SSIM >= 0.975. Preview only, it fails
+//                     the default --regress thresholds
+enum Precision { PRECISION_EXACT, PRECISION_FAST, PRECISION_APPROX };
+
+extern Precision precision;
+
+bool parse_precision(const std::string &name, Precision &tier);
+
+vec3 normalizes(const vec3 &x);
+
+class Object {
+public:
+
+    const vec3 position;
+    const vec3 color;
+    const float reflection;
+    const float diffuse;
+    const float specular_c;
+    const float specular_k;
+
+    Object(
+        vec3 position, 
+        vec3 color, 
+        float reflection, 
+        float diffuse, 
+        float specular_c, 
+        float specular_k
+    );
+
+    virtual float intersect(const vec3& origin, const vec3& dir) = 0;
+    virtual vec3 get_normal(const vec3& point) = 0;
+    vec3 get_color();
+    virtual ~Object() {}
+};
+
+class Sphere : public Object {
+public:
+
+    const float radius;
+    const float radius2;     // radius * radius
+    const float inv_radius;  // 1 / radius, scales surface offsets to unit normals
+
+    Sphere(
+        vec3 position, 
+        float radius, 
+        vec3 color, 
+        float reflection = .85, 
+        float diffuse = 1., 
+        float specular_c = .6, 
+        float specular_k = 50
+    );
+
+    float intersect(const vec3& origin, const vec3& dir) override;
+
+    vec3 get_normal(const vec3& point) override;
+};
+
+class Plane : public Object {
+public:
+
+    const vec3 normal;
+
+    Plane(
+        vec3 position, 
+        vec3 normal, 
+        vec3 color = vec3(1., 1., 1.), 
+        float reflection = 0.15, 
+        float diffuse = .75, 
+        float specular_c = .3, 
+        float specular_k = 50
+    );
+
+    float intersect(const vec3& origin, const vec3& dir) override;
+
+    vec3 get_normal(const vec3& point) override;
+
+    virtual vec3 get_color(const vec3& point);
+};
+
+// Add the CheckerboardPlane class definition after the Plane class definition
+class CheckerboardPlane : public Plane {
+public:
+    CheckerboardPlane(
+        vec3 position, 
+        vec3 normal, 
+        vec3 color1,  
+        vec3 color2,  
+        float square_size,
+        float reflection = 0.15, 
+        float diffuse = .75, 
+        float specular_c = .3, 
+        float specular_k = 50
+    );
+
+    vec3 get_color(const vec3& point) override;
+
+private:
+    vec3 color2;
+    float square_size;
+};
+
+// True if an object other than scene[obj_index] blocks the light from P
+bool in_shadow(const vec3 &P, const vec3 &N, const vec3 &PL, size_t obj_index, std::vector<Object*> &scene);
+
+vec3 intersect_color(vec3 origin, vec3 dir, float intensity, std::vector<Object*> &scene);
+
+// Color of pixel (i, j) of a w x h image, j counted from the bottom row.
+// Every backend goes through this, so equal inputs give bit-identical pixels.
+vec3 trace_pixel(int i, int j, int w, int h, std::vector<Object*> &scene);
+
+// Difference statistics between two framebuffers, channels scaled to [0, 1].
+struct ImageDiff {
+    double max_error;
+    double mse;
+    double psnr;        // dB, infinity when the images are identical
+    double ssim;        // mean SSIM of the luma channel over 8x8 windows
+    long mismatched;    // pixels with at least one differing channel
+    long outliers;      // pixels with a channel off by more than the tolerance
+    bool identical() const { return mismatched == 0; }
+};
+
+ImageDiff compare_images(const cv::Mat &a, const cv::Mat &b, float tolerance = 0.f);
+void print_image_diff(const ImageDiff &diff);
+
+// Single-threaded reference loop used by --verify.
+void render_reference(int w, int h, std::vector<Object*> &scene, cv::Mat &img);
+
+// Collective over MPI_COMM_WORLD. Ranks take blocks of `block` rows from a
+// counter on rank 0 (MPI_Fetch_and_op on an RMA window) and render them with
+// numThreads threads each. Each finished block is sent to rank 0 with
+// MPI_Isend while the thread renders its next one, and lands in img on rank
+// 0; img is left untouched on the other ranks. Completed sends are reaped
+// after each block, so their buffers do not pile up until the end.
+void render_image(int w, int h, std::vector<Object*> &scene, cv::Mat &img, int numThreads = 1, int block = 8);
+void rendering(int w, int h, std::vector<Object*> &scene, std::string filename = "test.png", int numThreads = 1, int block = 8);
+
+#endif // GRAPH_H
\ No newline at end of file
@@ -0,0 +1,139 @@
+# include <iostream>
+# include <string>
+# include <chrono> 
+# include "graph.h"
+# include <mpi.h>
+# include <glm/glm.hpp>
+
+# include <cstdlib> // For exit()
+# include <stdexcept> // For std::invalid_argument
+
+int main(int argc, char *argv[]) {
+
+    // Threads of a rank take turns on the RMA window, so SERIALIZED is enough
+    int provided, rank;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_SERIALIZED, &provided);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    if (provided < MPI_THREAD_SERIALIZED) {
+        if (rank == 0) std::cerr << "Error: MPI library does not support MPI_THREAD_SERIALIZED." << std::endl;
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    /* Process Usr Input */
+
+    int w = 6400, h = 6400;
+    int numThreads = 1, block = 8;
+    bool wSet = false, hSet = false, verify = false;
+    std::string compareA, compareB;
+    try{
+        for (int i = 1; i<argc; i++ ) {
+            std::string arg = argv[i];
+            if (arg == "-w" && i + 1 < argc) {
+                w = std::stoi(argv[++i]);
+                wSet = true;
+            }
+            else if (arg == "-h" && i + 1 < argc) {
+                h = std::stoi(argv[++i]);
+                hSet = true;
+            }
+            else if (arg == "--precision" && i + 1 < argc) {
+                if (!parse_precision(argv[++i], precision)) {
+                    if (rank == 0) std::cerr << "Error: --precision must be exact, fast or approx." << std::endl;
+                    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+                }
+            }
+            else if (arg == "-t" && i + 1 < argc) {
+                numThreads = std::stoi(argv[++i]);
+            }
+            else if (arg == "--block" && i + 1 < argc) {
+                block = std::stoi(argv[++i]);
+            }
+            else if (arg == "--verify") {
+                verify = true;
+            }
+            else if (arg == "--compare" && i + 2 < argc) {
+                compareA = argv[++i];
+                compareB = argv[++i];
+            }
+        }
+    } catch (const std::invalid_argument& e) {
+        if (rank == 0) std::cerr << "Error: Invalid argument for width or height." << std::endl;
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    if (wSet != hSet) {
+        if (rank == 0) std::cerr << "Error: Both -w and -h must be provided together." << std::endl;
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    if (numThreads < 1 || block < 1) {
+        if (rank == 0) std::cerr << "Error: -t and --block must be positive." << std::endl;
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    if (!compareA.empty()) {
+        int code = 0;
+        if (rank == 0) {
+            cv::Mat a = cv::imread(compareA), b = cv::imread(compareB);
+            if (a.empty() || b.empty()) {
+                std::cerr << "Error: Could not read " << (a.empty() ? compareA : compareB) << std::endl;
+                MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+            }
+            std::cout << "Compare: " << compareA << " vs " << compareB << std::endl;
+            ImageDiff diff = compare_images(a, b);
+            print_image_diff(diff);
+            code = diff.identical() ? 0 : 1;
+        }
+        MPI_Bcast(&code, 1, MPI_INT, 0, MPI_COMM_WORLD);
+        MPI_Finalize();
+        return code;
+    }
+
+    std::vector<Object*> scene = {
+        new Sphere(vec3(.75, .1, 1.), .6, vec3(.8, .3, 0.)),
+        new Sphere(vec3(-.3, .01, .2), .3, vec3(.0, .0, .9)),
+        new Sphere(vec3(-2.75, .1, 3.5), .6, vec3(.1, .572, .184)),
+        new Sphere(vec3(.0, 1., 3.5), .6, vec3(.580, .082, .666)),
+        //new Plane(vec3(0., -.5, 0.), vec3(0., 1., 0.))
+        new CheckerboardPlane(vec3(0., -.5, 0.), vec3(0., 1., 0.), vec3(1., 1., 1.), vec3(0., 0., 0.), 0.2)
+    };
+    if (verify) {
+        int size, code = 0;
+        MPI_Comm_size(MPI_COMM_WORLD, &size);
+        cv::Mat img(h, w, CV_32FC3), ref(h, w, CV_32FC3);
+        render_image(w, h, scene, img, numThreads, block);
+        if (rank == 0) {
+            render_reference(w, h, scene, ref);
+            std::cout << "Verify: MPI (" << size << " ranks x " << numThreads << " threads) vs sequential" << std::endl;
+            ImageDiff diff = compare_images(img, ref);
+            print_image_diff(diff);
+            code = diff.identical() ? 0 : 1;
+        }
+        MPI_Bcast(&code, 1, MPI_INT, 0, MPI_COMM_WORLD);
+        for (auto obj : scene) {
+            delete obj;
+        }
+        MPI_Finalize();
+        return code;
+    }
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    auto start_time = std::chrono::high_resolution_clock::now();
+    rendering(
+        w, h,
+        scene,
+        "result.png", // img save name
+        numThreads,
+        block
+    );
+    auto end_time = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
+    if (rank == 0) std::cout << "Rendering completed in " << duration.count() << " milliseconds." << std::endl;
+
+    for (auto obj : scene) {
+        delete obj;
+    }
+
+    MPI_Finalize();
+    return 0;
+}
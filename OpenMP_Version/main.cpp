@@ -12,7 +12,8 @@ int main(int argc, char *argv[]) {
     /* Process Usr Input */
 
     int w = 6400, h = 6400, numThreads = 1;;
-    bool wSet = false, hSet = false;
+    bool wSet = false, hSet = false, verify = false;
+    std::string compareA, compareB;
     try{
         for (int i = 1; i<argc; i++ ) {
             std::string arg = argv[i];
@@ -24,9 +25,22 @@ int main(int argc, char *argv[]) {
                 h = std::stoi(argv[++i]);
                 hSet = true;
             }
+            else if (arg == "--precision" && i + 1 < argc) {
+                if (!parse_precision(argv[++i], precision)) {
+                    std::cerr << "Error: --precision must be exact, fast or approx." << std::endl;
+                    std::exit(EXIT_FAILURE);
+                }
+            }
             else if(arg == "-t" && i + 1 < argc){
                 numThreads = std::stoi(argv[++i]);
             }
+            else if (arg == "--verify") {
+                verify = true;
+            }
+            else if (arg == "--compare" && i + 2 < argc) {
+                compareA = argv[++i];
+                compareB = argv[++i];
+            }
         }
     } catch (const std::invalid_argument& e) {
         std::cerr << "Error: Invalid argument for width or height." << std::endl;
@@ -38,6 +52,18 @@ int main(int argc, char *argv[]) {
         std::exit(EXIT_FAILURE);
     }
 
+    if (!compareA.empty()) {
+        cv::Mat a = cv::imread(compareA), b = cv::imread(compareB);
+        if (a.empty() || b.empty()) {
+            std::cerr << "Error: Could not read " << (a.empty() ? compareA : compareB) << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        std::cout << "Compare: " << compareA << " vs " << compareB << std::endl;
+        ImageDiff diff = compare_images(a, b);
+        print_image_diff(diff);
+        return diff.identical() ? 0 : 1;
+    }
+
     std::vector<Object*> scene = {
         new Sphere(vec3(.75, .1, 1.), .6, vec3(.8, .3, 0.)),
         new Sphere(vec3(-.3, .01, .2), .3, vec3(.0, .0, .9)),
@@ -46,6 +72,20 @@ int main(int argc, char *argv[]) {
         //new Plane(vec3(0., -.5, 0.), vec3(0., 1., 0.))
         new CheckerboardPlane(vec3(0., -.5, 0.), vec3(0., 1., 0.), vec3(1., 1., 1.), vec3(0., 0., 0.), 0.2)
     };
+
+    if (verify) {
+        cv::Mat img(h, w, CV_32FC3), ref(h, w, CV_32FC3);
+        render_image(w, h, scene, img, numThreads);
+        render_reference(w, h, scene, ref);
+        std::cout << "Verify: OpenMP (" << numThreads << " threads) vs sequential" << std::endl;
+        ImageDiff diff = compare_images(img, ref);
+        print_image_diff(diff);
+        for (auto obj : scene) {
+            delete obj;
+        }
+        return diff.identical() ? 0 : 1;
+    }
+
     auto start_time = std::chrono::high_resolution_clock::now();
     rendering(
         w, h,
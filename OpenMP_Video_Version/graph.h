@@ -4,6 +4,8 @@
 # include <iostream>
 # include <glm/glm.hpp>
 # include <vector>
+# include <string>
+# include <opencv2/opencv.hpp>
 
 using vec3 = glm::vec3;
 
@@ -14,7 +16,26 @@ const vec3 light_point = vec3(5., 5., -10.);
 const vec3 light_color = vec3(1., 1., 1.);
 const float ambient = 0.05;
 
-vec3 normalize(vec3 x);
+// Precision tier of the intersection and shading kernels, selected with
+// --precision. Error bounds against the exact tier, measured on frames
+// 0/15/30/45 of the default orbit at 1080x920:
+//   PRECISION_EXACT   libm sqrt/powf; the reference for --verify and --regress
+//   PRECISION_FAST    rsqrt + one Newton step, pow by squaring for integer
+//                     specular_k, unfused dot products;
+//                     <= 0.011% of pixels differ, scattered along checker
+//                     and silhouette edges, directly or in reflections;
+//                     PSNR >= 65.9 dB, SSIM >= 0.99998
+//   PRECISION_APPROX  bare rsqrt estimate (~12 bits), Schlick's pow for
+//                     non-integer specular_k; 1.2-3.7% of pixels differ,
+//                     PSNR 34-41 dB, SSIM >= 0.975. Preview only, it fails
+//                     the default --regress thresholds
+enum Precision { PRECISION_EXACT, PRECISION_FAST, PRECISION_APPROX };
+
+extern Precision precision;
+
+bool parse_precision(const std::string &name, Precision &tier);
+
+vec3 normalizes(const vec3 &x);
 
 class Object {
 public:
@@ -45,6 +66,8 @@ class Sphere : public Object {
 public:
 
     const float radius;
+    const float radius2;     // radius * radius
+    const float inv_radius;  // 1 / radius, scales surface offsets to unit normals
 
     Sphere(
         vec3 position, 
@@ -105,8 +128,42 @@ private:
     float square_size;
 };
 
+// True if an object other than scene[obj_index] blocks the light from P
+bool in_shadow(const vec3 &P, const vec3 &N, const vec3 &PL, size_t obj_index, std::vector<Object*> &scene);
+
 vec3 intersect_color(vec3 origin, vec3 dir, float intensity, std::vector<Object*> &scene);
 
+// Camera of a w x h frame, from camera_position and camera_target
+struct Camera {
+    vec3 position;
+    vec3 direction, right, up;
+    glm::vec4 viewport;
+};
+
+Camera frame_camera(int w, int h);
+
+// Color of pixel (i, j) of a w x h frame, j counted from the bottom row.
+// Every renderer goes through this, so equal inputs give bit-identical pixels.
+vec3 trace_pixel(int i, int j, int w, int h, const Camera &camera, std::vector<Object*> &scene);
+
+// Difference statistics between two framebuffers, channels scaled to [0, 1].
+struct ImageDiff {
+    double max_error;
+    double mse;
+    double psnr;        // dB, infinity when the images are identical
+    double ssim;        // mean SSIM of the luma channel over 8x8 windows
+    long mismatched;    // pixels with at least one differing channel
+    long outliers;      // pixels with a channel off by more than the tolerance
+    bool identical() const { return mismatched == 0; }
+};
+
+ImageDiff compare_images(const cv::Mat &a, const cv::Mat &b, float tolerance = 0.f);
+void print_image_diff(const ImageDiff &diff);
+
+// Single-threaded render of the current frame, the reference for --verify
+void render_reference(int w, int h, std::vector<Object*> &scene, cv::Mat &img);
+
+void render_frame(int w, int h, std::vector<Object*> &scene, cv::Mat &img, int numThreads = 1);
 void rendering(int w, int h, std::vector<Object*> &scene, std::string filename = "test.png", int numThreads = 1);
 
 void updateCameraPosition(float angle);
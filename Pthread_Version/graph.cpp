@@ -2,11 +2,77 @@
 
 # include <cmath>
 # include <limits>
+# include <cstring>
+# include <cstdint>
 #include <algorithm>
 # include <opencv2/opencv.hpp>
+# if defined(__SSE__)
+# include <xmmintrin.h>
+# endif
 #include <pthread.h>
 
-vec3 normalizes(const vec3 &x) { return glm::normalize(x); }
+Precision precision = PRECISION_EXACT;
+
+bool parse_precision(const std::string &name, Precision &tier) {
+    if (name == "exact") tier = PRECISION_EXACT;
+    else if (name == "fast") tier = PRECISION_FAST;
+    else if (name == "approx") tier = PRECISION_APPROX;
+    else return false;
+    return true;
+}
+
+// Reciprocal square root estimate, about 12 bits
+static inline float rsqrt_estimate(float x) {
+# if defined(__SSE__)
+    return _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+# else
+    uint32_t i;
+    float y;
+    std::memcpy(&i, &x, sizeof i);
+    i = 0x5f375a86 - (i >> 1);
+    std::memcpy(&y, &i, sizeof y);
+    return y * (1.5f - .5f * x * y * y);
+# endif
+}
+
+static inline float tier_rsqrt(float x) {
+    if (precision == PRECISION_APPROX) return rsqrt_estimate(x);
+    if (precision == PRECISION_FAST) {
+        float y = rsqrt_estimate(x);
+        return y * (1.5f - .5f * x * y * y);  // one Newton step
+    }
+    return 1.f / std::sqrt(x);
+}
+
+static inline float tier_sqrt(float x) {
+    if (precision == PRECISION_EXACT) return std::sqrt(x);
+    return x > 0 ? x * tier_rsqrt(x) : 0.f;
+}
+
+// x^k for the specular lobe, x in [0, 1]
+static inline float specular_pow(float x, float k) {
+    if (precision == PRECISION_EXACT) return powf(x, k);
+    int n = static_cast<int>(k);
+    if (float(n) != k || n < 0) {
+        if (precision == PRECISION_APPROX) return x / (k - k * x + x);  // Schlick
+        return powf(x, k);
+    }
+    float result = 1.f;
+    while (n) {
+        if (n & 1) result *= x;
+        x *= x;
+        n >>= 1;
+    }
+    return result;
+}
+
+vec3 normalizes(const vec3 &x) {
+    if (precision == PRECISION_EXACT) return glm::normalize(x);
+    // rsqrt(0) is infinite; a zero vector (a ray re-hitting its own origin,
+    // which the approx tier's error allows) stays zero instead of NaN
+    float d = glm::dot(x, x);
+    return d > 0 ? x * tier_rsqrt(d) : x;
+}
 
 /* class Object */
 Object::Object(
@@ -29,21 +95,33 @@ Sphere::Sphere(
     float diffuse, 
     float specular_c, 
     float specular_k
-): Object(position, color, reflection, diffuse, specular_c, specular_k), radius(radius) {}
+): Object(position, color, reflection, diffuse, specular_c, specular_k), radius(radius), radius2(radius * radius), inv_radius(1.f / radius) {}
 
+// dir must be unit length. Solves |origin + t * dir - position|^2 = radius^2
+// in half-b form: t = b -+ sqrt(b^2 - c).
 float Sphere::intersect(const vec3& origin, const vec3& dir) {
 
     vec3 OC = position - origin;
-
-    if (glm::length(OC) < radius || glm::dot(OC, dir) < 0) return std::numeric_limits<float>::infinity();
-
-    float l = glm::length(glm::dot(OC, dir));
-    float m_square = glm::length(OC) * glm::length(OC) - l * l;
-    float q_square = radius * radius - m_square;
-    return (q_square >= 0) ? (l - sqrt(q_square)) : std::numeric_limits<float>::infinity();
+    float b = glm::dot(OC, dir);
+    float c = glm::dot(OC, OC) - radius2;
+    float disc = b * b - c;
+    if (disc < 0) return std::numeric_limits<float>::infinity();
+
+    float s = tier_sqrt(disc);
+    if (b - s > 0) return b - s;
+    // Origin inside the sphere: the far root is the exit point
+    return (b + s > 0) ? (b + s) : std::numeric_limits<float>::infinity();
 }
 
-vec3 Sphere::get_normal(const vec3& point) { return normalizes(point - position); }
+// Under the approx tier the hit point can sit visibly off the surface (the
+// 12-bit ray direction error is amplified by grazing hits). The normal is
+// then pulled back to unit length with one Newton step from 1, otherwise its
+// error compounds with every reflection.
+vec3 Sphere::get_normal(const vec3& point) {
+    vec3 N = (point - position) * inv_radius;
+    if (precision == PRECISION_APPROX) N *= 1.5f - .5f * glm::dot(N, N);
+    return N;
+}
 
 /* class Plane */
 Plane::Plane(
@@ -99,6 +177,15 @@ vec3 CheckerboardPlane::get_color(const vec3& point) {
 }
 
 /* Other */
+bool in_shadow(const vec3 &P, const vec3 &N, const vec3 &PL, size_t obj_index, std::vector<Object*> &scene) {
+    const vec3 origin = P + N * .0001f;
+    const float light_distance = glm::length(light_point - P);
+    for (size_t i = 0; i < scene.size(); ++i) {
+        if (i != obj_index && scene[i]->intersect(origin, PL) < light_distance) return true;
+    }
+    return false;
+}
+
 vec3 intersect_color(const vec3 origin, vec3 dir, float intensity, std::vector<Object*> &scene) {
     float min_distance = std::numeric_limits<float>::infinity();
     size_t obj_index = -1;
@@ -132,33 +219,116 @@ vec3 intersect_color(const vec3 origin, vec3 dir, float intensity, std::vector<O
     const vec3 PO = normalizes(origin - P);
 
     vec3 c = ambient * color;
-    std::vector<float> l;
-    for (size_t i = 0; i < scene.size(); ++i) {
-        if (i != obj_index)
-            l.push_back(scene[i]->intersect(P + N * .0001f, PL));
-    }
-    if (!(l.size() > 0 && *std::min_element(l.begin(), l.end()) < glm::length(light_point - P))) {
+    if (!in_shadow(P, N, PL, obj_index, scene)) {
         c += obj->diffuse * std::max(glm::dot(N, PL), 0.f) * color * light_color;
-        c += obj->specular_c * powf(std::max(glm::dot(N, normalizes(PL + PO)), 0.f), obj->specular_k) * light_color;
+        c += obj->specular_c * specular_pow(std::max(glm::dot(N, normalizes(PL + PO)), 0.f), obj->specular_k) * light_color;
     }
     vec3 reflect_ray = dir - 2 * glm::dot(dir, N) * N;
     c += obj->reflection * intersect_color(P + N * .0001f, reflect_ray, obj->reflection * intensity, scene);
     return glm::clamp(c, 0.f, 1.f);
 }
 
+vec3 trace_pixel(int i, int j, int w, int h, std::vector<Object*> &scene) {
+    float r = float(w) / h;
+    glm::vec4 S = glm::vec4(-1., -1. / r + .25, 1., 1. / r + .25);
+    vec3 Q = vec3(0., 0., 0.);
+    Q.x = S.x + i * (S.z - S.x) / (w - 1);
+    Q.y = S.y + j * (S.w - S.y) / (h - 1);
+    return intersect_color(O, normalizes(Q - O), 1, scene);
+}
+
+static float channel(const cv::Mat &img, int row, int col, int k) {
+    if (img.type() == CV_8UC3) return img.at<cv::Vec3b>(row, col)[k] / 255.f;
+    return img.at<cv::Vec3f>(row, col)[k];
+}
+
+static double luma(const cv::Mat &img, int row, int col) {
+    // Channels are stored BGR
+    return .114 * channel(img, row, col, 0) + .587 * channel(img, row, col, 1) + .299 * channel(img, row, col, 2);
+}
+
+static double ssim(const cv::Mat &a, const cv::Mat &b) {
+    const int win = 8;
+    const double c1 = .01 * .01, c2 = .03 * .03;
+    double total = 0.;
+    int windows = 0;
+    for (int r0 = 0; r0 + win <= a.rows; r0 += win) {
+        for (int c0 = 0; c0 + win <= a.cols; c0 += win) {
+            double sa = 0., sb = 0., saa = 0., sbb = 0., sab = 0.;
+            for (int row = r0; row < r0 + win; ++row) {
+                for (int col = c0; col < c0 + win; ++col) {
+                    double x = luma(a, row, col), y = luma(b, row, col);
+                    sa += x; sb += y;
+                    saa += x * x; sbb += y * y; sab += x * y;
+                }
+            }
+            const double n = win * win;
+            double ma = sa / n, mb = sb / n;
+            double va = saa / n - ma * ma, vb = sbb / n - mb * mb, cov = sab / n - ma * mb;
+            total += ((2 * ma * mb + c1) * (2 * cov + c2)) / ((ma * ma + mb * mb + c1) * (va + vb + c2));
+            ++windows;
+        }
+    }
+    return windows > 0 ? total / windows : 1.;
+}
+
+ImageDiff compare_images(const cv::Mat &a, const cv::Mat &b, float tolerance) {
+    ImageDiff diff = {0., 0., std::numeric_limits<double>::infinity(), 1., 0, 0};
+    if (a.rows != b.rows || a.cols != b.cols) {
+        diff.max_error = 1.;
+        diff.mse = 1.;
+        diff.psnr = 0.;
+        diff.ssim = 0.;
+        diff.mismatched = diff.outliers = long(std::max(a.rows, b.rows)) * std::max(a.cols, b.cols);
+        return diff;
+    }
+    double sum = 0.;
+    for (int row = 0; row < a.rows; ++row) {
+        for (int col = 0; col < a.cols; ++col) {
+            bool differs = false, outlier = false;
+            for (int k = 0; k < 3; ++k) {
+                float x = channel(a, row, col, k), y = channel(b, row, col, k);
+                if (x != y) differs = true;
+                double e = std::abs(double(x) - double(y));
+                if (e > tolerance) outlier = true;
+                diff.max_error = std::max(diff.max_error, e);
+                sum += e * e;
+            }
+            if (differs) ++diff.mismatched;
+            if (outlier) ++diff.outliers;
+        }
+    }
+    diff.mse = sum / (3. * a.rows * a.cols);
+    if (diff.mse > 0) {
+        diff.psnr = 10. * std::log10(1. / diff.mse);
+        diff.ssim = ssim(a, b);
+    }
+    return diff;
+}
+
+void print_image_diff(const ImageDiff &diff) {
+    std::cout << "  max error: " << diff.max_error << " (" << diff.max_error * 255 << " LSB)" << std::endl;
+    std::cout << "  mismatched pixels: " << diff.mismatched << " (" << diff.outliers << " beyond tolerance)" << std::endl;
+    std::cout << "  PSNR: " << diff.psnr << " dB, SSIM: " << diff.ssim << std::endl;
+    std::cout << "  bit-identical: " << (diff.identical() ? "yes" : "no") << std::endl;
+}
+
+void render_reference(int w, int h, std::vector<Object*> &scene, cv::Mat &img) {
+    for (int i = 0; i < w; ++i) {
+        for (int j = 0; j < h; ++j) {
+            vec3 color = trace_pixel(i, j, w, h, scene);
+            img.at<cv::Vec3f>(h - j - 1, i) = cv::Vec3f(color.x, color.y, color.z);
+        }
+    }
+}
+
 void* renderThread(void* arg) {
     ThreadData* data = static_cast<ThreadData*>(arg);
     data->startTime = std::chrono::high_resolution_clock::now();
-    
-    float r = float(data->width) / data->height;
-    glm::vec4 S = glm::vec4(-1., -1. / r + .25, 1., 1. / r + .25);
-    vec3 Q = vec3(0., 0., 0.);
 
     for (int i = 0; i < data->width; ++i) {
         for (int j = data->startRow; j < data->endRow; ++j) {
-            Q.x = S.x + i * (S.z - S.x) / (data->width - 1);
-            Q.y = S.y + j * (S.w - S.y) / (data->height - 1);
-            vec3 color = intersect_color(O, normalizes(Q - O), 1, *data->scene);
+            vec3 color = trace_pixel(i, j, data->width, data->height, *data->scene);
             data->image.at<cv::Vec3f>(data->height - j - 1, i) = cv::Vec3f(color.x, color.y, color.z);
         }
     }
@@ -166,10 +336,7 @@ void* renderThread(void* arg) {
     pthread_exit(nullptr);
 }
 
-void rendering(int w, int h, std::vector<Object*> &scene, std::string filename, int numThreads) {
-    cv::Mat img(h, w, CV_32FC3);
-    //int numThreads = 3;  // Change the number of threads as needed
-
+void render_image(int w, int h, std::vector<Object*> &scene, cv::Mat &img, int numThreads) {
     pthread_t threads[numThreads];
     ThreadData threadData[numThreads];
 
@@ -177,7 +344,8 @@ void rendering(int w, int h, std::vector<Object*> &scene, std::string filename,
         threadData[i].width = w;
         threadData[i].height = h;
         threadData[i].startRow = i * (h / numThreads);
-        threadData[i].endRow = (i + 1) * (h / numThreads);
+        // The last thread also takes the h % numThreads leftover rows
+        threadData[i].endRow = (i == numThreads - 1) ? h : (i + 1) * (h / numThreads);
         threadData[i].scene = &scene;
         threadData[i].image = img;
 
@@ -189,7 +357,11 @@ void rendering(int w, int h, std::vector<Object*> &scene, std::string filename,
         auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(threadData[i].endTime - threadData[i].startTime).count();
         std::cout << "Thread " << i << " execution time: " << duration << " milliseconds" << std::endl;
     }
+}
 
+void rendering(int w, int h, std::vector<Object*> &scene, std::string filename, int numThreads) {
+    cv::Mat img(h, w, CV_32FC3);
+    render_image(w, h, scene, img, numThreads);
     img *= 255;
     img.convertTo(img, CV_8UC3);
     cv::imwrite(filename, img);
@@ -0,0 +1,78 @@
+# include "aov.h"
+# include "encode.h"
+
+# include <iostream>
+# include <sstream>
+
+unsigned aov_mask = 0;
+
+static const struct {
+    const char* name;
+    unsigned flag;
+} aov_names[] = {
+    {"depth", AOV_DEPTH},
+    {"normal", AOV_NORMAL},
+    {"id", AOV_ID},
+    {"albedo", AOV_ALBEDO},
+    {"shadow", AOV_SHADOW},
+    {"reflection", AOV_REFLECTION},
+};
+
+bool parse_aovs(const std::string &list, unsigned &mask) {
+    if (list == "all") {
+        mask = AOV_ALL;
+        return true;
+    }
+    unsigned selected = 0;
+    std::istringstream names(list);
+    std::string name;
+    while (std::getline(names, name, ',')) {
+        unsigned flag = 0;
+        for (const auto &aov : aov_names) {
+            if (name == aov.name) flag = aov.flag;
+        }
+        if (!flag) return false;
+        selected |= flag;
+    }
+    if (!selected) return false;
+    mask = selected;
+    return true;
+}
+
+void AovBuffers::create(int rows, int cols, unsigned mask) {
+    if (mask & AOV_DEPTH) depth.create(rows, cols, CV_32FC1);
+    if (mask & AOV_NORMAL) normal.create(rows, cols, CV_32FC3);
+    if (mask & AOV_ID) id.create(rows, cols, CV_32FC1);
+    if (mask & AOV_ALBEDO) albedo.create(rows, cols, CV_32FC3);
+    if (mask & AOV_SHADOW) shadow.create(rows, cols, CV_32FC1);
+    if (mask & AOV_REFLECTION) reflection.create(rows, cols, CV_32FC3);
+}
+
+void AovBuffers::store(int row, int col, const AovSample &sample) {
+    // Colors go in like the image's; the normal is reversed so that write_pfm,
+    // which swaps BGR to RGB, puts x in R
+    if (!depth.empty()) depth.at<float>(row, col) = sample.depth;
+    if (!normal.empty()) normal.at<cv::Vec3f>(row, col) = cv::Vec3f(sample.normal.z, sample.normal.y, sample.normal.x);
+    if (!id.empty()) id.at<float>(row, col) = sample.id;
+    if (!albedo.empty()) albedo.at<cv::Vec3f>(row, col) = cv::Vec3f(sample.albedo.x, sample.albedo.y, sample.albedo.z);
+    if (!shadow.empty()) shadow.at<float>(row, col) = sample.shadow;
+    if (!reflection.empty()) {
+        reflection.at<cv::Vec3f>(row, col) = cv::Vec3f(sample.reflection.x, sample.reflection.y, sample.reflection.z);
+    }
+}
+
+bool AovBuffers::save(const std::string &filename) const {
+    const std::string ext = file_extension(filename);
+    const std::string stem = ext.empty() ? filename : filename.substr(0, filename.size() - ext.size() - 1);
+    const cv::Mat* buffers[] = {&depth, &normal, &id, &albedo, &shadow, &reflection};
+    bool ok = true;
+    for (size_t k = 0; k < sizeof buffers / sizeof buffers[0]; ++k) {
+        if (buffers[k]->empty()) continue;
+        const std::string path = stem + "." + aov_names[k].name + ".pfm";
+        if (!write_pfm(*buffers[k], path)) {
+            std::cerr << "Error: Could not write " << path << std::endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
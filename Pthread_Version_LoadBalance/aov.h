@@ -0,0 +1,59 @@
+#ifndef AOV_H
+#define AOV_H
+
+# include <glm/glm.hpp>
+# include <opencv2/opencv.hpp>
+# include <limits>
+# include <string>
+
+/* Arbitrary output variables (--aov): per-pixel data of the primary hit,
+   recorded while the color is traced, so they cost no extra rays:
+
+     depth       distance along the primary ray, infinity on a miss
+     normal      world-space unit normal, x y z in the R G B channels
+     id          index of the object in the scene + 1, 0 for background
+     albedo      surface color before lighting
+     shadow      1 where the light is blocked, else 0
+     reflection  the reflection term added to the color, before the clamp
+
+   The buffers have the size and row order of the color framebuffer and are
+   written next to the image as <name>.<aov>.pfm: single-channel ones as
+   grayscale Pf, the others as RGB PF. */
+
+enum AovFlag {
+    AOV_DEPTH = 1,
+    AOV_NORMAL = 2,
+    AOV_ID = 4,
+    AOV_ALBEDO = 8,
+    AOV_SHADOW = 16,
+    AOV_REFLECTION = 32,
+    AOV_ALL = 63
+};
+
+// Selected AOVs, 0 renders color only
+extern unsigned aov_mask;
+
+// Parses a comma-separated list of the names above, or "all"
+bool parse_aovs(const std::string &list, unsigned &mask);
+
+struct AovSample {
+    float depth = std::numeric_limits<float>::infinity();
+    glm::vec3 normal = glm::vec3(0.);
+    float id = 0.f;
+    glm::vec3 albedo = glm::vec3(0.);
+    float shadow = 0.f;
+    glm::vec3 reflection = glm::vec3(0.);
+};
+
+struct AovBuffers {
+    cv::Mat depth, normal, id, albedo, shadow, reflection;  // empty unless selected
+
+    void create(int rows, int cols, unsigned mask);
+    void store(int row, int col, const AovSample &sample);
+
+    // Writes every selected buffer next to filename. Returns false if one
+    // could not be written.
+    bool save(const std::string &filename) const;
+};
+
+#endif // AOV_H
@@ -0,0 +1,345 @@
+# include <iostream>
+# include <iomanip>
+# include <string>
+# include <vector>
+# include <chrono>
+# include <random>
+# include <limits>
+# include <cmath>
+# include <cstdio>
+# include "graph.h"
+# include "mesh.h"
+# include "primitive_scene.h"
+# include "isa.h"
+# include "texture.h"
+
+/* Kernel microbenchmarks: each kernel runs over a fixed batch of rays and
+   reports ns per call. Results are accumulated into a sink so the compiler
+   cannot drop the calls. */
+
+struct Ray {
+    vec3 origin;
+    vec3 dir;
+};
+
+static volatile float sink;
+
+// Rays from random points around the scene in uniformly random directions
+static std::vector<Ray> random_rays(size_t n, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> pos(-3.f, 3.f), unit(-1.f, 1.f);
+    std::vector<Ray> rays(n);
+    for (auto &ray : rays) {
+        ray.origin = vec3(pos(rng), pos(rng) * .5f + .5f, pos(rng));
+        vec3 d;
+        do {
+            d = vec3(unit(rng), unit(rng), unit(rng));
+        } while (glm::dot(d, d) > 1.f || glm::dot(d, d) < 1e-4f);
+        ray.dir = glm::normalize(d);
+    }
+    return rays;
+}
+
+// Primary rays of a w x h image, in scanline order
+static std::vector<Ray> coherent_rays(int w, int h) {
+    std::vector<Ray> rays;
+    rays.reserve(size_t(w) * h);
+    float r = float(w) / h;
+    glm::vec4 S = glm::vec4(-1., -1. / r + .25, 1., 1. / r + .25);
+    for (int j = 0; j < h; ++j) {
+        for (int i = 0; i < w; ++i) {
+            vec3 Q = vec3(S.x + i * (S.z - S.x) / (w - 1), S.y + j * (S.w - S.y) / (h - 1), 0.);
+            rays.push_back({O, glm::normalize(Q - O)});
+        }
+    }
+    return rays;
+}
+
+// A hit point with the data the shading kernels need
+struct Hit {
+    vec3 origin;
+    vec3 dir;
+    vec3 P;
+    vec3 N;
+    size_t obj_index;
+};
+
+// Runs f over every input `repeat` times and returns ns per call
+template <class T, class F>
+static double ns_per_call(const std::vector<T> &inputs, int repeat, F f) {
+    float acc = 0.f;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int k = 0; k < repeat; ++k) {
+        for (const T &input : inputs) {
+            acc += f(input);
+        }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    sink = acc;
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    return ns / (double(inputs.size()) * repeat);
+}
+
+static void report(const std::string &name, const std::string &rays, double ns) {
+    std::cout << std::left << std::setw(30) << name << std::setw(10) << rays
+              << std::right << std::fixed << std::setprecision(2) << std::setw(9) << ns << " ns/op"
+              << std::setw(10) << std::setprecision(1) << 1e3 / ns << " M/s" << std::endl;
+}
+
+// Closest hit of every ray that hits something, as intersect_color finds it
+static std::vector<Hit> closest_hits(const std::vector<Ray> &rays, std::vector<Object*> &scene) {
+    std::vector<Hit> hits;
+    for (const Ray &ray : rays) {
+        float min_distance = std::numeric_limits<float>::infinity();
+        size_t obj_index = 0;
+        for (size_t i = 0; i < scene.size(); ++i) {
+            float d = scene[i]->intersect(ray.origin, ray.dir);
+            if (d < min_distance) {
+                min_distance = d;
+                obj_index = i;
+            }
+        }
+        if (min_distance == std::numeric_limits<float>::infinity()) continue;
+        vec3 P = ray.origin + ray.dir * min_distance;
+        hits.push_back({ray.origin, ray.dir, P, scene[obj_index]->get_normal(P), obj_index});
+    }
+    return hits;
+}
+
+// The ray-sphere test before precomputed radius^2 and the half-b form.
+// Kept out of line like Sphere::intersect so the comparison is fair.
+__attribute__((noinline))
+static float legacy_sphere_intersect(const Sphere &s, const vec3 &origin, const vec3 &dir) {
+    vec3 OC = s.position - origin;
+    if (glm::length(OC) < s.radius || glm::dot(OC, dir) < 0) return std::numeric_limits<float>::infinity();
+    float l = glm::length(glm::dot(OC, dir));
+    float m_square = glm::length(OC) * glm::length(OC) - l * l;
+    float q_square = s.radius * s.radius - m_square;
+    return (q_square >= 0) ? (l - std::sqrt(q_square)) : std::numeric_limits<float>::infinity();
+}
+
+// Tessellated sphere with per-vertex normals, 2 * rings * segments triangles
+static MeshData uv_sphere(const vec3 &center, float radius, int rings, int segments) {
+    MeshData mesh;
+    for (int r = 0; r <= rings; ++r) {
+        float theta = float(M_PI) * r / rings;
+        for (int s = 0; s <= segments; ++s) {
+            float phi = 2.f * float(M_PI) * s / segments;
+            vec3 n(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+            mesh.positions.push_back(center + n * radius);
+            mesh.normals.push_back(n);
+        }
+    }
+    for (int r = 0; r < rings; ++r) {
+        for (int s = 0; s < segments; ++s) {
+            uint32_t a = r * (segments + 1) + s, b = a + segments + 1;
+            uint32_t quad[6] = {a, b, a + 1, a + 1, b, b + 1};
+            mesh.indices.insert(mesh.indices.end(), quad, quad + 6);
+        }
+    }
+    mesh.normal_indices = mesh.indices;
+    return mesh;
+}
+
+// Misses return infinity; count hits instead of summing distances
+static float hit(float t) { return t < std::numeric_limits<float>::infinity() ? 1.f : 0.f; }
+
+int main(int argc, char *argv[]) {
+    int repeat = 20;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-r" && i + 1 < argc) {
+            repeat = std::stoi(argv[++i]);
+        }
+        else if (arg == "--precision" && i + 1 < argc) {
+            if (!parse_precision(argv[++i], precision)) {
+                std::cerr << "Error: --precision must be exact, fast or approx." << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else if (arg == "--isa" && i + 1 < argc) {
+            if (!parse_isa(argv[++i], isa) || !isa_supported(isa)) {
+                std::cerr << "Error: --isa must be auto, baseline, sse4.2, avx2 or avx512, and supported by this CPU." << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    // Same scene as main.cpp
+    std::vector<Object*> scene = {
+        new Sphere(vec3(.75, .1, 1.), .6, vec3(.8, .3, 0.)),
+        new Sphere(vec3(-.3, .01, .2), .3, vec3(.0, .0, .9)),
+        new Sphere(vec3(-2.75, .1, 3.5), .6, vec3(.1, .572, .184)),
+        new Sphere(vec3(.0, 1., 3.5), .6, vec3(.580, .082, .666)),
+        new CheckerboardPlane(vec3(0., -.5, 0.), vec3(0., 1., 0.), vec3(1., 1., 1.), vec3(0., 0., 0.), 0.2)
+    };
+    Sphere &sphere = *static_cast<Sphere*>(scene[0]);
+    // Same placement as the first sphere, so hit rates are comparable
+    std::shared_ptr<Object> mesh_ptr = std::make_shared<TriangleMesh>(
+        std::make_shared<const TriangleGeometry>(uv_sphere(vec3(0.), sphere.radius, 64, 128)), sphere.color);
+    TriangleMesh &mesh = *static_cast<TriangleMesh*>(mesh_ptr.get());
+    // The mesh is built around the origin and placed by the instance, so the
+    // two mesh lines differ only by the object-space transform
+    Instance instance(mesh_ptr, Transform::translate(sphere.position) * Transform::rotate(.5f, vec3(0., 1., 0.)));
+    CheckerboardPlane &plane = *static_cast<CheckerboardPlane*>(scene.back());
+    PrimitiveScene primitives(scene);
+    const Shader shader = select_shader(scene);
+
+    // 2048^2 tiled texture for the image texture lines. The file is removed
+    // as soon as it is open (tiles are read through the descriptor), so no
+    // exit path leaves it behind.
+    const std::string texture_file = "raytracing_bench.ttex";
+    cv::Mat texture_image(2048, 2048, CV_8UC3);
+    for (int row = 0; row < texture_image.rows; ++row) {
+        unsigned char* p = texture_image.ptr<unsigned char>(row);
+        for (int col = 0; col < texture_image.cols; ++col, p += 3) {
+            p[0] = (unsigned char)(col / 8);
+            p[1] = (unsigned char)(row / 8);
+            p[2] = (unsigned char)((row ^ col) & 255);
+        }
+    }
+    if (!write_tiled_texture(texture_image, texture_file)) {
+        std::remove(texture_file.c_str());
+        return EXIT_FAILURE;
+    }
+    std::shared_ptr<TiledImage> tiled = TiledImage::open(texture_file, texture_cache);
+    std::remove(texture_file.c_str());
+    if (!tiled) return EXIT_FAILURE;
+    const ImageTexture image_texture(tiled, plane.position, vec3(1., 0., 0.), vec3(0., 0., -1.), 1.f);
+
+    std::vector<std::pair<std::string, std::vector<Ray>>> sets;
+    sets.emplace_back("random", random_rays(1 << 16, 1));
+    sets.emplace_back("coherent", coherent_rays(256, 256));
+
+    std::cout << "precision: " << (precision == PRECISION_EXACT ? "exact" : precision == PRECISION_FAST ? "fast" : "approx")
+              << ", " << isa_name(isa) << " kernels, " << repeat << " repeats" << std::endl;
+    for (auto &set : sets) {
+        const std::vector<Ray> &rays = set.second;
+        std::vector<Hit> hits = closest_hits(rays, scene);
+        std::vector<vec3> plane_points;
+        for (const Hit &h : hits) {
+            if (scene[h.obj_index] == &plane) plane_points.push_back(h.P);
+        }
+
+        report("Sphere::intersect", set.first, ns_per_call(rays, repeat, [&](const Ray &ray) {
+            return hit(sphere.intersect(ray.origin, ray.dir));
+        }));
+        report("Sphere::intersect (legacy)", set.first, ns_per_call(rays, repeat, [&](const Ray &ray) {
+            return hit(legacy_sphere_intersect(sphere, ray.origin, ray.dir));
+        }));
+        report("TriangleMesh::intersect", set.first, ns_per_call(rays, repeat, [&](const Ray &ray) {
+            return hit(mesh.intersect(ray.origin - sphere.position, ray.dir));
+        }));
+        report("Instance::intersect (mesh)", set.first, ns_per_call(rays, repeat, [&](const Ray &ray) {
+            return hit(instance.intersect(ray.origin, ray.dir));
+        }));
+        report("Plane::intersect", set.first, ns_per_call(rays, repeat, [&](const Ray &ray) {
+            return hit(plane.intersect(ray.origin, ray.dir));
+        }));
+        report("CheckerboardPlane::get_color", set.first, ns_per_call(plane_points, repeat, [&](const vec3 &P) {
+            return plane.get_color(P).x;
+        }));
+        // Point at a time as the recursive renderer shades, and in batches
+        // as the wavefront renderer does
+        std::vector<float> px, py, pz, pr(plane_points.size()), pg(plane_points.size()), pb(plane_points.size());
+        for (const vec3 &P : plane_points) {
+            px.push_back(P.x);
+            py.push_back(P.y);
+            pz.push_back(P.z);
+        }
+        for (const char* name : {"perlin", "marble", "baked"}) {
+            std::shared_ptr<const Texture> texture = make_texture(name, vec3(.8, .3, 0.));
+            report(std::string("Texture::color (") + name + ")", set.first, ns_per_call(plane_points, repeat, [&](const vec3 &P) {
+                return texture->color(P).x;
+            }));
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int k = 0; k < repeat; ++k) {
+                texture->colors(px.data(), py.data(), pz.data(), px.size(), pr.data(), pg.data(), pb.data());
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+            sink = pr[0];
+            report(std::string("Texture::colors (") + name + ")", set.first,
+                   std::chrono::duration<double, std::nano>(end - start).count() / (double(px.size()) * repeat));
+        }
+        // Cold cache each time: a budget large enough for every tile the
+        // hits touch, and one that keeps evicting; with the footprints of a
+        // 256-wide frame, and at full resolution (pixel_spread 0)
+        for (int mips = 1; mips >= 0; --mips) {
+            for (int megabytes : {64, 1}) {
+                if (mips) set_pixel_spread(256);
+                else pixel_spread = 0.f;
+                texture_cache.set_budget(size_t(megabytes) << 20);
+                const uint64_t reads = texture_cache.reads();
+                auto start = std::chrono::high_resolution_clock::now();
+                for (int k = 0; k < repeat; ++k) {
+                    image_texture.colors(px.data(), py.data(), pz.data(), px.size(), pr.data(), pg.data(), pb.data());
+                }
+                auto end = std::chrono::high_resolution_clock::now();
+                sink = pr[0];
+                report(std::string(mips ? "ImageTexture" : "ImageTexture level 0") + ", " + std::to_string(megabytes) + " MB", set.first,
+                       std::chrono::duration<double, std::nano>(end - start).count() / (double(px.size()) * repeat));
+                std::cout << "  " << texture_cache.reads() - reads << " tiles read" << std::endl;
+            }
+        }
+        report("in_shadow", set.first, ns_per_call(hits, repeat, [&](const Hit &h) {
+            return in_shadow(h.P, h.N, normalizes(light_point - h.P), h.obj_index, scene) ? 1.f : 0.f;
+        }));
+        report("closest hit (virtual)", set.first, ns_per_call(rays, repeat, [&](const Ray &ray) {
+            float min_distance = std::numeric_limits<float>::infinity();
+            for (size_t i = 0; i < scene.size(); ++i) {
+                min_distance = std::min(min_distance, scene[i]->intersect(ray.origin, ray.dir));
+            }
+            return hit(min_distance);
+        }));
+        report("closest hit (static)", set.first, ns_per_call(rays, repeat, [&](const Ray &ray) {
+            float distance;
+            size_t index;
+            HitRecord record;
+            primitives.closest(ray.origin, ray.dir, distance, index, record);
+            return hit(distance);
+        }));
+        report("intersect_color", set.first, ns_per_call(rays, repeat, [&](const Ray &ray) {
+            return intersect_color(ray.origin, ray.dir, 1, scene).x;
+        }));
+        report("intersect_color (static)", set.first, ns_per_call(rays, repeat, [&](const Ray &ray) {
+            return intersect_color(ray.origin, ray.dir, 1, primitives).x;
+        }));
+        report("intersect_color (specialized)", set.first, ns_per_call(rays, repeat, [&](const Ray &ray) {
+            return shader.shade(ray.origin, ray.dir, scene, nullptr).x;
+        }));
+        report("intersect_color (spec., static)", set.first, ns_per_call(rays, repeat, [&](const Ray &ray) {
+            return shader.shade_static(ray.origin, ray.dir, primitives, nullptr).x;
+        }));
+    }
+
+    // Framebuffer conversion done at the end of rendering(), per pixel
+    cv::Mat img(1024, 1024, CV_32FC3), tmp, out;
+    for (int row = 0; row < img.rows; ++row) {
+        for (int col = 0; col < img.cols; ++col) {
+            img.at<cv::Vec3f>(row, col) = cv::Vec3f(row / 1024.f, col / 1024.f, .5f);
+        }
+    }
+    double tonemap_ns = 0.;
+    for (int k = 0; k < repeat; ++k) {
+        img.copyTo(tmp);
+        auto start = std::chrono::high_resolution_clock::now();
+        tmp *= 255;
+        tmp.convertTo(out, CV_8UC3);
+        auto end = std::chrono::high_resolution_clock::now();
+        tonemap_ns += std::chrono::duration<double, std::nano>(end - start).count();
+    }
+    report("tonemap + convertTo", "1024^2", tonemap_ns / (double(img.total()) * repeat));
+    tonemap_ns = 0.;
+    for (int k = 0; k < repeat; ++k) {
+        auto start = std::chrono::high_resolution_clock::now();
+        isa_kernels().tonemap(img, out);
+        auto end = std::chrono::high_resolution_clock::now();
+        tonemap_ns += std::chrono::duration<double, std::nano>(end - start).count();
+    }
+    report("tonemap (kernel)", "1024^2", tonemap_ns / (double(img.total()) * repeat));
+
+    for (auto obj : scene) {
+        delete obj;
+    }
+    return 0;
+}
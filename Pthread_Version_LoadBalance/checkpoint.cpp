@@ -0,0 +1,119 @@
+# include "checkpoint.h"
+# include "graph.h"
+
+# include <cerrno>
+# include <cstring>
+# include <iostream>
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+
+CheckpointConfig checkpointing;
+
+static const char CHECKPOINT_MAGIC[8] = {'R', 'T', 'C', 'K', 'P', 'T', '1', '\0'};
+
+struct CheckpointHeader {
+    char magic[8];
+    int32_t width;
+    int32_t height;
+    int32_t precision;
+    int32_t reserved;
+    uint64_t scene;
+};
+
+// The framebuffer starts on a cache line after the row flags
+static size_t pixels_offset(int h) {
+    return (sizeof(CheckpointHeader) + size_t(h) + 63) & ~size_t(63);
+}
+
+uint64_t scene_hash(const std::string &description) {
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : description) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+Checkpoint::~Checkpoint() {
+    close();
+}
+
+bool Checkpoint::open(const std::string &path, int w, int h, bool resume) {
+    close();
+    CheckpointHeader header;
+    std::memcpy(header.magic, CHECKPOINT_MAGIC, sizeof header.magic);
+    header.width = w;
+    header.height = h;
+    header.precision = int32_t(precision);
+    header.reserved = 0;
+    header.scene = checkpointing.scene;
+    const size_t size = pixels_offset(h) + size_t(w) * h * 3 * sizeof(float);
+
+    bool reuse = false;
+    int fd = -1;
+    if (resume) {
+        fd = ::open(path.c_str(), O_RDWR);
+        if (fd >= 0) {
+            struct stat st;
+            CheckpointHeader found;
+            if (fstat(fd, &st) != 0 || pread(fd, &found, sizeof found, 0) != ssize_t(sizeof found)
+                || std::memcmp(&found, &header, sizeof header) != 0 || size_t(st.st_size) != size) {
+                std::cerr << "Error: " << path << " is not a checkpoint of this frame; "
+                          << "delete it or run without --resume." << std::endl;
+                ::close(fd);
+                return false;
+            }
+            reuse = true;
+        }
+    }
+    if (!reuse) {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, off_t(size)) != 0) {
+            std::cerr << "Error: Could not create " << path << ": " << std::strerror(errno) << std::endl;
+            if (fd >= 0) ::close(fd);
+            return false;
+        }
+    }
+
+    void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        std::cerr << "Error: Could not map " << path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    path_ = path;
+    base_ = base;
+    size_ = size;
+    height_ = h;
+    rows_ = static_cast<unsigned char*>(base) + sizeof(CheckpointHeader);
+    pixels_ = reinterpret_cast<float*>(static_cast<char*>(base) + pixels_offset(h));
+    if (!reuse) std::memcpy(base, &header, sizeof header);
+    return true;
+}
+
+int Checkpoint::rows_done() const {
+    int done = 0;
+    for (int row = 0; row < height_; ++row) {
+        done += rows_[row] != 0;
+    }
+    return done;
+}
+
+void Checkpoint::sync() {
+    if (base_) msync(base_, size_, MS_SYNC);
+}
+
+void Checkpoint::remove() {
+    if (!base_) return;
+    close();
+    unlink(path_.c_str());
+}
+
+void Checkpoint::close() {
+    if (base_) munmap(base_, size_);
+    base_ = nullptr;
+    rows_ = nullptr;
+    pixels_ = nullptr;
+}
@@ -0,0 +1,65 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+# include <cstdint>
+# include <string>
+
+/* Checkpoint of a frame being rendered, kept in a memory-mapped file next to
+   the output (filename + ".ckpt"):
+
+     header | one done flag per row | w x h x 3 float framebuffer
+
+   The renderer writes pixels straight into the mapping and sets a row's flag
+   once the row is complete. The mapping is shared, so everything stored
+   before the process is killed is in the page cache and survives it; the file
+   is also synced every interval seconds so that a lost node costs at most
+   that much work. The checkpoint is deleted once the image is written. */
+
+struct CheckpointConfig {
+    bool enabled = false;   // --checkpoint
+    bool resume = false;    // --resume: reuse a matching checkpoint
+    int interval = 30;      // seconds between syncs to disk
+    uint64_t scene = 0;     // hash of the scene options, see scene_hash
+};
+
+extern CheckpointConfig checkpointing;
+
+// FNV-1a hash of a description of the scene; a checkpoint is only resumed
+// with the scene it was made with.
+uint64_t scene_hash(const std::string &description);
+
+class Checkpoint {
+public:
+    Checkpoint() = default;
+    ~Checkpoint();
+    Checkpoint(const Checkpoint&) = delete;
+    Checkpoint& operator=(const Checkpoint&) = delete;
+
+    // Maps path for a w x h frame. With resume, an existing checkpoint made
+    // for the same size, precision and scene is reused and must match;
+    // otherwise a new one is started. Prints an error and returns false on
+    // failure.
+    bool open(const std::string &path, int w, int h, bool resume);
+
+    float* pixels() const { return pixels_; }
+    unsigned char* rows() const { return rows_; }
+    int rows_done() const;
+
+    // Writes the dirty pages back to the file and waits for them
+    void sync();
+
+    // Unmaps and deletes the file
+    void remove();
+
+private:
+    std::string path_;
+    void* base_ = nullptr;
+    size_t size_ = 0;
+    int height_ = 0;
+    unsigned char* rows_ = nullptr;
+    float* pixels_ = nullptr;
+
+    void close();
+};
+
+#endif // CHECKPOINT_H
@@ -0,0 +1,541 @@
+# include "daemon.h"
+# include "scene.h"
+
+# include <atomic>
+# include <cerrno>
+# include <cstdio>
+# include <chrono>
+# include <cstdlib>
+# include <cstring>
+# include <iostream>
+# include <map>
+# include <memory>
+# include <set>
+# include <sstream>
+# include <poll.h>
+# include <pthread.h>
+# include <sys/socket.h>
+# include <sys/un.h>
+# include <unistd.h>
+
+enum JobState {
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_CANCELLED,
+    JOB_FAILED
+};
+
+struct Job {
+    int id;
+    int priority;
+    int width;
+    int height;
+    vec3 camera;
+    Precision tier;
+    std::string output;
+    std::string sceneName;
+    std::vector<Object*>* scene;
+    JobState state;
+    std::string error;      // reason of JOB_FAILED
+    std::atomic<bool> cancel;
+    long milliseconds;
+};
+
+// Render threads parked on a condition variable between jobs
+class RenderPool {
+public:
+    void start(int numThreads);
+
+    // Renders job into img on every thread; returns once all rows are done
+    // or the job has been cancelled
+    void run(Job &job, cv::Mat &img);
+
+    void stop();
+
+private:
+    static void* worker(void* arg);
+
+    std::vector<pthread_t> threads;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+    pthread_cond_t idle = PTHREAD_COND_INITIALIZER;
+    Job* job = nullptr;
+    cv::Mat* image = nullptr;
+    const PixelTracer* tracer = nullptr;
+    alignas(64) std::atomic<int> next{0};
+    int busy = 0;
+    unsigned generation = 0;
+    bool stopping = false;
+};
+
+void RenderPool::start(int numThreads) {
+    threads.resize(numThreads);
+    for (pthread_t &thread : threads) {
+        pthread_create(&thread, nullptr, worker, this);
+    }
+}
+
+void RenderPool::run(Job &j, cv::Mat &img) {
+    const PixelTracer jobTracer(*j.scene);
+    pthread_mutex_lock(&lock);
+    job = &j;
+    image = &img;
+    tracer = &jobTracer;
+    next.store(0);
+    busy = int(threads.size());
+    ++generation;
+    pthread_cond_broadcast(&wake);
+    while (busy > 0) pthread_cond_wait(&idle, &lock);
+    pthread_mutex_unlock(&lock);
+}
+
+void RenderPool::stop() {
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&wake);
+    pthread_mutex_unlock(&lock);
+    for (pthread_t thread : threads) {
+        pthread_join(thread, nullptr);
+    }
+    threads.clear();
+}
+
+void* RenderPool::worker(void* arg) {
+    RenderPool* pool = static_cast<RenderPool*>(arg);
+    unsigned seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (pool->generation == seen && !pool->stopping) pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->stopping) break;
+        seen = pool->generation;
+        Job* job = pool->job;
+        cv::Mat* img = pool->image;
+        const PixelTracer* tracer = pool->tracer;
+        pthread_mutex_unlock(&pool->lock);
+
+        const int w = job->width, h = job->height;
+        while (!job->cancel.load(std::memory_order_relaxed)) {
+            int row = pool->next.fetch_add(1, std::memory_order_relaxed);
+            if (row >= h) break;
+            for (int i = 0; i < w; ++i) {
+                vec3 color = tracer->trace(i, row, w, h);
+                img->at<cv::Vec3f>(h - row - 1, i) = cv::Vec3f(color.x, color.y, color.z);
+            }
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0) pthread_cond_signal(&pool->idle);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return nullptr;
+}
+
+/* Daemon state, guarded by lock; the scene cache has its own lock so a
+   mesh being loaded does not hold up status queries */
+
+struct Daemon {
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+    std::map<int, std::shared_ptr<Job>> jobs;
+    std::vector<std::shared_ptr<Job>> queue;
+    std::set<int> connections;
+    int nextId = 1;
+    bool stopping = false;
+
+    pthread_mutex_t scenesLock = PTHREAD_MUTEX_INITIALIZER;
+    std::map<std::string, std::vector<Object*>> scenes;
+    std::vector<Object*>* defaultScene = nullptr;
+    vec3 camera;            // defaults for jobs: the daemon's own settings
+    Precision tier;
+    int numThreads = 1;
+
+    RenderPool pool;
+};
+
+// Finished jobs kept for status queries
+static const size_t MAX_FINISHED_JOBS = 4096;
+
+// Largest job a client may submit: a side of 16384 and 64 Mpixels, whose
+// float framebuffer alone is 768 MB; and 65536 mesh instances
+static const int MAX_JOB_SIDE = 16384;
+static const long MAX_JOB_PIXELS = 64l << 20;
+static const int MAX_JOB_INSTANCES = 65536;
+
+static bool finished(JobState state) {
+    return state == JOB_DONE || state == JOB_CANCELLED || state == JOB_FAILED;
+}
+
+// Call with daemon.lock held
+static std::string describe(const Job &job) {
+    const std::string id = std::to_string(job.id);
+    switch (job.state) {
+        case JOB_QUEUED: return "queued " + id;
+        case JOB_RUNNING: return "running " + id;
+        case JOB_DONE: return "done " + id + " " + std::to_string(job.milliseconds);
+        case JOB_CANCELLED: return "cancelled " + id;
+        case JOB_FAILED: return "failed " + id + " " + job.error;
+    }
+    return "error";
+}
+
+static void prune_jobs(Daemon &daemon) {
+    size_t done = 0;
+    for (auto &entry : daemon.jobs) done += finished(entry.second->state);
+    for (auto it = daemon.jobs.begin(); it != daemon.jobs.end() && done > MAX_FINISHED_JOBS;) {
+        if (finished(it->second->state)) {
+            it = daemon.jobs.erase(it);
+            --done;
+        } else {
+            ++it;
+        }
+    }
+}
+
+static void* schedulerThread(void* arg) {
+    Daemon &daemon = *static_cast<Daemon*>(arg);
+    pthread_mutex_lock(&daemon.lock);
+    while (true) {
+        while (daemon.queue.empty() && !daemon.stopping) pthread_cond_wait(&daemon.changed, &daemon.lock);
+        if (daemon.queue.empty()) break;
+
+        // Highest priority, then oldest
+        auto best = daemon.queue.begin();
+        for (auto it = daemon.queue.begin(); it != daemon.queue.end(); ++it) {
+            if ((*it)->priority > (*best)->priority) best = it;
+        }
+        std::shared_ptr<Job> job = *best;
+        daemon.queue.erase(best);
+        job->state = JOB_RUNNING;
+        pthread_cond_broadcast(&daemon.changed);
+        pthread_mutex_unlock(&daemon.lock);
+
+        // The pool is idle, so the camera and precision globals are ours
+        O = job->camera;
+        set_pixel_spread(job->width);
+        precision = job->tier;
+        auto start = std::chrono::high_resolution_clock::now();
+        JobState state = JOB_CANCELLED;
+        std::string error;
+        try {
+            cv::Mat img(job->height, job->width, CV_32FC3);
+            daemon.pool.run(*job, img);
+            if (!job->cancel.load()) {
+                state = save_image(img, job->output) ? JOB_DONE : JOB_FAILED;
+                if (state == JOB_FAILED) error = "could not write " + job->output;
+            }
+        } catch (const std::exception&) {
+            // Out of memory for the framebuffer or the encoder: fail the
+            // job, not the daemon and the jobs queued behind it
+            state = JOB_FAILED;
+            error = "out of memory";
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+
+        pthread_mutex_lock(&daemon.lock);
+        job->state = state;
+        job->error = error;
+        job->milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+        std::cout << "Job " << job->id << " (" << job->width << "x" << job->height << ", scene " << job->sceneName
+                  << ", priority " << job->priority << "): " << describe(*job) << std::endl;
+        prune_jobs(daemon);
+        pthread_cond_broadcast(&daemon.changed);
+    }
+    pthread_mutex_unlock(&daemon.lock);
+    return nullptr;
+}
+
+/* Commands */
+
+static bool parse_camera(const std::string &text, vec3 &camera) {
+    char tail;
+    return std::sscanf(text.c_str(), "%f,%f,%f%c", &camera.x, &camera.y, &camera.z, &tail) == 3;
+}
+
+// The scene a job names, loaded on first use
+static std::vector<Object*>* find_scene(Daemon &daemon, const std::string &name, int instances) {
+    if (name == "default") return daemon.defaultScene;
+    const std::string key = name + "#" + std::to_string(instances);
+    pthread_mutex_lock(&daemon.scenesLock);
+    auto it = daemon.scenes.find(key);
+    if (it == daemon.scenes.end()) {
+        std::vector<Object*> scene;
+        if (build_scene(name, instances, daemon.numThreads, scene)) {
+            it = daemon.scenes.emplace(key, scene).first;
+        } else {
+            delete_scene(scene);
+        }
+    }
+    std::vector<Object*>* scene = it == daemon.scenes.end() ? nullptr : &it->second;
+    pthread_mutex_unlock(&daemon.scenesLock);
+    return scene;
+}
+
+static std::string submit(Daemon &daemon, std::istringstream &args) {
+    std::shared_ptr<Job> job = std::make_shared<Job>();
+    job->priority = 0;
+    job->width = 640;
+    job->height = 480;
+    job->camera = daemon.camera;
+    job->tier = daemon.tier;
+    job->sceneName = "default";
+    job->state = JOB_QUEUED;
+    job->cancel.store(false);
+    job->milliseconds = 0;
+    int instances = 1;
+
+    std::string arg;
+    try {
+        while (args >> arg) {
+            size_t eq = arg.find('=');
+            if (eq == std::string::npos) return "error expected key=value, got " + arg;
+            const std::string key = arg.substr(0, eq), value = arg.substr(eq + 1);
+            if (key == "out") job->output = value;
+            else if (key == "w") job->width = std::stoi(value);
+            else if (key == "h") job->height = std::stoi(value);
+            else if (key == "scene") job->sceneName = value;
+            else if (key == "instances") instances = std::stoi(value);
+            else if (key == "priority") job->priority = std::stoi(value);
+            else if (key == "camera") {
+                if (!parse_camera(value, job->camera)) return "error camera must be X,Y,Z";
+            }
+            else if (key == "precision") {
+                if (!parse_precision(value, job->tier)) return "error precision must be exact, fast or approx";
+            }
+            else return "error unknown option " + key;
+        }
+    } catch (const std::exception&) {
+        return "error invalid number in " + arg;
+    }
+    if (job->output.empty()) return "error out= is required";
+    if (job->width < 2 || job->height < 2) return "error w and h must be at least 2";
+    if (job->width > MAX_JOB_SIDE || job->height > MAX_JOB_SIDE || long(job->width) * job->height > MAX_JOB_PIXELS) {
+        return "error w and h must be at most " + std::to_string(MAX_JOB_SIDE) + " and w * h at most "
+             + std::to_string(MAX_JOB_PIXELS);
+    }
+    if (instances < 1 || instances > MAX_JOB_INSTANCES) {
+        return "error instances must be between 1 and " + std::to_string(MAX_JOB_INSTANCES);
+    }
+
+    job->scene = find_scene(daemon, job->sceneName, instances);
+    if (!job->scene) return "error could not load scene " + job->sceneName;
+
+    pthread_mutex_lock(&daemon.lock);
+    if (daemon.stopping) {
+        pthread_mutex_unlock(&daemon.lock);
+        return "error shutting down";
+    }
+    job->id = daemon.nextId++;
+    daemon.jobs[job->id] = job;
+    daemon.queue.push_back(job);
+    std::string reply = describe(*job);
+    pthread_cond_broadcast(&daemon.changed);
+    pthread_mutex_unlock(&daemon.lock);
+    return reply;
+}
+
+// status, wait and cancel
+static std::string query(Daemon &daemon, const std::string &command, std::istringstream &args) {
+    int id;
+    if (!(args >> id)) return "error " + command + " needs a job id";
+    pthread_mutex_lock(&daemon.lock);
+    auto it = daemon.jobs.find(id);
+    if (it == daemon.jobs.end()) {
+        pthread_mutex_unlock(&daemon.lock);
+        return "error no job " + std::to_string(id);
+    }
+    std::shared_ptr<Job> job = it->second;
+    if (command == "cancel" && !finished(job->state)) {
+        job->cancel.store(true);
+        if (job->state == JOB_QUEUED) {
+            for (auto q = daemon.queue.begin(); q != daemon.queue.end(); ++q) {
+                if (*q == job) {
+                    daemon.queue.erase(q);
+                    break;
+                }
+            }
+            job->state = JOB_CANCELLED;
+            pthread_cond_broadcast(&daemon.changed);
+        }
+    }
+    if (command == "wait") {
+        while (!finished(job->state)) pthread_cond_wait(&daemon.changed, &daemon.lock);
+    }
+    std::string reply = describe(*job);
+    pthread_mutex_unlock(&daemon.lock);
+    return reply;
+}
+
+static void shutdown_daemon(Daemon &daemon) {
+    pthread_mutex_lock(&daemon.lock);
+    daemon.stopping = true;
+    for (auto &job : daemon.queue) {
+        job->state = JOB_CANCELLED;
+    }
+    daemon.queue.clear();
+    pthread_cond_broadcast(&daemon.changed);
+    pthread_mutex_unlock(&daemon.lock);
+}
+
+static bool send_line(int fd, const std::string &line) {
+    const std::string data = line + "\n";
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += size_t(n);
+    }
+    return true;
+}
+
+struct ConnectionData {
+    Daemon* daemon;
+    int fd;
+};
+
+static void* connectionThread(void* arg) {
+    ConnectionData* data = static_cast<ConnectionData*>(arg);
+    Daemon &daemon = *data->daemon;
+    const int fd = data->fd;
+    delete data;
+
+    std::string buffer;
+    char chunk[4096];
+    bool open = true;
+    while (open) {
+        ssize_t n = recv(fd, chunk, sizeof chunk, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        buffer.append(chunk, size_t(n));
+        size_t newline;
+        while (open && (newline = buffer.find('\n')) != std::string::npos) {
+            std::istringstream line(buffer.substr(0, newline));
+            buffer.erase(0, newline + 1);
+            std::string command, reply;
+            if (!(line >> command)) continue;
+            if (command == "render") reply = submit(daemon, line);
+            else if (command == "status" || command == "wait" || command == "cancel") reply = query(daemon, command, line);
+            else if (command == "shutdown") {
+                shutdown_daemon(daemon);
+                reply = "ok";
+            }
+            else reply = "error unknown command " + command;
+            open = send_line(fd, reply);
+        }
+    }
+
+    pthread_mutex_lock(&daemon.lock);
+    daemon.connections.erase(fd);
+    close(fd);
+    pthread_cond_broadcast(&daemon.changed);
+    pthread_mutex_unlock(&daemon.lock);
+    return nullptr;
+}
+
+static std::string socket_path(const std::string &addr) {
+    return addr.compare(0, 5, "unix:") == 0 ? addr.substr(5) : addr;
+}
+
+static int unix_socket(const std::string &path, bool listening) {
+    sockaddr_un sa;
+    if (path.empty() || path.size() >= sizeof sa.sun_path) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    std::memset(&sa, 0, sizeof sa);
+    sa.sun_family = AF_UNIX;
+    std::strncpy(sa.sun_path, path.c_str(), sizeof sa.sun_path - 1);
+    if (listening) unlink(path.c_str());
+    int rc = listening ? bind(fd, reinterpret_cast<sockaddr*>(&sa), sizeof sa)
+                       : connect(fd, reinterpret_cast<sockaddr*>(&sa), sizeof sa);
+    if (rc != 0 || (listening && listen(fd, 64) != 0)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int run_daemon(const std::string &addr, std::vector<Object*> &scene, int numThreads) {
+    const std::string path = socket_path(addr);
+    int listener = unix_socket(path, true);
+    if (listener < 0) {
+        std::cerr << "Error: Could not listen on " << path << ": " << std::strerror(errno) << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    Daemon daemon;
+    daemon.defaultScene = &scene;
+    daemon.camera = O;
+    daemon.tier = precision;
+    daemon.numThreads = numThreads;
+    daemon.pool.start(numThreads);
+    pthread_t scheduler;
+    pthread_create(&scheduler, nullptr, schedulerThread, &daemon);
+    std::cout << "Daemon listening on " << path << " with " << numThreads << " threads" << std::endl;
+
+    while (true) {
+        pthread_mutex_lock(&daemon.lock);
+        bool stopping = daemon.stopping;
+        pthread_mutex_unlock(&daemon.lock);
+        if (stopping) break;
+
+        pollfd p = {listener, POLLIN, 0};
+        if (poll(&p, 1, 200) <= 0) continue;
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) continue;
+        pthread_mutex_lock(&daemon.lock);
+        daemon.connections.insert(fd);
+        pthread_mutex_unlock(&daemon.lock);
+
+        pthread_t thread;
+        if (pthread_create(&thread, nullptr, connectionThread, new ConnectionData{&daemon, fd}) == 0) {
+            pthread_detach(thread);
+        } else {
+            pthread_mutex_lock(&daemon.lock);
+            daemon.connections.erase(fd);
+            close(fd);
+            pthread_mutex_unlock(&daemon.lock);
+        }
+    }
+    close(listener);
+    unlink(path.c_str());
+
+    // Let the running job finish, then hang up on every client
+    pthread_join(scheduler, nullptr);
+    daemon.pool.stop();
+    pthread_mutex_lock(&daemon.lock);
+    for (int fd : daemon.connections) {
+        shutdown(fd, SHUT_RDWR);
+    }
+    while (!daemon.connections.empty()) pthread_cond_wait(&daemon.changed, &daemon.lock);
+    pthread_mutex_unlock(&daemon.lock);
+
+    for (auto &entry : daemon.scenes) {
+        delete_scene(entry.second);
+    }
+    std::cout << "Daemon stopped" << std::endl;
+    return 0;
+}
+
+int run_client(const std::string &addr, const std::string &command) {
+    const std::string path = socket_path(addr);
+    int fd = unix_socket(path, false);
+    if (fd < 0) {
+        std::cerr << "Error: Could not connect to " << path << ": " << std::strerror(errno) << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::string reply;
+    char c;
+    if (send_line(fd, command)) {
+        while (recv(fd, &c, 1, 0) == 1 && c != '\n') reply += c;
+    }
+    close(fd);
+    if (reply.empty()) {
+        std::cerr << "Error: No reply from " << path << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << reply << std::endl;
+    const bool ok = reply.compare(0, 5, "error") != 0 && reply.compare(0, 6, "failed") != 0
+                 && reply.compare(0, 9, "cancelled") != 0;
+    return ok ? 0 : 1;
+}
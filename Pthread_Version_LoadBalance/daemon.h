@@ -0,0 +1,44 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+# include "graph.h"
+# include <string>
+# include <vector>
+
+/* Render daemon. Keeps a pool of numThreads render threads and every scene
+   it has loaded (BVHs included) alive between jobs, and takes commands on a
+   Unix socket at path, one line each, answered with one line:
+
+     render out=FILE [w=N] [h=N] [scene=default|MESH] [instances=N]
+            [camera=X,Y,Z] [precision=exact|fast|approx] [priority=N]
+                        -> queued ID
+     status ID          -> queued|running ID, done ID MS, cancelled ID or
+                           failed ID REASON
+     wait ID            -> like status, once the job has finished
+     cancel ID          -> like status; a running job stops within a row
+     shutdown           -> ok; queued jobs are cancelled, the running one
+                           finishes
+
+   w and h go up to 16384, with w * h at most 64 Mpixels, and instances up
+   to 65536. A job that still runs out of memory fails on its own.
+
+   Jobs run one at a time on the whole pool, highest priority first and in
+   submission order within a priority. scene=default is the scene the daemon
+   was started with; a mesh file is loaded the first time a job names it and
+   kept from then on. The camera moves the eye; the image plane stays put.
+   Pixels are traced with a PixelTracer built for each job, so the daemon's
+   --isa and --dispatch apply.
+   Anything that can write a line to a Unix socket is a client, e.g.
+
+     echo "render out=thumb.png w=256 h=256" | socat - UNIX-CONNECT:rt.sock
+
+   or this binary with --send. */
+
+// Serves until a shutdown command. Returns the process exit code.
+int run_daemon(const std::string &path, std::vector<Object*> &scene, int numThreads);
+
+// Sends one command line to the daemon at path and prints the reply. Returns
+// 0 unless the reply is an error, a failure or a cancellation.
+int run_client(const std::string &path, const std::string &command);
+
+#endif // DAEMON_H
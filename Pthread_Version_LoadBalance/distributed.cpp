@@ -0,0 +1,536 @@
+# include "distributed.h"
+
+# include <algorithm>
+# include <cerrno>
+# include <chrono>
+# include <csignal>
+# include <cstdint>
+# include <cstring>
+# include <deque>
+# include <iostream>
+# include <fcntl.h>
+# include <netdb.h>
+# include <netinet/in.h>
+# include <netinet/tcp.h>
+# include <poll.h>
+# include <sys/socket.h>
+# include <sys/un.h>
+# include <sys/wait.h>
+# include <unistd.h>
+# include <zlib.h>
+
+/* Wire format: every message is a little-endian u32 type, a u32 payload
+   length, then the payload. Pixels travel as the bits of their floats, split
+   into 4 byte planes before compression, which makes them compress well. */
+
+enum MessageType : uint32_t {
+    MSG_HELLO = 1,  // worker -> coordinator: u32 version, u32 pid, u64 scene hash
+    MSG_JOB = 2,    // coordinator -> worker: u32 tile, i32 w, h, x0, y0, x1, y1, u32 precision
+    MSG_TILE = 3,   // worker -> coordinator: u32 tile, u32 raw size, zlib data
+    MSG_STOP = 4    // coordinator -> worker: no payload
+};
+
+static const uint32_t PROTOCOL_VERSION = 2;
+static const uint32_t MAX_MESSAGE = 64u << 20;
+
+typedef std::chrono::steady_clock Clock;
+
+static void put_u32(std::vector<uint8_t> &out, uint32_t v) {
+    for (int b = 0; b < 4; ++b) out.push_back(uint8_t(v >> (8 * b)));
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+}
+
+static std::vector<uint8_t> message(uint32_t type, const std::vector<uint8_t> &payload = std::vector<uint8_t>()) {
+    std::vector<uint8_t> out;
+    out.reserve(8 + payload.size());
+    put_u32(out, type);
+    put_u32(out, uint32_t(payload.size()));
+    out.insert(out.end(), payload.begin(), payload.end());
+    return out;
+}
+
+static bool write_all(int fd, const std::vector<uint8_t> &data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+        if (n > 0) {
+            done += size_t(n);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            pollfd p = {fd, POLLOUT, 0};
+            poll(&p, 1, 1000);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool read_all(int fd, uint8_t *data, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = recv(fd, data + done, size - done, 0);
+        if (n > 0) done += size_t(n);
+        else if (n < 0 && errno == EINTR) continue;
+        else return false;
+    }
+    return true;
+}
+
+/* Addresses */
+
+struct Address {
+    bool unix_socket;
+    std::string path;   // unix
+    std::string host;   // tcp, empty for any
+    std::string port;
+};
+
+static bool parse_address(const std::string &text, Address &addr) {
+    if (text.compare(0, 5, "unix:") == 0) {
+        addr.unix_socket = true;
+        addr.path = text.substr(5);
+        return !addr.path.empty() && addr.path.size() < sizeof(sockaddr_un().sun_path);
+    }
+    size_t colon = text.rfind(':');
+    if (colon == std::string::npos || colon + 1 == text.size()) return false;
+    addr.unix_socket = false;
+    addr.host = text.substr(0, colon);
+    addr.port = text.substr(colon + 1);
+    return true;
+}
+
+static int open_socket(const Address &addr, bool listening) {
+    if (addr.unix_socket) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        sockaddr_un sa;
+        std::memset(&sa, 0, sizeof sa);
+        sa.sun_family = AF_UNIX;
+        std::strncpy(sa.sun_path, addr.path.c_str(), sizeof sa.sun_path - 1);
+        if (listening) unlink(addr.path.c_str());
+        int rc = listening ? bind(fd, reinterpret_cast<sockaddr*>(&sa), sizeof sa)
+                           : connect(fd, reinterpret_cast<sockaddr*>(&sa), sizeof sa);
+        if (rc != 0 || (listening && listen(fd, 64) != 0)) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    addrinfo *list = nullptr;
+    if (getaddrinfo(addr.host.empty() ? nullptr : addr.host.c_str(), addr.port.c_str(), &hints, &list) != 0) return -1;
+    int fd = -1;
+    for (addrinfo *ai = list; ai != nullptr && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        int one = 1;
+        if (listening) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+        else setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+        int rc = listening ? bind(fd, ai->ai_addr, ai->ai_addrlen) : connect(fd, ai->ai_addr, ai->ai_addrlen);
+        if (rc != 0 || (listening && listen(fd, 64) != 0)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(list);
+    return fd;
+}
+
+/* Tile payload compression */
+
+static bool compress_tile(const std::vector<float> &pixels, std::vector<uint8_t> &out) {
+    const size_t n = pixels.size();
+    std::vector<uint8_t> planes(4 * n);
+    for (size_t k = 0; k < n; ++k) {
+        uint32_t bits;
+        std::memcpy(&bits, &pixels[k], sizeof bits);
+        for (int b = 0; b < 4; ++b) planes[b * n + k] = uint8_t(bits >> (8 * b));
+    }
+    uLongf size = compressBound(planes.size());
+    out.resize(size);
+    if (compress2(out.data(), &size, planes.data(), planes.size(), 1) != Z_OK) return false;
+    out.resize(size);
+    return true;
+}
+
+// True if the MSG_TILE reply for a tile of that many pixels fits in
+// MAX_MESSAGE, even when zlib cannot compress the pixels at all
+static bool tile_fits(uint64_t pixels) {
+    return compressBound(uLong(pixels * 3 * sizeof(float))) + 8 <= MAX_MESSAGE;
+}
+
+static bool decompress_tile(const uint8_t *data, size_t size, size_t count, std::vector<float> &pixels) {
+    std::vector<uint8_t> planes(4 * count);
+    uLongf raw = planes.size();
+    if (uncompress(planes.data(), &raw, data, size) != Z_OK || raw != planes.size()) return false;
+    pixels.resize(count);
+    for (size_t k = 0; k < count; ++k) {
+        uint32_t bits = 0;
+        for (int b = 0; b < 4; ++b) bits |= uint32_t(planes[b * count + k]) << (8 * b);
+        std::memcpy(&pixels[k], &bits, sizeof bits);
+    }
+    return true;
+}
+
+/* Worker */
+
+int run_worker(const std::string &addr_text, std::vector<Object*> &scene, uint64_t scene_hash) {
+    Address addr;
+    if (!parse_address(addr_text, addr)) {
+        std::cerr << "Error: Bad address " << addr_text << " (expected unix:PATH or HOST:PORT)" << std::endl;
+        return EXIT_FAILURE;
+    }
+    // The coordinator may still be starting up
+    int fd = -1;
+    for (int attempt = 0; attempt < 50 && fd < 0; ++attempt) {
+        fd = open_socket(addr, false);
+        if (fd < 0) usleep(100000);
+    }
+    if (fd < 0) {
+        std::cerr << "Error: Could not connect to " << addr_text << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::vector<uint8_t> hello;
+    put_u32(hello, PROTOCOL_VERSION);
+    put_u32(hello, uint32_t(getpid()));
+    put_u32(hello, uint32_t(scene_hash));
+    put_u32(hello, uint32_t(scene_hash >> 32));
+    if (!write_all(fd, message(MSG_HELLO, hello))) {
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    const PixelTracer tracer(scene);
+    std::vector<float> pixels;
+    std::vector<uint8_t> payload, compressed;
+    int jobs = 0;
+    while (true) {
+        uint8_t header[8];
+        if (!read_all(fd, header, sizeof header)) {
+            // A coordinator turns away workers of another scene or protocol
+            if (jobs == 0) std::cerr << "Error: " << addr_text << " closed the connection before any job; "
+                                     << "are the scene options the coordinator's?" << std::endl;
+            break;
+        }
+        uint32_t type = get_u32(header), length = get_u32(header + 4);
+        if (length > MAX_MESSAGE) break;
+        payload.resize(length);
+        if (!read_all(fd, payload.data(), length)) break;
+
+        if (type == MSG_STOP) {
+            close(fd);
+            return EXIT_SUCCESS;
+        }
+        if (type != MSG_JOB || length != 32) continue;
+        ++jobs;
+
+        const uint32_t tile = get_u32(&payload[0]);
+        const int w = int(get_u32(&payload[4])), h = int(get_u32(&payload[8]));
+        const int x0 = int(get_u32(&payload[12])), y0 = int(get_u32(&payload[16]));
+        const int x1 = int(get_u32(&payload[20])), y1 = int(get_u32(&payload[24]));
+        const uint32_t tier = get_u32(&payload[28]);
+        if (tier > PRECISION_APPROX) {
+            // Not a coordinator of this build; leaving makes it requeue the tile
+            std::cerr << "Error: Job for tile " << tile << " has unknown precision " << tier << std::endl;
+            break;
+        }
+        if (w < 1 || h < 1 || x0 < 0 || y0 < 0 || x1 <= x0 || y1 <= y0 || x1 > w || y1 > h
+            || !tile_fits(uint64_t(x1 - x0) * (y1 - y0))) {
+            std::cerr << "Error: Job for tile " << tile << " has a bad region" << std::endl;
+            break;
+        }
+        precision = Precision(tier);
+        set_pixel_spread(w);
+
+        // Image rows top-down; trace counts j from the bottom
+        pixels.clear();
+        for (int y = y0; y < y1; ++y) {
+            for (int x = x0; x < x1; ++x) {
+                vec3 color = tracer.trace(x, h - y - 1, w, h);
+                pixels.push_back(color.x);
+                pixels.push_back(color.y);
+                pixels.push_back(color.z);
+            }
+        }
+        if (!compress_tile(pixels, compressed)) break;
+        std::vector<uint8_t> reply;
+        put_u32(reply, tile);
+        put_u32(reply, uint32_t(pixels.size() * sizeof(float)));
+        reply.insert(reply.end(), compressed.begin(), compressed.end());
+        if (!write_all(fd, message(MSG_TILE, reply))) break;
+    }
+    close(fd);
+    return EXIT_FAILURE;
+}
+
+/* Coordinator */
+
+struct Tile {
+    int x0, y0, x1, y1;
+    bool done;
+    int in_flight;      // workers currently rendering it
+};
+
+struct Connection {
+    int fd;
+    int id;
+    uint32_t pid;
+    bool ready;         // HELLO received
+    int tile;           // tile in flight, -1 when idle
+    Clock::time_point start;
+    std::vector<uint8_t> in;
+    int rendered;
+};
+
+static void set_nonblocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+int run_coordinator(const std::string &addr_text, int w, int h, std::vector<Object*> &scene, uint64_t scene_hash,
+                    const std::string &filename, int tile_size, int spawn) {
+    Address addr;
+    if (!parse_address(addr_text, addr)) {
+        std::cerr << "Error: Bad address " << addr_text << " (expected unix:PATH or HOST:PORT)" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (tile_size < 1) tile_size = 64;
+    if (!tile_fits(uint64_t(tile_size) * tile_size)) {
+        int largest = tile_size;
+        while (!tile_fits(uint64_t(largest) * largest)) --largest;
+        std::cerr << "Error: --tile must be at most " << largest << " (a tile must fit in one message)" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::signal(SIGPIPE, SIG_IGN);
+
+    int listen_fd = open_socket(addr, true);
+    if (listen_fd < 0) {
+        std::cerr << "Error: Could not listen on " << addr_text << ": " << std::strerror(errno) << std::endl;
+        return EXIT_FAILURE;
+    }
+    set_nonblocking(listen_fd);
+
+    // Local workers are forked once the socket is listening, so they can
+    // connect straight away and share the scene already in memory
+    std::vector<pid_t> children;
+    for (int i = 0; i < spawn; ++i) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(listen_fd);
+            _exit(run_worker(addr_text, scene, scene_hash));
+        }
+        if (pid > 0) children.push_back(pid);
+    }
+
+    std::vector<Tile> tiles;
+    std::deque<int> pending;
+    for (int y = 0; y < h; y += tile_size) {
+        for (int x = 0; x < w; x += tile_size) {
+            Tile t = {x, y, std::min(x + tile_size, w), std::min(y + tile_size, h), false, 0};
+            pending.push_back(int(tiles.size()));
+            tiles.push_back(t);
+        }
+    }
+    size_t remaining = tiles.size();
+
+    cv::Mat img(h, w, CV_32FC3);
+    std::vector<Connection> connections;
+    int next_id = 0, lost = 0, duplicated = 0;
+    double tile_seconds = 0.;
+    int tiles_timed = 0;
+    std::vector<float> pixels;
+    auto start_time = Clock::now();
+
+    auto drop = [&](size_t c, const char *why) {
+        Connection &conn = connections[c];
+        std::cout << "Worker " << conn.id << " (pid " << conn.pid << ") " << why;
+        if (conn.tile >= 0 && !tiles[conn.tile].done) {
+            if (--tiles[conn.tile].in_flight == 0) pending.push_front(conn.tile);
+            std::cout << ", tile " << conn.tile << " requeued";
+        }
+        std::cout << std::endl;
+        close(conn.fd);
+        connections.erase(connections.begin() + c);
+        ++lost;
+    };
+
+    while (remaining > 0) {
+        std::vector<pollfd> fds(1 + connections.size());
+        fds[0] = {listen_fd, POLLIN, 0};
+        for (size_t c = 0; c < connections.size(); ++c) fds[c + 1] = {connections[c].fd, POLLIN, 0};
+        poll(fds.data(), fds.size(), 100);
+
+        // New workers
+        if (fds[0].revents & POLLIN) {
+            int fd;
+            while ((fd = accept(listen_fd, nullptr, nullptr)) >= 0) {
+                set_nonblocking(fd);
+                Connection conn = {fd, next_id++, 0, false, -1, Clock::now(), std::vector<uint8_t>(), 0};
+                connections.push_back(conn);
+            }
+        }
+
+        // Incoming data, walking backwards so drops do not shift what is left
+        for (size_t c = fds.size() - 1; c >= 1; --c) {
+            if (!(fds[c].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            Connection &conn = connections[c - 1];
+            bool closed = false;
+            uint8_t buffer[65536];
+            while (true) {
+                ssize_t n = recv(conn.fd, buffer, sizeof buffer, 0);
+                if (n > 0) conn.in.insert(conn.in.end(), buffer, buffer + n);
+                else if (n < 0 && errno == EINTR) continue;
+                else {
+                    closed = n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+                    break;
+                }
+            }
+
+            bool bad = false, other_scene = false;
+            size_t used = 0;
+            while (conn.in.size() - used >= 8) {
+                const uint8_t *p = conn.in.data() + used;
+                uint32_t type = get_u32(p), length = get_u32(p + 4);
+                if (length > MAX_MESSAGE) {
+                    bad = true;
+                    break;
+                }
+                if (conn.in.size() - used - 8 < length) break;
+                const uint8_t *body = p + 8;
+                used += 8 + length;
+
+                if (type == MSG_HELLO && length >= 4) {
+                    if (get_u32(body) != PROTOCOL_VERSION || length != 16) {
+                        bad = true;
+                        break;
+                    }
+                    conn.pid = get_u32(body + 4);
+                    if ((get_u32(body + 8) | uint64_t(get_u32(body + 12)) << 32) != scene_hash) {
+                        other_scene = true;
+                        break;
+                    }
+                    conn.ready = true;
+                    std::cout << "Worker " << conn.id << " (pid " << conn.pid << ") connected" << std::endl;
+                }
+                else if (type == MSG_TILE && length >= 8) {
+                    uint32_t id = get_u32(body);
+                    if (int(id) != conn.tile) {
+                        bad = true;
+                        break;
+                    }
+                    Tile &t = tiles[id];
+                    size_t count = size_t(t.x1 - t.x0) * (t.y1 - t.y0) * 3;
+                    if (get_u32(body + 4) != count * sizeof(float) || !decompress_tile(body + 8, length - 8, count, pixels)) {
+                        bad = true;
+                        break;
+                    }
+                    --t.in_flight;
+                    if (!t.done) {
+                        size_t k = 0;
+                        for (int y = t.y0; y < t.y1; ++y) {
+                            for (int x = t.x0; x < t.x1; ++x, k += 3) {
+                                img.at<cv::Vec3f>(y, x) = cv::Vec3f(pixels[k], pixels[k + 1], pixels[k + 2]);
+                            }
+                        }
+                        t.done = true;
+                        --remaining;
+                    }
+                    tile_seconds += std::chrono::duration<double>(Clock::now() - conn.start).count();
+                    ++tiles_timed;
+                    ++conn.rendered;
+                    conn.tile = -1;
+                }
+            }
+            conn.in.erase(conn.in.begin(), conn.in.begin() + used);
+            if (other_scene) drop(c - 1, "was started with other scene options (--mesh, --instances, --texture)");
+            else if (bad) drop(c - 1, "sent a malformed message");
+            else if (closed) drop(c - 1, "disconnected");
+        }
+
+        // Hand out work: pending tiles first, then duplicates of overdue ones
+        const double overdue = std::max(.25, tiles_timed > 0 ? 4. * tile_seconds / tiles_timed : 5.);
+        for (size_t c = 0; c < connections.size(); ++c) {
+            Connection &conn = connections[c];
+            if (!conn.ready || conn.tile >= 0) continue;
+            while (!pending.empty() && tiles[pending.front()].done) pending.pop_front();
+
+            int pick = -1;
+            if (!pending.empty()) {
+                pick = pending.front();
+                pending.pop_front();
+            } else {
+                double oldest = overdue;
+                for (const Connection &other : connections) {
+                    if (other.tile < 0 || tiles[other.tile].done || tiles[other.tile].in_flight > 1) continue;
+                    double age = std::chrono::duration<double>(Clock::now() - other.start).count();
+                    if (age > oldest) {
+                        oldest = age;
+                        pick = other.tile;
+                    }
+                }
+                if (pick < 0) continue;
+                ++duplicated;
+            }
+
+            const Tile &t = tiles[pick];
+            std::vector<uint8_t> job;
+            put_u32(job, uint32_t(pick));
+            put_u32(job, uint32_t(w));
+            put_u32(job, uint32_t(h));
+            put_u32(job, uint32_t(t.x0));
+            put_u32(job, uint32_t(t.y0));
+            put_u32(job, uint32_t(t.x1));
+            put_u32(job, uint32_t(t.y1));
+            put_u32(job, uint32_t(precision));
+            conn.tile = pick;
+            conn.start = Clock::now();
+            ++tiles[pick].in_flight;
+            if (!write_all(conn.fd, message(MSG_JOB, job))) {
+                drop(c, "could not be sent a job");
+                --c;
+            }
+        }
+
+        // Local workers that all died before connecting would hang us
+        for (size_t i = 0; i < children.size();) {
+            if (waitpid(children[i], nullptr, WNOHANG) == children[i]) children.erase(children.begin() + i);
+            else ++i;
+        }
+        if (spawn > 0 && children.empty() && connections.empty()) {
+            std::cerr << "Error: All workers exited with " << remaining << " tiles left" << std::endl;
+            close(listen_fd);
+            if (addr.unix_socket) unlink(addr.path.c_str());
+            return EXIT_FAILURE;
+        }
+    }
+
+    auto end_time = Clock::now();
+    for (Connection &conn : connections) {
+        write_all(conn.fd, message(MSG_STOP));
+        std::cout << "Worker " << conn.id << " (pid " << conn.pid << "): " << conn.rendered << " tiles" << std::endl;
+        close(conn.fd);
+    }
+    close(listen_fd);
+    if (addr.unix_socket) unlink(addr.path.c_str());
+    for (pid_t pid : children) waitpid(pid, nullptr, 0);
+
+    std::cout << tiles.size() << " tiles of " << tile_size << "x" << tile_size << " in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count()
+              << " milliseconds; " << lost << " worker(s) lost, " << duplicated << " tile(s) duplicated" << std::endl;
+
+    if (!save_image(img, filename)) {
+        std::cerr << "Error: Could not write " << filename << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,38 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+# include "graph.h"
+# include <cstdint>
+# include <string>
+# include <vector>
+
+/* Coordinator/worker rendering across processes.
+
+   The coordinator listens on addr, which is "unix:PATH" for a Unix-domain
+   socket or "HOST:PORT" for TCP (":PORT" listens on all interfaces). It
+   splits the frame into tile x tile squares and hands one at a time to each
+   connected worker. Workers send back the tile's float pixels, zlib
+   compressed, and the coordinator writes the assembled frame to filename.
+
+   A worker that disconnects has its tile requeued. When no tiles are left to
+   hand out, an idle worker is given a duplicate of the tile that has been in
+   flight longest, if that tile is overdue; the first copy back wins.
+
+   Workers build the scene from their own command line. Each sends the hash
+   of its scene options (--mesh, --instances, --texture; see scene_hash) when
+   it connects, and the coordinator turns away workers whose hash differs
+   from its own, so a tile never comes from another scene; precision is sent
+   with every job. Pixels are computed with a PixelTracer, so the frame is
+   bit-identical to a local render and --isa and --dispatch apply. */
+
+// Renders w x h into filename. spawn > 0 forks that many local workers
+// connected to addr. tile must be at most 2364, so that a tile's pixels fit
+// in one message. Returns the process exit code.
+int run_coordinator(const std::string &addr, int w, int h, std::vector<Object*> &scene, uint64_t scene_hash,
+                    const std::string &filename, int tile = 64, int spawn = 0);
+
+// Connects to a coordinator at addr and renders tiles until told to stop.
+// Returns the process exit code.
+int run_worker(const std::string &addr, std::vector<Object*> &scene, uint64_t scene_hash);
+
+#endif // DISTRIBUTED_H
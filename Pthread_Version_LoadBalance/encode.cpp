@@ -0,0 +1,331 @@
+# include "encode.h"
+
+# include <algorithm>
+# include <atomic>
+# include <cctype>
+# include <cstdint>
+# include <cstdio>
+# include <cstdlib>
+# include <cstring>
+# include <functional>
+# include <vector>
+# include <pthread.h>
+# include <zlib.h>
+
+EncodeOptions encoding;
+
+std::string file_extension(const std::string &filename) {
+    size_t dot = filename.rfind('.');
+    if (dot == std::string::npos || filename.find('/', dot) != std::string::npos) return "";
+    std::string ext = filename.substr(dot + 1);
+    for (char &c : ext) c = char(std::tolower(static_cast<unsigned char>(c)));
+    return ext;
+}
+
+bool write_image(const cv::Mat &img, const std::string &filename) {
+    const std::string ext = file_extension(filename);
+    if (ext == "png") return write_png(img, filename, encoding.level, encoding.threads);
+    if (ext == "ppm") return write_ppm(img, filename);
+    if (ext == "qoi") return write_qoi(img, filename);
+    if (ext == "pfm") {
+        cv::Mat scaled;
+        img.convertTo(scaled, CV_32FC3, 1. / 255);
+        return write_pfm(scaled, filename);
+    }
+    return cv::imwrite(filename, img);
+}
+
+/* Parallel loop over [0, count) on up to numThreads threads */
+
+struct ParallelData {
+    std::atomic<int> next;
+    int count;
+    const std::function<void(int)>* body;
+};
+
+static void* parallelThread(void* arg) {
+    ParallelData* data = static_cast<ParallelData*>(arg);
+    for (int k; (k = data->next.fetch_add(1)) < data->count;) {
+        (*data->body)(k);
+    }
+    return nullptr;
+}
+
+static void parallel_for(int count, int numThreads, const std::function<void(int)> &body) {
+    ParallelData data;
+    data.next.store(0);
+    data.count = count;
+    data.body = &body;
+    numThreads = std::max(1, std::min(numThreads, count));
+    std::vector<pthread_t> threads(numThreads - 1);
+    for (pthread_t &thread : threads) {
+        pthread_create(&thread, nullptr, parallelThread, &data);
+    }
+    parallelThread(&data);
+    for (pthread_t thread : threads) {
+        pthread_join(thread, nullptr);
+    }
+}
+
+static void put_be32(std::vector<uint8_t> &out, uint32_t v) {
+    for (int b = 3; b >= 0; --b) out.push_back(uint8_t(v >> (8 * b)));
+}
+
+static bool write_file(const std::string &filename, const std::vector<uint8_t> &header,
+                       const std::vector<uint8_t> &data) {
+    FILE* file = std::fopen(filename.c_str(), "wb");
+    if (!file) return false;
+    bool ok = std::fwrite(header.data(), 1, header.size(), file) == header.size()
+           && std::fwrite(data.data(), 1, data.size(), file) == data.size();
+    return std::fclose(file) == 0 && ok;
+}
+
+// Row r of a BGR image as RGB
+static void rgb_row(const cv::Mat &img, int r, uint8_t* out) {
+    const uint8_t* in = img.ptr<uint8_t>(r);
+    for (int i = 0; i < img.cols; ++i) {
+        out[3 * i] = in[3 * i + 2];
+        out[3 * i + 1] = in[3 * i + 1];
+        out[3 * i + 2] = in[3 * i];
+    }
+}
+
+/* PNG */
+
+// Rows per independently compressed chunk aim for about this much data
+static const size_t PNG_CHUNK_BYTES = 256 << 10;
+
+// zlib's window: how much of the preceding data primes each chunk
+static const size_t DEFLATE_WINDOW = 32 << 10;
+
+static inline uint8_t paeth(int a, int b, int c) {
+    int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc) return uint8_t(a);
+    return uint8_t(pb <= pc ? b : c);
+}
+
+// Writes the filter byte and filtered bytes of cur (prev is the row above,
+// all zero for the first row), choosing the filter with the smallest sum of
+// absolute signed bytes, as libpng does
+static void filter_row(const uint8_t* prev, const uint8_t* cur, size_t n, uint8_t* out, std::vector<uint8_t> &scratch) {
+    scratch.resize(5 * n);
+    long best_sum = -1;
+    int best = 0;
+    for (int f = 0; f < 5; ++f) {
+        uint8_t* dst = &scratch[f * n];
+        long sum = 0;
+        for (size_t k = 0; k < n; ++k) {
+            const int a = k >= 3 ? cur[k - 3] : 0, b = prev[k], c = k >= 3 ? prev[k - 3] : 0;
+            uint8_t v = cur[k];
+            switch (f) {
+                case 1: v = uint8_t(v - a); break;
+                case 2: v = uint8_t(v - b); break;
+                case 3: v = uint8_t(v - ((a + b) >> 1)); break;
+                case 4: v = uint8_t(v - paeth(a, b, c)); break;
+            }
+            dst[k] = v;
+            sum += std::abs(int(int8_t(v)));
+        }
+        if (best_sum < 0 || sum < best_sum) {
+            best_sum = sum;
+            best = f;
+        }
+    }
+    out[0] = uint8_t(best);
+    std::memcpy(out + 1, &scratch[best * n], n);
+}
+
+static void png_chunk(std::vector<uint8_t> &out, const char type[4], const uint8_t* data, size_t size,
+                      const std::vector<uint8_t> &prefix = std::vector<uint8_t>(),
+                      const std::vector<uint8_t> &suffix = std::vector<uint8_t>()) {
+    put_be32(out, uint32_t(prefix.size() + size + suffix.size()));
+    const size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), prefix.begin(), prefix.end());
+    out.insert(out.end(), data, data + size);
+    out.insert(out.end(), suffix.begin(), suffix.end());
+    put_be32(out, uint32_t(crc32(0, &out[start], uInt(out.size() - start))));
+}
+
+bool write_png(const cv::Mat &img, const std::string &filename, int level, int threads) {
+    const int w = img.cols, h = img.rows;
+    const size_t row_bytes = size_t(w) * 3, stride = row_bytes + 1;
+    const int rows_per_chunk = int(std::max<size_t>(1, PNG_CHUNK_BYTES / stride));
+    const int chunks = (h + rows_per_chunk - 1) / rows_per_chunk;
+
+    // Filter every row into one buffer, a chunk of rows per task
+    std::vector<uint8_t> filtered(stride * h);
+    parallel_for(chunks, threads, [&](int k) {
+        std::vector<uint8_t> prev(row_bytes, 0), cur(row_bytes), scratch;
+        const int first = k * rows_per_chunk, last = std::min(h, first + rows_per_chunk);
+        if (first > 0) rgb_row(img, first - 1, prev.data());
+        for (int r = first; r < last; ++r) {
+            rgb_row(img, r, cur.data());
+            uint8_t* out = &filtered[stride * r];
+            if (level == 0) {
+                out[0] = 0;
+                std::memcpy(out + 1, cur.data(), row_bytes);
+            } else {
+                filter_row(prev.data(), cur.data(), row_bytes, out, scratch);
+            }
+            prev.swap(cur);
+        }
+    });
+
+    // Raw deflate of each chunk; all but the last end on a byte boundary
+    // (Z_SYNC_FLUSH), so the pieces concatenate into one stream
+    std::vector<std::vector<uint8_t>> deflated(chunks);
+    std::vector<uLong> adlers(chunks);
+    std::atomic<bool> ok(true);
+    parallel_for(chunks, threads, [&](int k) {
+        const size_t begin = stride * size_t(k) * rows_per_chunk;
+        const size_t end = std::min(filtered.size(), begin + stride * rows_per_chunk);
+        z_stream z;
+        std::memset(&z, 0, sizeof z);
+        if (deflateInit2(&z, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            ok = false;
+            return;
+        }
+        if (begin > 0 && level > 0) {
+            const size_t dict = std::min(begin, DEFLATE_WINDOW);
+            deflateSetDictionary(&z, &filtered[begin - dict], uInt(dict));
+        }
+        std::vector<uint8_t> &out = deflated[k];
+        out.resize(deflateBound(&z, uLong(end - begin)) + 16);
+        z.next_in = &filtered[begin];
+        z.avail_in = uInt(end - begin);
+        const int flush = k + 1 == chunks ? Z_FINISH : Z_SYNC_FLUSH;
+        int rc;
+        do {
+            if (z.total_out == out.size()) out.resize(out.size() * 2);
+            z.next_out = &out[z.total_out];
+            z.avail_out = uInt(out.size() - z.total_out);
+            rc = deflate(&z, flush);
+        } while (rc == Z_OK && (z.avail_in > 0 || z.avail_out == 0));
+        if (rc != (flush == Z_FINISH ? Z_STREAM_END : Z_OK)) ok = false;
+        out.resize(z.total_out);
+        deflateEnd(&z);
+        adlers[k] = adler32(adler32(0, nullptr, 0), &filtered[begin], uInt(end - begin));
+    });
+    if (!ok) return false;
+
+    uLong adler = adler32(0, nullptr, 0);
+    for (int k = 0; k < chunks; ++k) {
+        const size_t begin = stride * size_t(k) * rows_per_chunk;
+        const size_t end = std::min(filtered.size(), begin + stride * rows_per_chunk);
+        adler = adler32_combine(adler, adlers[k], z_off_t(end - begin));
+    }
+
+    static const uint8_t signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+    std::vector<uint8_t> head(signature, signature + 8), ihdr, body;
+    put_be32(ihdr, uint32_t(w));
+    put_be32(ihdr, uint32_t(h));
+    ihdr.insert(ihdr.end(), {8, 2, 0, 0, 0});    // 8-bit RGB, deflate, adaptive filters, no interlace
+    png_chunk(head, "IHDR", ihdr.data(), ihdr.size());
+
+    // One IDAT per chunk: the zlib header goes in front of the first, the
+    // Adler-32 of all the filtered data after the last
+    const std::vector<uint8_t> zlib_header = {0x78, 0x01};
+    std::vector<uint8_t> zlib_trailer;
+    put_be32(zlib_trailer, uint32_t(adler));
+    for (int k = 0; k < chunks; ++k) {
+        png_chunk(body, "IDAT", deflated[k].data(), deflated[k].size(),
+                  k == 0 ? zlib_header : std::vector<uint8_t>(),
+                  k + 1 == chunks ? zlib_trailer : std::vector<uint8_t>());
+        std::vector<uint8_t>().swap(deflated[k]);
+    }
+    png_chunk(body, "IEND", nullptr, 0);
+    return write_file(filename, head, body);
+}
+
+/* PPM and PFM */
+
+bool write_ppm(const cv::Mat &img, const std::string &filename) {
+    const std::string header = "P6\n" + std::to_string(img.cols) + " " + std::to_string(img.rows) + "\n255\n";
+    std::vector<uint8_t> data(size_t(img.cols) * img.rows * 3);
+    for (int r = 0; r < img.rows; ++r) {
+        rgb_row(img, r, &data[size_t(r) * img.cols * 3]);
+    }
+    return write_file(filename, std::vector<uint8_t>(header.begin(), header.end()), data);
+}
+
+bool write_pfm(const cv::Mat &img, const std::string &filename) {
+    // A negative scale marks little-endian data; rows go bottom to top
+    const uint16_t probe = 1;
+    const bool little = *reinterpret_cast<const uint8_t*>(&probe) == 1;
+    const bool gray = img.type() == CV_32FC1;
+    const int channels = gray ? 1 : 3;
+    const std::string header = (gray ? "Pf\n" : "PF\n") + std::to_string(img.cols) + " " + std::to_string(img.rows)
+                             + (little ? "\n-1.0\n" : "\n1.0\n");
+    std::vector<uint8_t> data(size_t(img.cols) * img.rows * channels * sizeof(float));
+    float* out = reinterpret_cast<float*>(data.data());
+    for (int r = img.rows - 1; r >= 0; --r) {
+        for (int i = 0; i < img.cols; ++i) {
+            if (gray) {
+                *out++ = img.at<float>(r, i);
+                continue;
+            }
+            const cv::Vec3f &p = img.at<cv::Vec3f>(r, i);
+            *out++ = p[2];
+            *out++ = p[1];
+            *out++ = p[0];
+        }
+    }
+    return write_file(filename, std::vector<uint8_t>(header.begin(), header.end()), data);
+}
+
+/* QOI, see qoiformat.org */
+
+bool write_qoi(const cv::Mat &img, const std::string &filename) {
+    std::vector<uint8_t> header = {'q', 'o', 'i', 'f'}, data;
+    put_be32(header, uint32_t(img.cols));
+    put_be32(header, uint32_t(img.rows));
+    header.push_back(3);    // RGB
+    header.push_back(0);    // sRGB with linear alpha
+    data.reserve(size_t(img.cols) * img.rows);
+
+    uint32_t index[64] = {0};
+    uint8_t pr = 0, pg = 0, pb = 0;
+    int run = 0;
+    const size_t count = size_t(img.cols) * img.rows;
+    size_t n = 0;
+    for (int row = 0; row < img.rows; ++row) {
+        const uint8_t* in = img.ptr<uint8_t>(row);
+        for (int i = 0; i < img.cols; ++i, ++n) {
+            const uint8_t b = in[3 * i], g = in[3 * i + 1], r = in[3 * i + 2];
+            if (r == pr && g == pg && b == pb) {
+                if (++run == 62 || n + 1 == count) {
+                    data.push_back(uint8_t(0xc0 | (run - 1)));
+                    run = 0;
+                }
+                continue;
+            }
+            if (run > 0) {
+                data.push_back(uint8_t(0xc0 | (run - 1)));
+                run = 0;
+            }
+            const uint32_t rgba = uint32_t(r) << 24 | uint32_t(g) << 16 | uint32_t(b) << 8 | 255u;
+            const int slot = (r * 3 + g * 5 + b * 7 + 255 * 11) % 64;
+            if (index[slot] == rgba) {
+                data.push_back(uint8_t(slot));
+            } else {
+                index[slot] = rgba;
+                const int8_t dr = int8_t(r - pr), dg = int8_t(g - pg), db = int8_t(b - pb);
+                const int dr_dg = dr - dg, db_dg = db - dg;
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                    data.push_back(uint8_t(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+                } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+                    data.push_back(uint8_t(0x80 | (dg + 32)));
+                    data.push_back(uint8_t((dr_dg + 8) << 4 | (db_dg + 8)));
+                } else {
+                    data.insert(data.end(), {0xfe, r, g, b});
+                }
+            }
+            pr = r;
+            pg = g;
+            pb = b;
+        }
+    }
+    data.insert(data.end(), {0, 0, 0, 0, 0, 0, 0, 1});
+    return write_file(filename, header, data);
+}
@@ -0,0 +1,41 @@
+#ifndef ENCODE_H
+#define ENCODE_H
+
+# include <opencv2/opencv.hpp>
+# include <string>
+
+/* Image writers used by save_image, picked by the file extension:
+
+     .png  written here: rows are filtered and deflated in independent
+           chunks on several threads, each chunk primed with the 32 KB of
+           data before it, and the pieces are joined into one zlib stream.
+           Level 0 stores the rows unfiltered and uncompressed.
+     .ppm  binary P6, 8 bits per channel
+     .pfm  little-endian float RGB straight from the framebuffer, unclamped
+           by the 8-bit conversion
+     .qoi  the Quite OK Image format
+
+   Anything else goes to cv::imwrite. */
+
+struct EncodeOptions {
+    int level = 1;          // --compression: zlib level 0-9 for .png
+    int threads = 1;        // threads for .png, follows -t
+};
+
+extern EncodeOptions encoding;
+
+// Writes an 8-bit BGR image. Returns false if the file cannot be written.
+bool write_png(const cv::Mat &img, const std::string &filename, int level, int threads);
+bool write_ppm(const cv::Mat &img, const std::string &filename);
+bool write_qoi(const cv::Mat &img, const std::string &filename);
+
+// Writes a float BGR framebuffer, or a single-channel float one as grayscale
+bool write_pfm(const cv::Mat &img, const std::string &filename);
+
+// Writes an 8-bit BGR image in the format named by the extension
+bool write_image(const cv::Mat &img, const std::string &filename);
+
+// Lower-case extension of filename without the dot, or "" if there is none
+std::string file_extension(const std::string &filename);
+
+#endif // ENCODE_H
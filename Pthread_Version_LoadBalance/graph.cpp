@@ -2,12 +2,46 @@
 
 # include <cmath>
 # include <limits>
+# include <cstdio>
+# include <cstring>
+# include <cstdint>
 #include <algorithm>
 # include <opencv2/opencv.hpp>
 #include <pthread.h>
 #include <atomic>
+# include <map>
+# include "numa.h"
+# include "checkpoint.h"
+# include "encode.h"
+# include "aov.h"
+# include "primitive_scene.h"
+# include "scene_bvh.h"
+# include "kernels.h"
+# include "isa.h"
+# include "texture.h"
+# include <ctime>
+
+vec3 O = vec3(0., 0.35, -1.);
+
+float pixel_spread = 0.f;
+
+Precision precision = PRECISION_EXACT;
+
+bool parse_precision(const std::string &name, Precision &tier) {
+    if (name == "exact") tier = PRECISION_EXACT;
+    else if (name == "fast") tier = PRECISION_FAST;
+    else if (name == "approx") tier = PRECISION_APPROX;
+    else return false;
+    return true;
+}
+
+bool pin_threads = false;
+bool replicate_scene = false;
+bool use_wavefront = false;
+bool sort_secondary = false;
+bool static_dispatch = false;
 
-vec3 normalizes(const vec3 &x) { return glm::normalize(x); }
+vec3 normalizes(const vec3 &x) { return tier_normalize(x); }
 
 /* class Object */
 Object::Object(
@@ -19,8 +53,67 @@ Object::Object(
     float specular_k
 ): position(position), color(color), reflection(reflection), diffuse(diffuse), specular_c(specular_c), specular_k(specular_k) {}
 
+float Object::intersect_hit(const vec3& origin, const vec3& dir, HitRecord &record) { return intersect(origin, dir); }
+
+// The loops of the batch kernels around one object's intersect, which the
+// overrides below pass inline so it is not a virtual call per ray
+template <typename Intersect>
+static void intersect_rays(const RayBatch &rays, int index, float* t, int* object, HitRecord* record,
+                           Intersect intersect) {
+    for (size_t k = 0; k < rays.n; ++k) {
+        const vec3 origin(rays.ox[k], rays.oy[k], rays.oz[k]), dir(rays.dx[k], rays.dy[k], rays.dz[k]);
+        HitRecord part;
+        const float d = intersect(origin, dir, part);
+        if (d < t[k]) {
+            t[k] = d;
+            object[k] = index;
+            record[k] = part;
+        }
+    }
+}
+
+template <typename Intersect>
+static void occlude_rays(const RayBatch &rays, const float* limit, const int* skip, int index, char* blocked,
+                         Intersect intersect) {
+    for (size_t k = 0; k < rays.n; ++k) {
+        if (blocked[k] || (skip && skip[k] == index)) continue;
+        const vec3 origin(rays.ox[k], rays.oy[k], rays.oz[k]), dir(rays.dx[k], rays.dy[k], rays.dz[k]);
+        HitRecord part;
+        blocked[k] = intersect(origin, dir, part) < limit[k];
+    }
+}
+
+void Object::intersect_batch(const RayBatch &rays, int index, float* t, int* object, HitRecord* record) {
+    intersect_rays(rays, index, t, object, record,
+                   [this](const vec3 &o, const vec3 &d, HitRecord &part) { return intersect_hit(o, d, part); });
+}
+
+void Object::occluded_batch(const RayBatch &rays, const float* limit, const int* skip, int index, char* blocked) {
+    occlude_rays(rays, limit, skip, index, blocked,
+                 [this](const vec3 &o, const vec3 &d, HitRecord &) { return intersect(o, d); });
+}
+
+vec3 Object::get_hit_normal(const vec3& point, const vec3& dir, const HitRecord &record) { return get_normal(point); }
+
 vec3 Object::get_color() { return color; }
 
+bool Object::convex() const { return false; }
+
+bool Object::bounds(vec3 &lo, vec3 &hi) const { return false; }
+
+// Hits can only be off the exact box along the ray (the approx tier's
+// directions are not quite unit length, which scales the distances) or by
+// rounding. The first is covered by the traversals' relative margin on
+// distances; a thousandth of the box's size covers the approx square root
+// of the sphere test, and the rest covers rounding.
+void pad_bounds(vec3 &lo, vec3 &hi) {
+    const vec3 size = hi - lo, magnitude = glm::max(glm::abs(lo), glm::abs(hi));
+    const float pad = 1e-3f * std::max(std::max(size.x, size.y), size.z)
+                    + 1e-5f * std::max(std::max(magnitude.x, magnitude.y), magnitude.z) + 1e-6f;
+    lo -= vec3(pad);
+    hi += vec3(pad);
+}
+
 /* class Sphere */
 Sphere::Sphere(
     vec3 position, 
@@ -30,21 +123,50 @@ Sphere::Sphere(
     float diffuse, 
     float specular_c, 
     float specular_k
-): Object(position, color, reflection, diffuse, specular_c, specular_k), radius(radius) {}
+): Object(position, color, reflection, diffuse, specular_c, specular_k), radius(radius), radius2(radius * radius), inv_radius(1.f / radius) {}
 
 float Sphere::intersect(const vec3& origin, const vec3& dir) {
+    return sphere_distance(position, radius2, origin, dir);
+}
+
+float Sphere::intersect_hit(const vec3& origin, const vec3& dir, HitRecord &record) {
+    return sphere_distance(position, radius2, origin, dir);
+}
+
+void Sphere::intersect_batch(const RayBatch &rays, int index, float* t, int* object, HitRecord* record) {
+    const vec3 center = position;
+    const float r2 = radius2;
+    intersect_rays(rays, index, t, object, record, [center, r2](const vec3 &o, const vec3 &d, HitRecord &) {
+        return sphere_distance(center, r2, o, d);
+    });
+}
+
+void Sphere::occluded_batch(const RayBatch &rays, const float* limit, const int* skip, int index, char* blocked) {
+    const vec3 center = position;
+    const float r2 = radius2;
+    occlude_rays(rays, limit, skip, index, blocked,
+                 [center, r2](const vec3 &o, const vec3 &d, HitRecord &) { return sphere_distance(center, r2, o, d); });
+}
 
-    vec3 OC = position - origin;
+// Under the approx tier the hit point can sit visibly off the surface (the
+// 12-bit ray direction error is amplified by grazing hits). The normal is
+// then pulled back to unit length with one Newton step from 1, otherwise its
+// error compounds with every reflection.
+vec3 Sphere::get_normal(const vec3& point) {
+    vec3 N = (point - position) * inv_radius;
+    if (precision == PRECISION_APPROX) N *= 1.5f - .5f * glm::dot(N, N);
+    return N;
+}
 
-    if (glm::length(OC) < radius || glm::dot(OC, dir) < 0) return std::numeric_limits<float>::infinity();
+bool Sphere::convex() const { return true; }
 
-    float l = glm::length(glm::dot(OC, dir));
-    float m_square = glm::length(OC) * glm::length(OC) - l * l;
-    float q_square = radius * radius - m_square;
-    return (q_square >= 0) ? (l - sqrt(q_square)) : std::numeric_limits<float>::infinity();
+bool Sphere::bounds(vec3 &lo, vec3 &hi) const {
+    lo = position - vec3(radius);
+    hi = position + vec3(radius);
+    return true;
 }
 
-vec3 Sphere::get_normal(const vec3& point) { return normalizes(point - position); }
+Object* Sphere::clone() const { return new Sphere(*this); }
 
 /* class Plane */
 Plane::Plane(
@@ -58,16 +180,31 @@ Plane::Plane(
 ): Object(position, color, reflection, diffuse, specular_c, specular_k), normal(normal) {}
 
 float Plane::intersect(const vec3& origin, const vec3& dir) {
-    float dn = glm::dot(dir, normal);
-    if (std::abs(dn) < 1e-6) {
-        return std::numeric_limits<float>::infinity();
-    }
-    float d = glm::dot(position - origin, normal) / dn;
-    return d > 0 ? d : std::numeric_limits<float>::infinity();
+    return plane_distance(position, normal, origin, dir);
+}
+
+float Plane::intersect_hit(const vec3& origin, const vec3& dir, HitRecord &record) {
+    return plane_distance(position, normal, origin, dir);
+}
+
+void Plane::intersect_batch(const RayBatch &rays, int index, float* t, int* object, HitRecord* record) {
+    const vec3 point = position, n = normal;
+    intersect_rays(rays, index, t, object, record,
+                   [point, n](const vec3 &o, const vec3 &d, HitRecord &) { return plane_distance(point, n, o, d); });
+}
+
+void Plane::occluded_batch(const RayBatch &rays, const float* limit, const int* skip, int index, char* blocked) {
+    const vec3 point = position, n = normal;
+    occlude_rays(rays, limit, skip, index, blocked,
+                 [point, n](const vec3 &o, const vec3 &d, HitRecord &) { return plane_distance(point, n, o, d); });
 }
 
 vec3 Plane::get_normal(const vec3& point) { return normal; }
 
+bool Plane::convex() const { return true; }
+
+Object* Plane::clone() const { return new Plane(*this); }
+
 vec3 Plane::get_color(const vec3& point) {
     return color;  // or any default color logic you want
 }
@@ -99,111 +236,595 @@ vec3 CheckerboardPlane::get_color(const vec3& point) {
     }
 }
 
+Object* CheckerboardPlane::clone() const { return new CheckerboardPlane(*this); }
+
+/* struct Transform */
+Transform Transform::translate(const vec3 &offset) { return Transform(glm::mat3(1.f), offset); }
+
+Transform Transform::scale(const vec3 &factors) {
+    return Transform(glm::mat3(vec3(factors.x, 0., 0.), vec3(0., factors.y, 0.), vec3(0., 0., factors.z)), vec3(0.));
+}
+
+// Rodrigues' rotation about axis
+Transform Transform::rotate(float radians, const vec3 &axis) {
+    const vec3 a = glm::normalize(axis);
+    const float c = std::cos(radians), s = std::sin(radians), t = 1.f - c;
+    return Transform(glm::mat3(
+        vec3(t * a.x * a.x + c,       t * a.x * a.y + s * a.z, t * a.x * a.z - s * a.y),
+        vec3(t * a.x * a.y - s * a.z, t * a.y * a.y + c,       t * a.y * a.z + s * a.x),
+        vec3(t * a.x * a.z + s * a.y, t * a.y * a.z - s * a.x, t * a.z * a.z + c)
+    ), vec3(0.));
+}
+
+Transform Transform::operator*(const Transform &other) const {
+    return Transform(linear * other.linear, linear * other.translation + translation);
+}
+
+Transform Transform::inverse() const {
+    const glm::mat3 inv = glm::inverse(linear);
+    return Transform(inv, -(inv * translation));
+}
+
+/* class Instance */
+Instance::Instance(std::shared_ptr<Object> prototype, const Transform &to_world)
+    : Instance(prototype, to_world, prototype->color, prototype->reflection, prototype->diffuse, prototype->specular_c, prototype->specular_k) {}
+
+Instance::Instance(
+    std::shared_ptr<Object> prototype,
+    const Transform &to_world,
+    vec3 color,
+    float reflection,
+    float diffuse,
+    float specular_c,
+    float specular_k
+): Object(to_world.point(prototype->position), color, reflection, diffuse, specular_c, specular_k),
+   prototype(prototype), to_world(to_world), to_object(to_world.inverse()),
+   normal_matrix(glm::transpose(to_object.linear)) {
+    vec3 lo, hi;
+    bounded = prototype->bounds(lo, hi);
+    if (!bounded) return;
+    world_lo = vec3(std::numeric_limits<float>::infinity());
+    world_hi = -world_lo;
+    for (int corner = 0; corner < 8; ++corner) {
+        const vec3 p = to_world.point(vec3(corner & 1 ? hi.x : lo.x, corner & 2 ? hi.y : lo.y, corner & 4 ? hi.z : lo.z));
+        world_lo = glm::min(world_lo, p);
+        world_hi = glm::max(world_hi, p);
+    }
+    reject_lo = world_lo;
+    reject_hi = world_hi;
+    pad_bounds(reject_lo, reject_hi);
+}
+
+// The prototype is intersected with a unit direction; distances scale back
+// by the length the transform gave it
+float Instance::intersect(const vec3& origin, const vec3& dir) {
+    if (bounded && !box_hit(reject_lo, reject_hi, origin, vec3(1.f) / dir, std::numeric_limits<float>::infinity())) {
+        return std::numeric_limits<float>::infinity();
+    }
+    const vec3 d = to_object.vector(dir);
+    const float length = glm::length(d);
+    return prototype->intersect(to_object.point(origin), d / length) / length;
+}
+
+float Instance::intersect_hit(const vec3& origin, const vec3& dir, HitRecord &record) {
+    if (bounded && !box_hit(reject_lo, reject_hi, origin, vec3(1.f) / dir, std::numeric_limits<float>::infinity())) {
+        return std::numeric_limits<float>::infinity();
+    }
+    const vec3 d = to_object.vector(dir);
+    const float length = glm::length(d);
+    return prototype->intersect_hit(to_object.point(origin), d / length, record) / length;
+}
+
+vec3 Instance::get_normal(const vec3& point) {
+    return normalizes(normal_matrix * prototype->get_normal(to_object.point(point)));
+}
+
+vec3 Instance::get_hit_normal(const vec3& point, const vec3& dir, const HitRecord &record) {
+    const vec3 d = to_object.vector(dir);
+    const vec3 n = prototype->get_hit_normal(to_object.point(point), d / glm::length(d), record);
+    return normalizes(normal_matrix * n);
+}
+
+// An affine map keeps a convex prototype convex
+bool Instance::convex() const { return prototype->convex(); }
+
+bool Instance::bounds(vec3 &lo, vec3 &hi) const {
+    lo = world_lo;
+    hi = world_hi;
+    return bounded;
+}
+
+Object* Instance::clone() const {
+    Instance* copy = new Instance(std::shared_ptr<Object>(prototype->clone()), to_world, color, reflection, diffuse, specular_c, specular_k);
+    copy->texture = texture;
+    return copy;
+}
+
+std::vector<Object*> clone_scene(const std::vector<Object*> &scene) {
+    std::map<const Object*, std::shared_ptr<Object>> prototypes;
+    std::vector<Object*> copy;
+    for (const Object* obj : scene) {
+        const Instance* instance = dynamic_cast<const Instance*>(obj);
+        if (instance == nullptr) {
+            copy.push_back(obj->clone());
+            continue;
+        }
+        std::shared_ptr<Object> &prototype = prototypes[instance->prototype.get()];
+        if (!prototype) prototype.reset(instance->prototype->clone());
+        Instance* copy_instance = new Instance(prototype, instance->to_world, instance->color, instance->reflection,
+                                               instance->diffuse, instance->specular_c, instance->specular_k);
+        copy_instance->texture = instance->texture;
+        copy.push_back(copy_instance);
+    }
+    return copy;
+}
+
 /* Other */
-vec3 intersect_color(const vec3 origin, vec3 dir, float intensity, std::vector<Object*> &scene) {
-    float min_distance = std::numeric_limits<float>::infinity();
-    size_t obj_index = -1;
+bool in_shadow(const vec3 &P, const vec3 &N, const vec3 &PL, size_t obj_index, std::vector<Object*> &scene) {
+    const vec3 origin = P + N * .0001f;
+    const float light_distance = glm::length(light_point - P);
+    for (size_t i = 0; i < scene.size(); ++i) {
+        if ((i != obj_index || !scene[i]->convex()) && scene[i]->intersect(origin, PL) < light_distance) return true;
+    }
+    return false;
+}
+
+vec3 surface_color(Object* obj, const vec3 &P) {
+    if (obj->texture) return obj->texture->color(P);
+    CheckerboardPlane* checkerboardObj = dynamic_cast<CheckerboardPlane*>(obj);
+    if (checkerboardObj != nullptr) {
+        return checkerboardObj->get_color(P);
+    }
+    return obj->get_color();
+}
+
+vec3 diffuse_term(const Object* obj, const vec3 &color, const vec3 &N, const vec3 &PL) {
+    return diffuse_lobe(obj, color, N, PL);
+}
 
+vec3 specular_term(const Object* obj, const vec3 &N, const vec3 &PL, const vec3 &PO) {
+    return specular_lobe(obj, N, PL, PO, obj->specular_k);
+}
+
+PrimitiveScene::PrimitiveScene(const std::vector<Object*> &scene) {
     for (size_t i = 0; i < scene.size(); ++i) {
-        float current_distance = scene[i]->intersect(origin, dir);
-        if (current_distance < min_distance) {
-            min_distance = current_distance;
-            obj_index = i;
-        }
+        arrays.add(scene[i], i);
     }
+}
+
+Object* PrimitiveScene::closest(const vec3 &origin, const vec3 &dir, float &distance, size_t &index, HitRecord &record) {
+    return StaticScene{*this}.closest(origin, dir, distance, index, record);
+}
+
+bool PrimitiveScene::shadowed(const vec3 &P, const vec3 &N, const vec3 &PL, size_t index) {
+    return StaticScene{*this}.shadowed(P, N, PL, index);
+}
+
+vec3 intersect_color(const vec3 origin, vec3 dir, float intensity, std::vector<Object*> &scene, AovSample* aov) {
+    VirtualScene objects = {scene};
+    return trace<VirtualScene, true, true, 0>(origin, dir, intensity, objects, aov);
+}
 
-    if (min_distance == std::numeric_limits<float>::infinity() || intensity < 0.01) return vec3(0., 0., 0.);
+vec3 intersect_color(const vec3 origin, vec3 dir, float intensity, PrimitiveScene &scene, AovSample* aov) {
+    StaticScene primitives = {scene};
+    return trace<StaticScene, true, true, 0>(origin, dir, intensity, primitives, aov);
+}
+
+const IsaKernels kernels_baseline = {select_kernel_shader, tonemap_kernel};
+
+Shader select_shader(const std::vector<Object*> &scene) {
+    return isa_kernels().select_shader(scene);
+}
+
+PixelTracer::PixelTracer(std::vector<Object*> &scene): scene(scene), shader(select_shader(scene)) {
+    if (static_dispatch) primitives.reset(new PrimitiveScene(scene));
+    else if (SceneBvh::worthwhile(scene)) bvh.reset(new SceneBvh(scene));
+}
+
+PixelTracer::~PixelTracer() {}
+
+vec3 PixelTracer::trace(int i, int j, int w, int h) const {
+    const vec3 dir = primary_dir(i, j, w, h);
+    if (primitives) return shader.shade_static(O, dir, *primitives, nullptr);
+    if (bvh) return shader.shade_bvh(O, dir, *bvh, nullptr);
+    return shader.shade(O, dir, scene, nullptr);
+}
+
+// primary_dir spaces pixels 2 / (w - 1) apart on the image plane, which is
+// |O.z| away from the camera
+void set_pixel_spread(int w) {
+    pixel_spread = 2.f / std::max(w - 1, 1) / std::max(std::fabs(O.z), 1e-3f);
+}
 
-    Object* obj = scene[obj_index];
-    const vec3 P = origin + dir * min_distance;
+vec3 primary_dir(int i, int j, int w, int h) {
+    float r = float(w) / h;
+    glm::vec4 S = glm::vec4(-1., -1. / r + .25, 1., 1. / r + .25);
+    vec3 Q = vec3(0., 0., 0.);
+    Q.x = S.x + i * (S.z - S.x) / (w - 1);
+    Q.y = S.y + j * (S.w - S.y) / (h - 1);
+    return normalizes(Q - O);
+}
+
+vec3 trace_pixel(int i, int j, int w, int h, std::vector<Object*> &scene, AovSample* aov) {
+    return intersect_color(O, primary_dir(i, j, w, h), 1, scene, aov);
+}
+
+vec3 trace_pixel(int i, int j, int w, int h, PrimitiveScene &scene, AovSample* aov) {
+    return intersect_color(O, primary_dir(i, j, w, h), 1, scene, aov);
+}
+
+static float channel(const cv::Mat &img, int row, int col, int k) {
+    if (img.type() == CV_8UC3) return img.at<cv::Vec3b>(row, col)[k] / 255.f;
+    return img.at<cv::Vec3f>(row, col)[k];
+}
+
+static double luma(const cv::Mat &img, int row, int col) {
+    // Channels are stored BGR
+    return .114 * channel(img, row, col, 0) + .587 * channel(img, row, col, 1) + .299 * channel(img, row, col, 2);
+}
 
-    vec3 color = vec3(0., 0., 0.);  // Default color
+static double ssim(const cv::Mat &a, const cv::Mat &b) {
+    const int win = 8;
+    const double c1 = .01 * .01, c2 = .03 * .03;
+    double total = 0.;
+    int windows = 0;
+    for (int r0 = 0; r0 + win <= a.rows; r0 += win) {
+        for (int c0 = 0; c0 + win <= a.cols; c0 += win) {
+            double sa = 0., sb = 0., saa = 0., sbb = 0., sab = 0.;
+            for (int row = r0; row < r0 + win; ++row) {
+                for (int col = c0; col < c0 + win; ++col) {
+                    double x = luma(a, row, col), y = luma(b, row, col);
+                    sa += x; sb += y;
+                    saa += x * x; sbb += y * y; sab += x * y;
+                }
+            }
+            const double n = win * win;
+            double ma = sa / n, mb = sb / n;
+            double va = saa / n - ma * ma, vb = sbb / n - mb * mb, cov = sab / n - ma * mb;
+            total += ((2 * ma * mb + c1) * (2 * cov + c2)) / ((ma * ma + mb * mb + c1) * (va + vb + c2));
+            ++windows;
+        }
+    }
+    return windows > 0 ? total / windows : 1.;
+}
 
-    if (obj != nullptr) {
-        CheckerboardPlane* checkerboardObj = dynamic_cast<CheckerboardPlane*>(obj);
-        if (checkerboardObj != nullptr) {
-            color = checkerboardObj->get_color(P);
-        } else {
-            color = obj->get_color();
+ImageDiff compare_images(const cv::Mat &a, const cv::Mat &b, float tolerance) {
+    ImageDiff diff = {0., 0., std::numeric_limits<double>::infinity(), 1., 0, 0};
+    if (a.rows != b.rows || a.cols != b.cols) {
+        diff.max_error = 1.;
+        diff.mse = 1.;
+        diff.psnr = 0.;
+        diff.ssim = 0.;
+        diff.mismatched = diff.outliers = long(std::max(a.rows, b.rows)) * std::max(a.cols, b.cols);
+        return diff;
+    }
+    double sum = 0.;
+    for (int row = 0; row < a.rows; ++row) {
+        for (int col = 0; col < a.cols; ++col) {
+            bool differs = false, outlier = false;
+            for (int k = 0; k < 3; ++k) {
+                float x = channel(a, row, col, k), y = channel(b, row, col, k);
+                if (x != y) differs = true;
+                double e = std::abs(double(x) - double(y));
+                if (e > tolerance) outlier = true;
+                diff.max_error = std::max(diff.max_error, e);
+                sum += e * e;
+            }
+            if (differs) ++diff.mismatched;
+            if (outlier) ++diff.outliers;
         }
     }
+    diff.mse = sum / (3. * a.rows * a.cols);
+    if (diff.mse > 0) {
+        diff.psnr = 10. * std::log10(1. / diff.mse);
+        diff.ssim = ssim(a, b);
+    }
+    return diff;
+}
 
-    const vec3 N = obj->get_normal(P);
-    const vec3 PL = normalizes(light_point - P);
-    const vec3 PO = normalizes(origin - P);
+void print_image_diff(const ImageDiff &diff) {
+    std::cout << "  max error: " << diff.max_error << " (" << diff.max_error * 255 << " LSB)" << std::endl;
+    std::cout << "  mismatched pixels: " << diff.mismatched << " (" << diff.outliers << " beyond tolerance)" << std::endl;
+    std::cout << "  PSNR: " << diff.psnr << " dB, SSIM: " << diff.ssim << std::endl;
+    std::cout << "  bit-identical: " << (diff.identical() ? "yes" : "no") << std::endl;
+}
 
-    vec3 c = ambient * color;
-    std::vector<float> l;
-    for (size_t i = 0; i < scene.size(); ++i) {
-        if (i != obj_index)
-            l.push_back(scene[i]->intersect(P + N * .0001f, PL));
+void render_reference(int w, int h, std::vector<Object*> &scene, cv::Mat &img) {
+    set_pixel_spread(w);
+    for (int i = 0; i < w; ++i) {
+        for (int j = 0; j < h; ++j) {
+            vec3 color = trace_pixel(i, j, w, h, scene);
+            img.at<cv::Vec3f>(h - j - 1, i) = cv::Vec3f(color.x, color.y, color.z);
+        }
+    }
+}
+
+bool parse_region(const std::string &text, int w, int h, Region &region) {
+    char tail;
+    if (std::sscanf(text.c_str(), "%d,%d,%d,%d%c", &region.x0, &region.y0, &region.x1, &region.y1, &tail) != 4) {
+        return false;
     }
-    if (!(l.size() > 0 && *std::min_element(l.begin(), l.end()) < glm::length(light_point - P))) {
-        c += obj->diffuse * std::max(glm::dot(N, PL), 0.f) * color * light_color;
-        c += obj->specular_c * powf(std::max(glm::dot(N, normalizes(PL + PO)), 0.f), obj->specular_k) * light_color;
+    return 0 <= region.x0 && region.x0 < region.x1 && region.x1 <= w
+        && 0 <= region.y0 && region.y0 < region.y1 && region.y1 <= h;
+}
+
+// Checkpoint flag of a row (counted from the bottom of the frame)
+static inline unsigned char& row_flag(ThreadData* data, int row) {
+    return data->rowsDone[row - (data->height - data->region.y1)];
+}
+
+// Next row to render: from the thread's own band first, then from the others
+int next_row(ThreadData* data) {
+    for (int k = 0; k < data->numBands; ++k) {
+        RowBand &band = data->bands[(data->band + k) % data->numBands];
+        while (band.next.load(std::memory_order_relaxed) < band.end) {
+            int row = band.next.fetch_add(1, std::memory_order_relaxed);
+            if (row >= band.end) break;
+            if (data->rowsDone && row_flag(data, row)) continue;   // resumed
+            return row;
+        }
     }
-    vec3 reflect_ray = dir - 2 * glm::dot(dir, N) * N;
-    c += obj->reflection * intersect_color(P + N * .0001f, reflect_ray, obj->reflection * intensity, scene);
-    return glm::clamp(c, 0.f, 1.f);
+    return -1;
+}
+
+void finish_row(ThreadData* data, int row) {
+    if (!data->rowsDone) return;
+    // The flag must not reach the mapping before the pixels do
+    std::atomic_thread_fence(std::memory_order_release);
+    row_flag(data, row) = 1;
 }
 
-//pthread_mutex_t mutex;
-std::atomic<int> currentRow(0);
 void* renderThread(void* arg) {
     ThreadData* data = static_cast<ThreadData*>(arg);
     data->startTime = std::chrono::high_resolution_clock::now();
 
-    float r = static_cast<float>(data->width) / data->height;
-    glm::vec4 S = glm::vec4(-1., -1. / r + .25, 1., 1. / r + .25);
-    vec3 Q = vec3(0., 0., 0.);
-
-    while (true) {
-        int rowToProcess = currentRow.fetch_add(1, std::memory_order_relaxed);
+    while (!use_wavefront) {
+        int rowToProcess = next_row(data);
 
-        if (rowToProcess >= data->height) {
+        if (rowToProcess < 0) {
             break;  // No more rows to process
         }
 
-        for (int i = 0; i < data->width; ++i) {
-            Q.x = S.x + i * (S.z - S.x) / (data->width - 1);
-            Q.y = S.y + rowToProcess * (S.w - S.y) / (data->height - 1);
-            vec3 color = intersect_color(O, normalizes(Q - O), 1, *data->scene);
-
-            //pthread_mutex_lock(&mutex);
-            data->image->at<cv::Vec3f>(data->height - rowToProcess - 1, i) = cv::Vec3f(color.x, color.y, color.z);
-            //pthread_mutex_unlock(&mutex);
+        const Region &region = data->region;
+        const int row = data->height - rowToProcess - 1 - region.y0;
+        for (int i = region.x0; i < region.x1; ++i) {
+            AovSample sample;
+            AovSample* aov = data->aovs ? &sample : nullptr;
+            const vec3 dir = primary_dir(i, rowToProcess, data->width, data->height);
+            vec3 color = data->primitives ? data->shader.shade_static(O, dir, *data->primitives, aov)
+                       : data->bvh ? data->shader.shade_bvh(O, dir, *data->bvh, aov)
+                       : data->shader.shade(O, dir, *data->scene, aov);
+            data->image->at<cv::Vec3f>(row, i - region.x0) = cv::Vec3f(color.x, color.y, color.z);
+            if (data->aovs) data->aovs->store(row, i - region.x0, sample);
         }
+        finish_row(data, rowToProcess);
+    }
+    if (use_wavefront) {
+        render_wavefront(data);
     }
 
     data->endTime = std::chrono::high_resolution_clock::now();
     pthread_exit(nullptr);
 }
 
-void rendering(int w, int h, std::vector<Object*> &scene, std::string filename, int numThreads) {
-    cv::Mat img(h, w, CV_32FC3);
-    //int numThreads = 7;
+struct ReplicaData {
+    const std::vector<Object*>* scene;
+    std::vector<Object*> copy;
+};
+
+static void* replicateThread(void* arg) {
+    ReplicaData* data = static_cast<ReplicaData*>(arg);
+    data->copy = clone_scene(*data->scene);
+    return nullptr;
+}
+
+void render_image(int w, int h, std::vector<Object*> &scene, cv::Mat &img, int numThreads) {
+    render_region(w, h, Region{0, 0, w, h}, scene, img, numThreads);
+}
 
+void render_region(int w, int h, const Region &region, std::vector<Object*> &scene, cv::Mat &img,
+                   int numThreads, unsigned char* rowsDone, AovBuffers* aovs) {
+    set_pixel_spread(w);
     pthread_t threads[numThreads];
     ThreadData threadData[numThreads];
 
-    currentRow.store(0);  // Reset currentRow
+    // Without --pin every thread shares one band, i.e. one row counter
+    std::vector<CpuInfo> placement;
+    int numBands = 1;
+    if (pin_threads) {
+        Topology topology = discover_topology();
+        placement = place_threads(topology, numThreads);
+        for (const CpuInfo &info : placement) numBands = std::max(numBands, info.node + 1);
+        std::cout << "Pinning " << numThreads << " threads to " << topology.cpus.size()
+                  << " CPUs on " << topology.nodes << " NUMA node(s)" << std::endl;
+    }
+
+    // Band n covers a share of the rows proportional to node n's threads
+    RowBand bands[numBands];
+    std::vector<int> threadsOnNode(numBands, 0);
+    for (int i = 0; i < numThreads; ++i) {
+        ++threadsOnNode[placement.empty() ? 0 : placement[i].node];
+    }
+    const int firstRow = h - region.y1, rows = region.height();
+    for (int n = 0, before = 0; n < numBands; ++n) {
+        bands[n].next.store(firstRow + int(long(rows) * before / numThreads));
+        before += threadsOnNode[n];
+        bands[n].end = firstRow + int(long(rows) * before / numThreads);
+    }
+
+    // Per-node scene copies, each made by a thread running on that node
+    std::vector<ReplicaData> replicas(numBands);
+    if (replicate_scene && !placement.empty()) {
+        for (int n = 0; n < numBands; ++n) {
+            replicas[n].scene = &scene;
+            for (const CpuInfo &info : placement) {
+                if (info.node != n) continue;
+                pthread_t thread;
+                pthread_attr_t attr;
+                pthread_attr_init(&attr);
+                pin_attr(&attr, info.cpu);
+                pthread_create(&thread, &attr, replicateThread, &replicas[n]);
+                pthread_join(thread, nullptr);
+                pthread_attr_destroy(&attr);
+                break;
+            }
+        }
+    }
+
+    const Shader shader = select_shader(scene);
+
+    // One PrimitiveScene, or else one SceneBvh, per scene copy in use
+    std::vector<std::unique_ptr<PrimitiveScene>> primitives;
+    std::vector<std::unique_ptr<SceneBvh>> bvhs;
+    if (static_dispatch && !use_wavefront) {
+        for (int n = 0; n < numBands; ++n) {
+            primitives.emplace_back(new PrimitiveScene(replicas[n].copy.empty() ? scene : replicas[n].copy));
+        }
+    } else if (!use_wavefront && SceneBvh::worthwhile(scene)) {
+        for (int n = 0; n < numBands; ++n) {
+            bvhs.emplace_back(new SceneBvh(replicas[n].copy.empty() ? scene : replicas[n].copy));
+        }
+    }
 
     for (int i = 0; i < numThreads; ++i) {
         threadData[i].width = w;
         threadData[i].height = h;
-        threadData[i].scene = &scene;
         threadData[i].image = &img;
-
-        pthread_create(&threads[i], nullptr, renderThread, &threadData[i]);
+        threadData[i].bands = bands;
+        threadData[i].region = region;
+        threadData[i].rowsDone = rowsDone;
+        threadData[i].aovs = aovs;
+        threadData[i].numBands = numBands;
+        threadData[i].cpu = placement.empty() ? -1 : placement[i].cpu;
+        threadData[i].node = placement.empty() ? 0 : placement[i].node;
+        threadData[i].band = threadData[i].node;
+        threadData[i].scene = replicas[threadData[i].node].copy.empty() ? &scene : &replicas[threadData[i].node].copy;
+        threadData[i].primitives = primitives.empty() ? nullptr : primitives[threadData[i].node].get();
+        threadData[i].bvh = bvhs.empty() ? nullptr : bvhs[threadData[i].node].get();
+        threadData[i].shader = shader;
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (threadData[i].cpu >= 0 && !pin_attr(&attr, threadData[i].cpu)) {
+            std::cerr << "Warning: Could not pin thread " << i << " to CPU " << threadData[i].cpu << std::endl;
+        }
+        pthread_create(&threads[i], &attr, renderThread, &threadData[i]);
+        pthread_attr_destroy(&attr);
     }
 
     for (int i = 0; i < numThreads; ++i) {
         pthread_join(threads[i], nullptr);
         auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(threadData[i].endTime - threadData[i].startTime).count();
-        std::cout << "Thread " << i << " execution time: " << duration << " milliseconds" << std::endl;
+        std::cout << "Thread " << i;
+        if (threadData[i].cpu >= 0) {
+            std::cout << " (cpu " << threadData[i].cpu << ", node " << placement[i].os_node << ")";
+        }
+        std::cout << " execution time: " << duration << " milliseconds" << std::endl;
     }
 
-    img *= 255;
-    img.convertTo(img, CV_8UC3);
-    cv::imwrite(filename, img);
+    for (ReplicaData &replica : replicas) {
+        for (auto obj : replica.copy) {
+            delete obj;
+        }
+    }
+}
+
+// Syncs a checkpoint every checkpointing.interval seconds until stopped
+struct SyncData {
+    Checkpoint* checkpoint;
+    pthread_mutex_t lock;
+    pthread_cond_t stop;
+    bool done;
+};
+
+static void* syncThread(void* arg) {
+    SyncData* data = static_cast<SyncData*>(arg);
+    pthread_mutex_lock(&data->lock);
+    while (!data->done) {
+        timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += checkpointing.interval;
+        pthread_cond_timedwait(&data->stop, &data->lock, &deadline);
+        if (!data->done) data->checkpoint->sync();
+    }
+    pthread_mutex_unlock(&data->lock);
+    return nullptr;
+}
+
+void rendering(int w, int h, std::vector<Object*> &scene, std::string filename, int numThreads,
+               const Region* region, const std::string &base) {
+    const Region crop = region ? *region : Region{0, 0, w, h};
+    cv::Mat frame;
+    if (!base.empty()) {
+        frame = cv::imread(base);
+        if (frame.rows != h || frame.cols != w) {
+            std::cerr << "Error: " << base << " is not a " << w << "x" << h << " image." << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+    }
+
+    cv::Mat img;
+    Checkpoint checkpoint;
+    AovBuffers aovs;
+    auto render_start = std::chrono::high_resolution_clock::now();
+    if (!checkpointing.enabled) {
+        img.create(crop.height(), crop.width(), CV_32FC3);
+        aovs.create(crop.height(), crop.width(), aov_mask);
+        render_region(w, h, crop, scene, img, numThreads, nullptr, aov_mask ? &aovs : nullptr);
+    } else {
+        if (!checkpoint.open(filename + ".ckpt", crop.width(), crop.height(), checkpointing.resume)) {
+            std::exit(EXIT_FAILURE);
+        }
+        if (int done = checkpoint.rows_done()) {
+            std::cout << "Resuming " << filename << ": " << done << " of " << crop.height() << " rows already rendered" << std::endl;
+        }
+
+        SyncData sync = {&checkpoint, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false};
+        pthread_t syncer;
+        pthread_create(&syncer, nullptr, syncThread, &sync);
+        cv::Mat mapped(crop.height(), crop.width(), CV_32FC3, checkpoint.pixels());
+        render_region(w, h, crop, scene, mapped, numThreads, checkpoint.rows());
+        pthread_mutex_lock(&sync.lock);
+        sync.done = true;
+        pthread_cond_signal(&sync.stop);
+        pthread_mutex_unlock(&sync.lock);
+        pthread_join(syncer, nullptr);
+
+        // save_image scales in place, so convert a copy; the checkpoint stays
+        // valid until the image is on disk
+        checkpoint.sync();
+        img = mapped.clone();
+    }
+
+    auto encode_start = std::chrono::high_resolution_clock::now();
+    bool written;
+    if (frame.empty()) {
+        written = save_image(img, filename);
+    } else {
+        cv::Mat pixels;
+        isa_kernels().tonemap(img, pixels);
+        img = pixels;
+        cv::Mat patch = frame(cv::Rect(crop.x0, crop.y0, crop.width(), crop.height()));
+        img.copyTo(patch);
+        written = write_image(frame, filename);
+    }
+    if (!aovs.save(filename)) std::exit(EXIT_FAILURE);
+    auto encode_end = std::chrono::high_resolution_clock::now();
+    if (!written) {
+        std::cerr << "Error: Could not write " << filename << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    std::cout << "Rendered in " << std::chrono::duration_cast<std::chrono::milliseconds>(encode_start - render_start).count()
+              << " milliseconds, encoded " << filename << " in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(encode_end - encode_start).count()
+              << " milliseconds." << std::endl;
+    if (checkpointing.enabled) checkpoint.remove();
+}
+
+bool save_image(cv::Mat &img, const std::string &filename) {
+    if (file_extension(filename) == "pfm") return write_pfm(img, filename);
+    cv::Mat pixels;
+    isa_kernels().tonemap(img, pixels);
+    img = pixels;
+    return write_image(img, filename);
 }
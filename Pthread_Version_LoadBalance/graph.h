@@ -3,18 +3,93 @@
 
 # include <iostream>
 # include <glm/glm.hpp>
+# include <cstdint>
 # include <vector>
+# include <memory>
+# include <atomic>
+# include <string>
 # include <chrono>
 # include <opencv2/opencv.hpp> 
 
 using vec3 = glm::vec3;
 
-const vec3 O = vec3(0., 0.35, -1.);
+struct AovSample;
+struct AovBuffers;
+class PrimitiveScene;
+class SceneBvh;
+class Texture;
+
+// Camera position; the image plane stays at z = 0. Only changed between
+// renders (the daemon sets it per job).
+extern vec3 O;
+
+// Distance between neighbouring primary rays per unit of distance from O,
+// which gives image textures the footprint of a hit (texture.h). Set with
+// O by set_pixel_spread; 0 until then, which samples full resolution.
+extern float pixel_spread;
+
+// Sets pixel_spread for a frame w pixels wide seen from O
+void set_pixel_spread(int w);
 const vec3 light_point = vec3(5., 5., -10.);
 const vec3 light_color = vec3(1., 1., 1.);
 const float ambient = 0.05;
 
-vec3 normalize(vec3 x);
+// Precision tier of the intersection and shading kernels, selected with
+// --precision. Error bounds against the exact tier, measured on frames
+// 0/15/30/45 of the default orbit at 1080x920:
+//   PRECISION_EXACT   libm sqrt/powf; the reference for --verify and --regress
+//   PRECISION_FAST    rsqrt + one Newton step, pow by squaring for integer
+//                     specular_k, unfused dot products;
+//                     <= 0.011% of pixels differ, scattered along checker
+//                     and silhouette edges, directly or in reflections;
+//                     PSNR >= 65.9 dB, SSIM >= 0.99998
+//   PRECISION_APPROX  bare rsqrt estimate (~12 bits), Schlick's pow for
+//                     non-integer specular_k; 1.2-3.7% of pixels differ,
+//                     PSNR 34-41 dB, SSIM >= 0.975. Preview only, it fails
+//                     the default --regress thresholds
+enum Precision { PRECISION_EXACT, PRECISION_FAST, PRECISION_APPROX };
+
+extern Precision precision;
+
+bool parse_precision(const std::string &name, Precision &tier);
+
+vec3 normalizes(const vec3 &x);
+
+// --pin: workers are pinned one per core across the NUMA nodes, and each node
+// renders its own band of rows first so framebuffer pages are first touched
+// (and so placed) on the node that writes them. --replicate additionally
+// gives each node its own copy of the scene, cloned on that node.
+extern bool pin_threads;
+extern bool replicate_scene;
+
+// --wavefront: workers trace batches of rows stage by stage instead of
+// recursing per pixel; see wavefront.cpp
+extern bool use_wavefront;
+
+// --sort-rays: the wavefront renderer sorts each wave of reflection rays by
+// direction octant and origin Morton code before tracing it
+extern bool sort_secondary;
+
+// --dispatch static: the recursive renderer traces through a PrimitiveScene
+// (primitive_scene.h) with per-type arrays instead of virtual calls
+extern bool static_dispatch;
+
+// Which part of an object a ray hit, for objects whose normal depends on it:
+// the triangle of a mesh and the barycentrics (u, v) of the hit point. The
+// closest-hit pass fills it and shading hands it back to get_hit_normal, so
+// objects keep no per-ray state.
+struct HitRecord {
+    uint32_t triangle = 0;
+    float u = 0.f, v = 0.f;
+};
+
+// n rays with their components in separate arrays, as the wavefront
+// renderer queues them, for the batch kernels of Object
+struct RayBatch {
+    const float *ox, *oy, *oz;
+    const float *dx, *dy, *dz;
+    size_t n;
+};
 
 class Object {
 public:
@@ -25,6 +100,8 @@ public:
     const float diffuse;
     const float specular_c;
     const float specular_k;
+    // Replaces color when set (texture.h); shared by the clones
+    std::shared_ptr<const Texture> texture;
 
     Object(
         vec3 position, 
@@ -36,8 +113,31 @@ public:
     );
 
     virtual float intersect(const vec3& origin, const vec3& dir) = 0;
+    // intersect for the closest-hit pass, which also records the part hit.
+    // The default records nothing.
+    virtual float intersect_hit(const vec3& origin, const vec3& dir, HitRecord &record);
+    // Closest-hit pass of a batch, this object being scene[index]: each ray
+    // k it hits nearer than t[k] gets that distance in t[k], index in
+    // object[k] and the part in record[k]. The default calls intersect_hit
+    // per ray.
+    virtual void intersect_batch(const RayBatch &rays, int index, float* t, int* object, HitRecord* record);
+    // Shadow pass of a batch: sets blocked[k] if the object is hit before
+    // limit[k]. Rays already blocked, and with skip those whose skip[k] is
+    // index, are not tested. The default calls intersect per ray.
+    virtual void occluded_batch(const RayBatch &rays, const float* limit, const int* skip, int index, char* blocked);
     virtual vec3 get_normal(const vec3& point) = 0;
+    // Normal at point, the hit of a ray along dir that intersect_hit
+    // described in record. The default is get_normal(point).
+    virtual vec3 get_hit_normal(const vec3& point, const vec3& dir, const HitRecord &record);
     vec3 get_color();
+    // True if a ray leaving the surface can never hit the object again, so
+    // shadow rays may skip the object they start on. False by default.
+    virtual bool convex() const;
+    // World-space box around the object. False, the default, for unbounded
+    // objects (planes).
+    virtual bool bounds(vec3 &lo, vec3 &hi) const;
+    // Deep copy, used to replicate the scene per NUMA node
+    virtual Object* clone() const = 0;
     virtual ~Object() {}
 };
 
@@ -45,6 +145,8 @@ class Sphere : public Object {
 public:
 
     const float radius;
+    const float radius2;     // radius * radius
+    const float inv_radius;  // 1 / radius, scales surface offsets to unit normals
 
     Sphere(
         vec3 position, 
@@ -58,7 +160,17 @@ public:
 
     float intersect(const vec3& origin, const vec3& dir) override;
 
+    float intersect_hit(const vec3& origin, const vec3& dir, HitRecord &record) override;
+    void intersect_batch(const RayBatch &rays, int index, float* t, int* object, HitRecord* record) override;
+    void occluded_batch(const RayBatch &rays, const float* limit, const int* skip, int index, char* blocked) override;
+
     vec3 get_normal(const vec3& point) override;
+
+    bool convex() const override;
+
+    bool bounds(vec3 &lo, vec3 &hi) const override;
+
+    Object* clone() const override;
 };
 
 class Plane : public Object {
@@ -78,9 +190,17 @@ public:
 
     float intersect(const vec3& origin, const vec3& dir) override;
 
+    float intersect_hit(const vec3& origin, const vec3& dir, HitRecord &record) override;
+    void intersect_batch(const RayBatch &rays, int index, float* t, int* object, HitRecord* record) override;
+    void occluded_batch(const RayBatch &rays, const float* limit, const int* skip, int index, char* blocked) override;
+
     vec3 get_normal(const vec3& point) override;
 
     virtual vec3 get_color(const vec3& point);
+
+    bool convex() const override;
+
+    Object* clone() const override;
 };
 
 class CheckerboardPlane : public Plane {
@@ -99,11 +219,144 @@ public:
 
     vec3 get_color(const vec3& point) override;
 
+    Object* clone() const override;
+
 private:
     vec3 color2;
     float square_size;
 };
 
+// Affine object-to-world transform, the 4x3 matrix [linear | translation]
+struct Transform {
+    glm::mat3 linear;
+    vec3 translation;
+
+    Transform(): linear(1.f), translation(0.) {}
+    Transform(const glm::mat3 &linear, const vec3 &translation): linear(linear), translation(translation) {}
+
+    static Transform translate(const vec3 &offset);
+    static Transform scale(const vec3 &factors);
+    static Transform rotate(float radians, const vec3 &axis);
+
+    // This transform applied after other
+    Transform operator*(const Transform &other) const;
+    Transform inverse() const;
+
+    vec3 point(const vec3 &p) const { return linear * p + translation; }
+    vec3 vector(const vec3 &v) const { return linear * v; }
+};
+
+// A placed copy of a shared prototype. Rays are taken into the prototype's
+// object space, so one TriangleGeometry or Sphere backs any number of
+// instances. The prototype is owned through the shared_ptr and must not
+// also be in the scene.
+class Instance : public Object {
+public:
+
+    const std::shared_ptr<Object> prototype;
+    const Transform to_world;
+
+    // Uses the prototype's material
+    Instance(std::shared_ptr<Object> prototype, const Transform &to_world);
+
+    // Overrides the material
+    Instance(
+        std::shared_ptr<Object> prototype,
+        const Transform &to_world,
+        vec3 color,
+        float reflection,
+        float diffuse,
+        float specular_c,
+        float specular_k
+    );
+
+    float intersect(const vec3& origin, const vec3& dir) override;
+
+    float intersect_hit(const vec3& origin, const vec3& dir, HitRecord &record) override;
+
+    vec3 get_normal(const vec3& point) override;
+
+    vec3 get_hit_normal(const vec3& point, const vec3& dir, const HitRecord &record) override;
+
+    bool convex() const override;
+
+    // The prototype's box carried to world space
+    bool bounds(vec3 &lo, vec3 &hi) const override;
+
+    Object* clone() const override;
+
+private:
+    const Transform to_object;
+    const glm::mat3 normal_matrix;   // inverse transpose of to_world.linear
+    // bounds, and the same box widened by pad_bounds: rays that miss it are
+    // rejected before they are taken into object space
+    bool bounded;
+    vec3 world_lo, world_hi;
+    vec3 reject_lo, reject_hi;
+};
+
+// Widens a box from Object::bounds so that it holds every hit the object's
+// intersect reports; rounding, and the approx tier's rsqrt estimate, can
+// put a hit slightly outside the exact box
+void pad_bounds(vec3 &lo, vec3 &hi);
+
+// Deep copy of a scene. Instances sharing a prototype still share its copy.
+std::vector<Object*> clone_scene(const std::vector<Object*> &scene);
+
+// Pixels [x0, x1) x [y0, y1) of a frame, rows counted from the top like the
+// image they are written to
+struct Region {
+    int x0, y0, x1, y1;
+    int width() const { return x1 - x0; }
+    int height() const { return y1 - y0; }
+};
+
+// Parses "x0,y0,x1,y1" and checks it is a non-empty part of a w x h frame
+bool parse_region(const std::string &text, int w, int h, Region &region);
+
+// Shading kernel specialized for the features a scene uses: whether any
+// object reflects, whether there is a checkerboard or a texture, and the
+// specular exponent when all objects share one of the compiled-in values
+// (specular_k 0 is the generic exponent). select_shader picks it once per
+// render, among the kernels built for the instruction set in use (isa.h).
+// The entry points, one per scene representation, trace a primary ray and
+// give the same bits as intersect_color.
+struct Shader {
+    bool reflective;
+    bool textured;
+    int specular_k;
+    vec3 (*shade)(const vec3 &origin, const vec3 &dir, std::vector<Object*> &scene, AovSample* aov);
+    vec3 (*shade_static)(const vec3 &origin, const vec3 &dir, PrimitiveScene &scene, AovSample* aov);
+    vec3 (*shade_bvh)(const vec3 &origin, const vec3 &dir, SceneBvh &scene, AovSample* aov);
+};
+
+Shader select_shader(const std::vector<Object*> &scene);
+
+// The kernel and scene representation render_region would trace scene with
+// (select_shader's, over a PrimitiveScene with --dispatch static or over a
+// SceneBvh when one pays off), for the renderers that take one pixel at a
+// time: the daemon's pool and distributed workers. scene must outlive it.
+class PixelTracer {
+public:
+    explicit PixelTracer(std::vector<Object*> &scene);
+    ~PixelTracer();
+
+    // Same bits as trace_pixel
+    vec3 trace(int i, int j, int w, int h) const;
+
+private:
+    std::vector<Object*> &scene;
+    Shader shader;
+    std::unique_ptr<PrimitiveScene> primitives;
+    std::unique_ptr<SceneBvh> bvh;
+};
+
+// Rows [next, end) handed out one at a time; one band per NUMA node
+struct RowBand {
+    alignas(64) std::atomic<int> next;
+    int end;
+};
+
 // Define ThreadData
 struct ThreadData {
     alignas(64) int width;
@@ -112,12 +365,89 @@ struct ThreadData {
     alignas(64) int endRow;
     alignas(64) std::vector<Object*>* scene;
     alignas(64) cv::Mat* image;
+    RowBand* bands;
+    int numBands;
+    int band;           // the band of this thread's node, taken first
+    int cpu;            // -1 when not pinned
+    int node;
+    Region region;              // part of the frame being rendered into image
+    unsigned char* rowsDone;    // checkpoint flags, nullptr without --checkpoint
+    AovBuffers* aovs;           // region-sized like image, nullptr without --aov
+    PrimitiveScene* primitives; // copy of scene for --dispatch static, else nullptr
+    SceneBvh* bvh;              // top-level BVH over scene when it pays off, else nullptr
+    Shader shader;              // kernel for scene, see select_shader
     std::chrono::high_resolution_clock::time_point startTime;  
     std::chrono::high_resolution_clock::time_point endTime;    
 };
 
-vec3 intersect_color(vec3 origin, vec3 dir, float intensity, std::vector<Object*> &scene);
+// True if an object blocks the light from P. scene[obj_index], the object
+// P lies on, is only tested if it is not convex (a mesh can shadow itself).
+bool in_shadow(const vec3 &P, const vec3 &N, const vec3 &PL, size_t obj_index, std::vector<Object*> &scene);
+
+// With aov, the data of the hit is stored there (see aov.h); reflections
+// are traced without, so only the first hit is recorded.
+vec3 intersect_color(vec3 origin, vec3 dir, float intensity, std::vector<Object*> &scene, AovSample* aov = nullptr);
+vec3 intersect_color(vec3 origin, vec3 dir, float intensity, PrimitiveScene &scene, AovSample* aov = nullptr);
+
+// Shading pieces of intersect_color, shared with the wavefront renderer so
+// both compute the same bits: surface color at P, and the diffuse and
+// specular terms added when P is lit
+vec3 surface_color(Object* obj, const vec3 &P);
+vec3 diffuse_term(const Object* obj, const vec3 &color, const vec3 &N, const vec3 &PL);
+vec3 specular_term(const Object* obj, const vec3 &N, const vec3 &PL, const vec3 &PO);
+
+// Direction of the primary ray through pixel (i, j), j counted from the bottom
+vec3 primary_dir(int i, int j, int w, int h);
+
+// Color of pixel (i, j) of a w x h image, j counted from the bottom row.
+// Every backend goes through this, so equal inputs give bit-identical pixels.
+vec3 trace_pixel(int i, int j, int w, int h, std::vector<Object*> &scene, AovSample* aov = nullptr);
+vec3 trace_pixel(int i, int j, int w, int h, PrimitiveScene &scene, AovSample* aov = nullptr);
+
+// Difference statistics between two framebuffers, channels scaled to [0, 1].
+struct ImageDiff {
+    double max_error;
+    double mse;
+    double psnr;        // dB, infinity when the images are identical
+    double ssim;        // mean SSIM of the luma channel over 8x8 windows
+    long mismatched;    // pixels with at least one differing channel
+    long outliers;      // pixels with a channel off by more than the tolerance
+    bool identical() const { return mismatched == 0; }
+};
+
+ImageDiff compare_images(const cv::Mat &a, const cv::Mat &b, float tolerance = 0.f);
+void print_image_diff(const ImageDiff &diff);
+
+// Single-threaded reference loop used by --verify.
+void render_reference(int w, int h, std::vector<Object*> &scene, cv::Mat &img);
+void render_image(int w, int h, std::vector<Object*> &scene, cv::Mat &img, int numThreads = 1);
+
+// Renders region of the w x h frame into img, which is region-sized; pixels
+// are the same as those of the full frame. With rowsDone (one flag per row
+// of the region), rows whose flag is set are skipped and the flag of every
+// row rendered is set once its pixels are in img. With aovs, its buffers
+// (img-sized) are filled in the same pass.
+void render_region(int w, int h, const Region &region, std::vector<Object*> &scene, cv::Mat &img,
+                   int numThreads = 1, unsigned char* rowsDone = nullptr, AovBuffers* aovs = nullptr);
+
+// Next row for a worker, from its own band first; -1 when all are taken
+int next_row(ThreadData* data);
+
+// Marks a row whose pixels have all been written as done
+void finish_row(ThreadData* data, int row);
+
+// Worker loop of the wavefront renderer
+void render_wavefront(ThreadData* data);
+// Renders and writes filename; with --checkpoint the frame is rendered into a
+// checkpoint (see checkpoint.h) that --resume picks up after a kill. With a
+// region only that crop is rendered; it is written on its own, or pasted
+// into a copy of the w x h image base when base is not empty. The AOVs
+// selected by --aov are written next to filename.
+void rendering(int w, int h, std::vector<Object*> &scene, std::string filename = "test.png", int numThreads = 1,
+               const Region* region = nullptr, const std::string &base = "");
 
-void rendering(int w, int h, std::vector<Object*> &scene, std::string filename = "test.png", int numThreads = 1);
+// Converts a float framebuffer to 8 bits in place and writes it to filename.
+// Returns false if the file could not be written.
+bool save_image(cv::Mat &img, const std::string &filename);
 
 #endif // GRAPH_H
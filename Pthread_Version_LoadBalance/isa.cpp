@@ -0,0 +1,57 @@
+# include "isa.h"
+
+Isa isa = detect_isa();
+
+bool isa_supported(Isa set) {
+# if defined(__x86_64__) || defined(__i386__)
+    // May run from static initializers, before libgcc has read cpuid
+    __builtin_cpu_init();
+    switch (set) {
+    case ISA_BASELINE: return true;
+    case ISA_SSE42: return __builtin_cpu_supports("sse4.2");
+    case ISA_AVX2: return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    case ISA_AVX512:
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+            && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("fma");
+    }
+    return false;
+# else
+    return set == ISA_BASELINE;
+# endif
+}
+
+Isa detect_isa() {
+    const Isa sets[] = {ISA_AVX512, ISA_AVX2, ISA_SSE42};
+    for (Isa set : sets) {
+        if (isa_supported(set)) return set;
+    }
+    return ISA_BASELINE;
+}
+
+bool parse_isa(const std::string &name, Isa &set) {
+    if (name == "auto") set = detect_isa();
+    else if (name == "baseline") set = ISA_BASELINE;
+    else if (name == "sse4.2") set = ISA_SSE42;
+    else if (name == "avx2") set = ISA_AVX2;
+    else if (name == "avx512") set = ISA_AVX512;
+    else return false;
+    return true;
+}
+
+const char* isa_name(Isa set) {
+    switch (set) {
+    case ISA_SSE42: return "sse4.2";
+    case ISA_AVX2: return "avx2";
+    case ISA_AVX512: return "avx512";
+    default: return "baseline";
+    }
+}
+
+const IsaKernels& isa_kernels() {
+    switch (isa) {
+    case ISA_SSE42: return kernels_sse42;
+    case ISA_AVX2: return kernels_avx2;
+    case ISA_AVX512: return kernels_avx512;
+    default: return kernels_baseline;
+    }
+}
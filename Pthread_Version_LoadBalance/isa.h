@@ -0,0 +1,57 @@
+#ifndef ISA_H
+#define ISA_H
+
+# include <string>
+# include <vector>
+# include "graph.h"
+
+/* The hot kernels (kernels.h) are built once per instruction set in the same
+   binary, so it runs on every node of a mixed farm and still uses the wider
+   units where they exist:
+
+     baseline  the Makefile's flags (SSE2 on x86-64), in graph.cpp
+     sse4.2    Nehalem and later, isa_sse42.cpp
+     avx2      AVX2 + FMA, Haswell / Zen and later, isa_avx2.cpp
+     avx512    AVX-512 F/BW/VL, Skylake-SP / Zen 4 and later, isa_avx512.cpp
+
+   The best set the CPU (and OS) supports is picked at startup; --isa picks
+   another one for benchmarking. All sets give bit-identical images.
+
+   The shading kernels of select_shader and the tonemap of save_image come
+   from the selected set. Intersections are in it under --dispatch static;
+   the default path calls the baseline Object::intersect virtually. The
+   wavefront renderer and the reference of --verify stay on the baseline. */
+
+enum Isa { ISA_BASELINE, ISA_SSE42, ISA_AVX2, ISA_AVX512 };
+
+// Set of the kernels in use
+extern Isa isa;
+
+// Best set this CPU supports
+Isa detect_isa();
+
+bool isa_supported(Isa set);
+
+// Parses baseline, sse4.2, avx2, avx512 or auto (detect_isa)
+bool parse_isa(const std::string &name, Isa &set);
+
+const char* isa_name(Isa set);
+
+// Entry points of one set
+struct IsaKernels {
+    // select_shader built for the set
+    Shader (*select_shader)(const std::vector<Object*> &scene);
+    // Float framebuffer in [0, 1] to 8 bits, as img *= 255 then
+    // img.convertTo(out, CV_8UC3)
+    void (*tonemap)(const cv::Mat &img, cv::Mat &out);
+};
+
+extern const IsaKernels kernels_baseline;
+extern const IsaKernels kernels_sse42;
+extern const IsaKernels kernels_avx2;
+extern const IsaKernels kernels_avx512;
+
+// Kernels of the set in use
+const IsaKernels& isa_kernels();
+
+#endif // ISA_H
@@ -0,0 +1,26 @@
+// Kernels for --isa avx2, see isa.h
+
+# include <algorithm>
+# include <cmath>
+# include <cstdint>
+# include <cstring>
+# include <limits>
+# include <vector>
+# include <opencv2/opencv.hpp>
+# if defined(__SSE__)
+# include <xmmintrin.h>
+# endif
+# include "graph.h"
+# include "aov.h"
+# include "primitive_scene.h"
+# include "scene_bvh.h"
+# include "isa.h"
+
+// Only what kernels.h defines is built for the target; the headers above
+// stay baseline code
+# if defined(__x86_64__) || defined(__i386__)
+# pragma GCC target("avx2,fma")
+# endif
+# include "kernels.h"
+
+const IsaKernels kernels_avx2 = {select_kernel_shader, tonemap_kernel};
@@ -0,0 +1,458 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+# include <algorithm>
+# include <cmath>
+# include <cstdint>
+# include <cstring>
+# include <limits>
+# include <vector>
+# include <opencv2/opencv.hpp>
+# if defined(__SSE__)
+# include <xmmintrin.h>
+# endif
+# include "graph.h"
+# include "aov.h"
+# include "primitive_scene.h"
+# include "scene_bvh.h"
+
+/* The hot kernels: intersection, shading and the 8-bit tonemap. graph.cpp
+   builds them for the baseline target of the Makefile, and isa_*.cpp build
+   them again under #pragma GCC target for SSE4.2, AVX2 and AVX-512; isa.h
+   picks one set at startup.
+
+   Everything here is in an anonymous namespace, so each of those files gets
+   its own copy with internal linkage. A shared inline function would be
+   emitted once per file, each for that file's target, and the linker would
+   keep any one of them, possibly an AVX-512 one on a CPU without it. For the
+   same reason a file including this under a target pragma must include the
+   headers above before the pragma.
+
+   The kernels are written once and built without FP contraction, so every
+   variant gives the same bits as the baseline. */
+
+namespace {
+
+// Reciprocal square root estimate, about 12 bits
+inline float rsqrt_estimate(float x) {
+# if defined(__SSE__)
+    return _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+# else
+    uint32_t i;
+    float y;
+    std::memcpy(&i, &x, sizeof i);
+    i = 0x5f375a86 - (i >> 1);
+    std::memcpy(&y, &i, sizeof y);
+    return y * (1.5f - .5f * x * y * y);
+# endif
+}
+
+inline float tier_rsqrt(float x) {
+    if (precision == PRECISION_APPROX) return rsqrt_estimate(x);
+    if (precision == PRECISION_FAST) {
+        float y = rsqrt_estimate(x);
+        return y * (1.5f - .5f * x * y * y);  // one Newton step
+    }
+    return 1.f / std::sqrt(x);
+}
+
+inline float tier_sqrt(float x) {
+    if (precision == PRECISION_EXACT) return std::sqrt(x);
+    return x > 0 ? x * tier_rsqrt(x) : 0.f;
+}
+
+// x^k for the specular lobe, x in [0, 1]
+inline float specular_pow(float x, float k) {
+    if (precision == PRECISION_EXACT) return powf(x, k);
+    int n = static_cast<int>(k);
+    if (float(n) != k || n < 0) {
+        if (precision == PRECISION_APPROX) return x / (k - k * x + x);  // Schlick
+        return powf(x, k);
+    }
+    float result = 1.f;
+    while (n) {
+        if (n & 1) result *= x;
+        x *= x;
+        n >>= 1;
+    }
+    return result;
+}
+
+inline vec3 tier_normalize(const vec3 &x) {
+    if (precision == PRECISION_EXACT) return glm::normalize(x);
+    // rsqrt(0) is infinite; a zero vector (a ray re-hitting its own origin,
+    // which the approx tier's error allows) stays zero instead of NaN
+    float d = glm::dot(x, x);
+    return d > 0 ? x * tier_rsqrt(d) : x;
+}
+
+// dir must be unit length. Solves |origin + t * dir - center|^2 = radius2
+// in half-b form: t = b -+ sqrt(b^2 - c).
+inline float sphere_distance(const vec3 &center, float radius2, const vec3 &origin, const vec3 &dir) {
+    vec3 OC = center - origin;
+    float b = glm::dot(OC, dir);
+    float c = glm::dot(OC, OC) - radius2;
+    float disc = b * b - c;
+    if (disc < 0) return std::numeric_limits<float>::infinity();
+
+    float s = tier_sqrt(disc);
+    if (b - s > 0) return b - s;
+    // Origin inside the sphere: the far root is the exit point
+    return (b + s > 0) ? (b + s) : std::numeric_limits<float>::infinity();
+}
+
+inline float plane_distance(const vec3 &position, const vec3 &normal, const vec3 &origin, const vec3 &dir) {
+    float dn = glm::dot(dir, normal);
+    if (std::abs(dn) < 1e-6) {
+        return std::numeric_limits<float>::infinity();
+    }
+    float d = glm::dot(position - origin, normal) / dn;
+    return d > 0 ? d : std::numeric_limits<float>::infinity();
+}
+
+// Slab test: true if the ray enters [lo, hi] before t_max; inv is 1 / dir.
+// A zero direction component with the origin on a slab plane gives NaN,
+// which leaves the interval as it was, so the test stays conservative.
+inline bool box_hit(const vec3 &lo, const vec3 &hi, const vec3 &origin, const vec3 &inv, float t_max) {
+    float t0 = 0.f, t1 = t_max;
+    for (int a = 0; a < 3; ++a) {
+        float ta = (lo[a] - origin[a]) * inv[a], tb = (hi[a] - origin[a]) * inv[a];
+        if (ta > tb) std::swap(ta, tb);
+        t0 = std::max(t0, ta);
+        t1 = std::min(t1, tb);
+    }
+    return t0 <= t1;
+}
+
+// Non-virtual intersect of the PrimitiveScene arrays; CheckerboardPlane
+// takes the Plane overload
+inline float intersect_kernel(const Sphere &sphere, const vec3 &origin, const vec3 &dir) {
+    return sphere_distance(sphere.position, sphere.radius2, origin, dir);
+}
+
+inline float intersect_kernel(const Plane &plane, const vec3 &origin, const vec3 &dir) {
+    return plane_distance(plane.position, plane.normal, origin, dir);
+}
+
+inline float intersect_kernel(Instance &instance, const vec3 &origin, const vec3 &dir) {
+    return instance.Instance::intersect(origin, dir);
+}
+
+// The closest-hit versions; only instances record the part hit
+inline float intersect_kernel(const Sphere &sphere, const vec3 &origin, const vec3 &dir, HitRecord &record) {
+    return intersect_kernel(sphere, origin, dir);
+}
+
+inline float intersect_kernel(const Plane &plane, const vec3 &origin, const vec3 &dir, HitRecord &record) {
+    return intersect_kernel(plane, origin, dir);
+}
+
+inline float intersect_kernel(Instance &instance, const vec3 &origin, const vec3 &dir, HitRecord &record) {
+    return instance.Instance::intersect_hit(origin, dir, record);
+}
+
+// Closest hit and shadow test over the arrays of a PrimitiveScene, one loop
+// per type; the end of the list holds the objects dispatched virtually
+inline void closest_in(PrimitiveArrays<> &arrays, const vec3 &origin, const vec3 &dir, PrimitiveHit &hit) {
+    for (size_t k = 0; k < arrays.objects.size(); ++k) {
+        HitRecord record;
+        const float t = arrays.objects[k]->intersect_hit(origin, dir, record);
+        hit.update(t, arrays.index[k], arrays.objects[k], record);
+    }
+}
+
+template <typename T, typename... Rest>
+inline void closest_in(PrimitiveArrays<T, Rest...> &arrays, const vec3 &origin, const vec3 &dir, PrimitiveHit &hit) {
+    for (size_t k = 0; k < arrays.objects.size(); ++k) {
+        HitRecord record;
+        const float t = intersect_kernel(arrays.objects[k], origin, dir, record);
+        hit.update(t, arrays.index[k], &arrays.objects[k], record);
+    }
+    closest_in(static_cast<PrimitiveArrays<Rest...>&>(arrays), origin, dir, hit);
+}
+
+inline bool occluded_in(PrimitiveArrays<> &arrays, const vec3 &origin, const vec3 &dir,
+                        float distance, size_t exclude) {
+    for (size_t k = 0; k < arrays.objects.size(); ++k) {
+        Object* obj = arrays.objects[k];
+        if ((arrays.index[k] != exclude || !obj->convex()) && obj->intersect(origin, dir) < distance) return true;
+    }
+    return false;
+}
+
+template <typename T, typename... Rest>
+inline bool occluded_in(PrimitiveArrays<T, Rest...> &arrays, const vec3 &origin, const vec3 &dir,
+                        float distance, size_t exclude) {
+    for (size_t k = 0; k < arrays.objects.size(); ++k) {
+        T &obj = arrays.objects[k];
+        if ((arrays.index[k] != exclude || !obj.T::convex())
+            && intersect_kernel(obj, origin, dir) < distance) return true;
+    }
+    return occluded_in(static_cast<PrimitiveArrays<Rest...>&>(arrays), origin, dir, distance, exclude);
+}
+
+// The std::vector<Object*> scene as trace() sees it
+struct VirtualScene {
+    std::vector<Object*> &objects;
+
+    Object* closest(const vec3 &origin, const vec3 &dir, float &distance, size_t &index, HitRecord &record) {
+        float min_distance = std::numeric_limits<float>::infinity();
+        size_t obj_index = -1;
+        for (size_t i = 0; i < objects.size(); ++i) {
+            HitRecord current;
+            float current_distance = objects[i]->intersect_hit(origin, dir, current);
+            if (current_distance < min_distance) {
+                min_distance = current_distance;
+                obj_index = i;
+                record = current;
+            }
+        }
+        distance = min_distance;
+        index = obj_index;
+        return min_distance == std::numeric_limits<float>::infinity() ? nullptr : objects[obj_index];
+    }
+
+    bool shadowed(const vec3 &P, const vec3 &N, const vec3 &PL, size_t index) {
+        return in_shadow(P, N, PL, index, objects);
+    }
+};
+
+// A PrimitiveScene as trace() sees it. flatten: the intersect kernels are
+// too big for GCC to inline on its own.
+struct StaticScene {
+    PrimitiveScene &scene;
+
+    __attribute__((flatten))
+    Object* closest(const vec3 &origin, const vec3 &dir, float &distance, size_t &index, HitRecord &record) {
+        PrimitiveHit hit;
+        closest_in(scene.arrays, origin, dir, hit);
+        distance = hit.distance;
+        index = hit.index;
+        record = hit.record;
+        return hit.distance == std::numeric_limits<float>::infinity() ? nullptr : hit.object;
+    }
+
+    __attribute__((flatten))
+    bool shadowed(const vec3 &P, const vec3 &N, const vec3 &PL, size_t index) {
+        return occluded_in(scene.arrays, P + N * .0001f, PL, glm::length(light_point - P), index);
+    }
+};
+
+// A SceneBvh as trace() sees it. Subtrees are skipped when their box starts
+// a thousandth beyond the distance that matters (the closest hit so far, or
+// the light), which covers hits the approx tier reports slightly off along
+// the ray; see pad_bounds.
+struct BvhScene {
+    SceneBvh &bvh;
+
+    Object* closest(const vec3 &origin, const vec3 &dir, float &distance, size_t &index, HitRecord &record) {
+        PrimitiveHit hit;
+        for (uint32_t i : bvh.unbounded) {
+            HitRecord part;
+            const float t = bvh.scene[i]->intersect_hit(origin, dir, part);
+            hit.update(t, i, bvh.scene[i], part);
+        }
+        const vec3 inv = vec3(1.f) / dir;
+        uint32_t stack[64];
+        int top = 0;
+        if (!bvh.nodes.empty()) stack[top++] = 0;
+        while (top > 0) {
+            const uint32_t node_index = stack[--top];
+            const SceneBvh::Node &node = bvh.nodes[node_index];
+            if (!box_hit(node.lo, node.hi, origin, inv, hit.distance + hit.distance * 1e-3f)) continue;
+            if (node.count > 0) {
+                for (uint32_t k = node.offset; k < node.offset + node.count; ++k) {
+                    const uint32_t i = bvh.items[k];
+                    HitRecord part;
+                    const float t = bvh.scene[i]->intersect_hit(origin, dir, part);
+                    hit.update(t, i, bvh.scene[i], part);
+                }
+                continue;
+            }
+            // Push the far child first so the near one is visited first
+            uint32_t near_child = node_index + 1, far_child = node.offset;
+            if (inv[node.axis] < 0) std::swap(near_child, far_child);
+            stack[top++] = far_child;
+            stack[top++] = near_child;
+        }
+        distance = hit.distance;
+        index = hit.index;
+        record = hit.record;
+        return hit.distance == std::numeric_limits<float>::infinity() ? nullptr : hit.object;
+    }
+
+    // Same test as in_shadow
+    bool shadowed(const vec3 &P, const vec3 &N, const vec3 &PL, size_t index) {
+        const vec3 origin = P + N * .0001f;
+        const float light_distance = glm::length(light_point - P);
+        for (uint32_t i : bvh.unbounded) {
+            if ((i != index || !bvh.scene[i]->convex()) && bvh.scene[i]->intersect(origin, PL) < light_distance) {
+                return true;
+            }
+        }
+        const vec3 inv = vec3(1.f) / PL;
+        uint32_t stack[64];
+        int top = 0;
+        if (!bvh.nodes.empty()) stack[top++] = 0;
+        while (top > 0) {
+            const SceneBvh::Node &node = bvh.nodes[stack[--top]];
+            if (!box_hit(node.lo, node.hi, origin, inv, light_distance + light_distance * 1e-3f)) continue;
+            if (node.count > 0) {
+                for (uint32_t k = node.offset; k < node.offset + node.count; ++k) {
+                    const uint32_t i = bvh.items[k];
+                    Object* obj = bvh.scene[i];
+                    if ((i != index || !obj->convex()) && obj->intersect(origin, PL) < light_distance) return true;
+                }
+                continue;
+            }
+            stack[top++] = node.offset;
+            stack[top++] = uint32_t(&node - bvh.nodes.data()) + 1;
+        }
+        return false;
+    }
+};
+
+inline vec3 diffuse_lobe(const Object* obj, const vec3 &color, const vec3 &N, const vec3 &PL) {
+    return obj->diffuse * std::max(glm::dot(N, PL), 0.f) * color * light_color;
+}
+
+// Specular term with the exponent k passed in, a constant in the specialized
+// kernels
+inline vec3 specular_lobe(const Object* obj, const vec3 &N, const vec3 &PL, const vec3 &PO, float k) {
+    return obj->specular_c * specular_pow(std::max(glm::dot(N, tier_normalize(PL + PO)), 0.f), k) * light_color;
+}
+
+// Whitted shading of the ray, over either scene type. The other parameters
+// drop what a scene does not use, see select_shader: Reflective false skips
+// the reflection ray (every object has reflection 0), Textured false the
+// checkerboard and texture lookups, and a nonzero SpecularK is the
+// specular_k of every object. The generic kernel is
+// trace<Scene, true, true, 0>.
+template <typename Scene, bool Reflective, bool Textured, int SpecularK>
+vec3 trace(const vec3 origin, vec3 dir, float intensity, Scene &scene, AovSample* aov) {
+    float min_distance;
+    size_t obj_index;
+    HitRecord record;
+    Object* obj = scene.closest(origin, dir, min_distance, obj_index, record);
+
+    if (!obj || (Reflective && intensity < 0.01)) return vec3(0., 0., 0.);
+
+    const vec3 P = origin + dir * min_distance;
+    const vec3 color = Textured ? surface_color(obj, P) : obj->get_color();
+
+    const vec3 N = obj->get_hit_normal(P, dir, record);
+    const vec3 PL = tier_normalize(light_point - P);
+    const vec3 PO = tier_normalize(origin - P);
+
+    vec3 c = ambient * color;
+    const bool lit = !scene.shadowed(P, N, PL, obj_index);
+    if (lit) {
+        c += diffuse_lobe(obj, color, N, PL);
+        c += specular_lobe(obj, N, PL, PO, SpecularK ? float(SpecularK) : obj->specular_k);
+    }
+    vec3 reflected = vec3(0., 0., 0.);
+    if (Reflective) {
+        vec3 reflect_ray = dir - 2 * glm::dot(dir, N) * N;
+        reflected = obj->reflection * trace<Scene, Reflective, Textured, SpecularK>(
+            P + N * .0001f, reflect_ray, obj->reflection * intensity, scene, nullptr);
+        c += reflected;
+    }
+    if (aov) {
+        aov->depth = min_distance;
+        aov->normal = N;
+        aov->id = float(obj_index + 1);
+        aov->albedo = color;
+        aov->shadow = lit ? 0.f : 1.f;
+        aov->reflection = reflected;
+    }
+    return glm::clamp(c, 0.f, 1.f);
+}
+
+template <bool Reflective, bool Textured, int SpecularK>
+vec3 shade_virtual(const vec3 &origin, const vec3 &dir, std::vector<Object*> &scene, AovSample* aov) {
+    VirtualScene objects = {scene};
+    return trace<VirtualScene, Reflective, Textured, SpecularK>(origin, dir, 1, objects, aov);
+}
+
+template <bool Reflective, bool Textured, int SpecularK>
+vec3 shade_static(const vec3 &origin, const vec3 &dir, PrimitiveScene &scene, AovSample* aov) {
+    StaticScene primitives = {scene};
+    return trace<StaticScene, Reflective, Textured, SpecularK>(origin, dir, 1, primitives, aov);
+}
+
+template <bool Reflective, bool Textured, int SpecularK>
+vec3 shade_bvh(const vec3 &origin, const vec3 &dir, SceneBvh &scene, AovSample* aov) {
+    BvhScene objects = {scene};
+    return trace<BvhScene, Reflective, Textured, SpecularK>(origin, dir, 1, objects, aov);
+}
+
+template <bool Reflective, bool Textured, int SpecularK>
+Shader make_shader() {
+    Shader shader;
+    shader.reflective = Reflective;
+    shader.textured = Textured;
+    shader.specular_k = SpecularK;
+    shader.shade = shade_virtual<Reflective, Textured, SpecularK>;
+    shader.shade_static = shade_static<Reflective, Textured, SpecularK>;
+    shader.shade_bvh = shade_bvh<Reflective, Textured, SpecularK>;
+    return shader;
+}
+
+// Exponents with their own kernels; 50 is the default material's
+template <bool Reflective, bool Textured>
+Shader make_shader(int specular_k) {
+    switch (specular_k) {
+    case 20: return make_shader<Reflective, Textured, 20>();
+    case 50: return make_shader<Reflective, Textured, 50>();
+    case 100: return make_shader<Reflective, Textured, 100>();
+    default: return make_shader<Reflective, Textured, 0>();
+    }
+}
+
+Shader select_kernel_shader(const std::vector<Object*> &scene) {
+    bool reflective = false, textured = false;
+    int specular_k = 0;
+    for (size_t i = 0; i < scene.size(); ++i) {
+        const Object* obj = scene[i];
+        reflective = reflective || obj->reflection != 0.f;
+        textured = textured || obj->texture || dynamic_cast<const CheckerboardPlane*>(obj) != nullptr;
+        const int k = int(obj->specular_k);
+        if (i == 0) specular_k = k;
+        if (float(k) != obj->specular_k || k != specular_k) specular_k = -1;
+    }
+    if (reflective) {
+        return textured ? make_shader<true, true>(specular_k) : make_shader<true, false>(specular_k);
+    }
+    return textured ? make_shader<false, true>(specular_k) : make_shader<false, false>(specular_k);
+}
+
+// One channel of tonemap_kernel. Adding and subtracting 1.5 * 2^23 rounds
+// to the nearest integer, ties to even, like the cvRound of convertTo,
+// without a libm call. The clamp is on the integer: float compares would
+// keep GCC from vectorizing under the default -ftrapping-math. Channels
+// come clamped to [0, 1] from trace(); like convertTo, NaN gives 0 on x86.
+inline unsigned char tonemap_channel(float x) {
+    const int q = static_cast<int>((x * 255.f + 12582912.f) - 12582912.f);
+    return static_cast<unsigned char>(std::min(std::max(q, 0), 255));
+}
+
+// Runs of 32 channels have a fixed trip count, which GCC vectorizes at -O2
+inline void tonemap_row(const float* __restrict in, unsigned char* __restrict px, int n) {
+    int k = 0;
+    for (; k + 32 <= n; k += 32) {
+        for (int l = 0; l < 32; ++l) px[k + l] = tonemap_channel(in[k + l]);
+    }
+    for (; k < n; ++k) px[k] = tonemap_channel(in[k]);
+}
+
+// img *= 255 and convertTo(CV_8UC3) in one pass
+void tonemap_kernel(const cv::Mat &img, cv::Mat &out) {
+    out.create(img.rows, img.cols, CV_8UC3);
+    for (int row = 0; row < img.rows; ++row) {
+        tonemap_row(img.ptr<float>(row), out.ptr<unsigned char>(row), img.cols * 3);
+    }
+}
+
+} // namespace
+
+#endif // KERNELS_H
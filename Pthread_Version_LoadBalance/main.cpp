@@ -2,6 +2,14 @@
 # include <string>
 # include <chrono> 
 # include "graph.h"
+# include "scene.h"
+# include "distributed.h"
+# include "checkpoint.h"
+# include "daemon.h"
+# include "encode.h"
+# include "aov.h"
+# include "isa.h"
+# include "texture.h"
 # include <glm/glm.hpp>
 
 # include <cstdlib> 
@@ -11,8 +19,12 @@ int main(int argc, char *argv[]) {
 
     /* Process Usr Input */
 
-    int w = 6400, h = 6400, numThreads = 1;
-    bool wSet = false, hSet = false;
+    int w = 6400, h = 6400, numThreads = 1, instances = 1, tile = 64, spawn = 0;
+    bool wSet = false, hSet = false, verify = false;
+    std::string compareA, compareB, meshFile, coordinatorAddr, workerAddr, daemonAddr, sendAddr, sendCommand;
+    std::string regionText, baseImage, format = "png";
+    std::vector<std::string> textures;
+    std::string makeTextureIn, makeTextureOut;
     try{
         for (int i = 1; i<argc; i++ ) {
             std::string arg = argv[i];
@@ -24,9 +36,131 @@ int main(int argc, char *argv[]) {
                 h = std::stoi(argv[++i]);
                 hSet = true;
             }
+            else if (arg == "--precision" && i + 1 < argc) {
+                if (!parse_precision(argv[++i], precision)) {
+                    std::cerr << "Error: --precision must be exact, fast or approx." << std::endl;
+                    std::exit(EXIT_FAILURE);
+                }
+            }
             else if(arg == "-t" && i + 1 < argc){
                 numThreads = std::stoi(argv[++i]);
             }
+            else if (arg == "--pin") {
+                pin_threads = true;
+            }
+            else if (arg == "--replicate") {
+                pin_threads = true;
+                replicate_scene = true;
+            }
+            else if (arg == "--wavefront") {
+                use_wavefront = true;
+            }
+            else if (arg == "--sort-rays") {
+                use_wavefront = true;
+                sort_secondary = true;
+            }
+            else if (arg == "--dispatch" && i + 1 < argc) {
+                std::string dispatch = argv[++i];
+                if (dispatch != "virtual" && dispatch != "static") {
+                    std::cerr << "Error: --dispatch must be virtual or static." << std::endl;
+                    std::exit(EXIT_FAILURE);
+                }
+                static_dispatch = dispatch == "static";
+            }
+            else if (arg == "--isa" && i + 1 < argc) {
+                if (!parse_isa(argv[++i], isa)) {
+                    std::cerr << "Error: --isa must be auto, baseline, sse4.2, avx2 or avx512." << std::endl;
+                    std::exit(EXIT_FAILURE);
+                }
+                if (!isa_supported(isa)) {
+                    std::cerr << "Error: This CPU does not support --isa " << isa_name(isa) << "." << std::endl;
+                    std::exit(EXIT_FAILURE);
+                }
+            }
+            else if (arg == "--verify") {
+                verify = true;
+            }
+            else if (arg == "--compare" && i + 2 < argc) {
+                compareA = argv[++i];
+                compareB = argv[++i];
+            }
+            else if (arg == "--mesh" && i + 1 < argc) {
+                meshFile = argv[++i];
+            }
+            else if (arg == "--instances" && i + 1 < argc) {
+                instances = std::stoi(argv[++i]);
+            }
+            else if (arg == "--texture" && i + 1 < argc) {
+                textures.push_back(argv[++i]);
+            }
+            else if (arg == "--texture-cache" && i + 1 < argc) {
+                const int megabytes = std::stoi(argv[++i]);
+                if (megabytes < 1) {
+                    std::cerr << "Error: --texture-cache must be at least 1 MB." << std::endl;
+                    std::exit(EXIT_FAILURE);
+                }
+                texture_cache.set_budget(size_t(megabytes) << 20);
+            }
+            else if (arg == "--make-texture" && i + 2 < argc) {
+                makeTextureIn = argv[++i];
+                makeTextureOut = argv[++i];
+            }
+            else if (arg == "--coordinator" && i + 1 < argc) {
+                coordinatorAddr = argv[++i];
+            }
+            else if (arg == "--worker" && i + 1 < argc) {
+                workerAddr = argv[++i];
+            }
+            else if (arg == "--spawn" && i + 1 < argc) {
+                spawn = std::stoi(argv[++i]);
+            }
+            else if (arg == "--tile" && i + 1 < argc) {
+                tile = std::stoi(argv[++i]);
+            }
+            else if (arg == "--daemon" && i + 1 < argc) {
+                daemonAddr = argv[++i];
+            }
+            else if (arg == "--send" && i + 2 < argc) {
+                sendAddr = argv[++i];
+                sendCommand = argv[++i];
+            }
+            else if (arg == "--region" && i + 1 < argc) {
+                regionText = argv[++i];
+            }
+            else if (arg == "--into" && i + 1 < argc) {
+                baseImage = argv[++i];
+            }
+            else if (arg == "--format" && i + 1 < argc) {
+                format = argv[++i];
+                if (format != "png" && format != "ppm" && format != "pfm" && format != "qoi") {
+                    std::cerr << "Error: --format must be png, ppm, pfm or qoi." << std::endl;
+                    std::exit(EXIT_FAILURE);
+                }
+            }
+            else if (arg == "--compression" && i + 1 < argc) {
+                encoding.level = std::stoi(argv[++i]);
+                if (encoding.level < 0 || encoding.level > 9) {
+                    std::cerr << "Error: --compression must be 0-9." << std::endl;
+                    std::exit(EXIT_FAILURE);
+                }
+            }
+            else if (arg == "--aov" && i + 1 < argc) {
+                if (!parse_aovs(argv[++i], aov_mask)) {
+                    std::cerr << "Error: --aov must be all or a comma-separated list of depth, normal, id, albedo, shadow, reflection." << std::endl;
+                    std::exit(EXIT_FAILURE);
+                }
+            }
+            else if (arg == "--checkpoint") {
+                checkpointing.enabled = true;
+            }
+            else if (arg == "--checkpoint-interval" && i + 1 < argc) {
+                checkpointing.enabled = true;
+                checkpointing.interval = std::stoi(argv[++i]);
+            }
+            else if (arg == "--resume") {
+                checkpointing.enabled = true;
+                checkpointing.resume = true;
+            }
         }
     } catch (const std::invalid_argument& e) {
         std::cerr << "Error: Invalid argument for width or height." << std::endl;
@@ -38,29 +172,139 @@ int main(int argc, char *argv[]) {
         std::exit(EXIT_FAILURE);
     }
 
-    std::vector<Object*> scene = {
-        new Sphere(vec3(.75, .1, 1.), .6, vec3(.8, .3, 0.)),
-        new Sphere(vec3(-.3, .01, .2), .3, vec3(.0, .0, .9)),
-        new Sphere(vec3(-2.75, .1, 3.5), .6, vec3(.1, .572, .184)),
-        new Sphere(vec3(.0, 1., 3.5), .6, vec3(.580, .082, .666)),
-        //new Plane(vec3(0., -.5, 0.), vec3(0., 1., 0.))
-        new CheckerboardPlane(vec3(0., -.5, 0.), vec3(0., 1., 0.), vec3(1., 1., 1.), vec3(0., 0., 0.), 0.2)
-    };
+    if (checkpointing.interval < 1) {
+        std::cerr << "Error: --checkpoint-interval must be at least 1 second." << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    if (aov_mask && checkpointing.enabled) {
+        std::cerr << "Error: --aov buffers are not kept in checkpoints; drop --checkpoint/--resume." << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    // The daemon's pool and distributed workers trace one pixel at a time
+    // through PixelTracer, which has the kernels of --isa and --dispatch but
+    // no wavefront, AOVs or NUMA placement
+    if ((!daemonAddr.empty() || !coordinatorAddr.empty() || !workerAddr.empty())
+        && (use_wavefront || aov_mask || pin_threads)) {
+        std::cerr << "Error: --wavefront, --sort-rays, --aov, --pin and --replicate do not apply to "
+                  << "--daemon, --coordinator or --worker." << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    encoding.threads = numThreads;
+
+    Region region = {0, 0, w, h};
+    if (!regionText.empty() && !parse_region(regionText, w, h, region)) {
+        std::cerr << "Error: --region must be x0,y0,x1,y1 with 0 <= x0 < x1 <= width and 0 <= y0 < y1 <= height." << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    if (!baseImage.empty() && regionText.empty()) {
+        std::cerr << "Error: --into needs a --region." << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    // Distributed workers must build the same scene; the checkpoint holds the
+    // crop only, so the full frame size and the crop's origin, which decide
+    // the camera rays of its pixels, are part of its identity too
+    std::string sceneText = "mesh=" + meshFile + ";instances=" + std::to_string(instances);
+    for (const std::string &spec : textures) sceneText += ";texture=" + spec;
+    const uint64_t sceneHash = scene_hash(sceneText);
+    sceneText += ";frame=" + std::to_string(w) + "x" + std::to_string(h)
+               + ";region=" + std::to_string(region.x0) + "," + std::to_string(region.y0) + ","
+               + std::to_string(region.x1) + "," + std::to_string(region.y1);
+    checkpointing.scene = scene_hash(sceneText);
+
+    if (!compareA.empty()) {
+        cv::Mat a = cv::imread(compareA), b = cv::imread(compareB);
+        if (a.empty() || b.empty()) {
+            std::cerr << "Error: Could not read " << (a.empty() ? compareA : compareB) << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        std::cout << "Compare: " << compareA << " vs " << compareB << std::endl;
+        ImageDiff diff = compare_images(a, b);
+        print_image_diff(diff);
+        return diff.identical() ? 0 : 1;
+    }
+
+    if (!makeTextureIn.empty()) {
+        cv::Mat image = cv::imread(makeTextureIn);
+        if (image.empty()) {
+            std::cerr << "Error: Could not read " << makeTextureIn << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        if (!write_tiled_texture(image, makeTextureOut)) std::exit(EXIT_FAILURE);
+        std::cout << "Wrote " << makeTextureOut << ": " << image.cols << "x" << image.rows << " in "
+                  << TEXTURE_TILE << "x" << TEXTURE_TILE << " tiles" << std::endl;
+        return 0;
+    }
+
+    if (!sendAddr.empty()) {
+        return run_client(sendAddr, sendCommand);
+    }
+
+    std::vector<Object*> scene;
+    if (!build_scene(meshFile, instances, numThreads, scene)) {
+        std::exit(EXIT_FAILURE);
+    }
+    for (const std::string &spec : textures) {
+        if (!attach_texture(spec, scene)) {
+            delete_scene(scene);
+            std::exit(EXIT_FAILURE);
+        }
+    }
+
+    if (!daemonAddr.empty()) {
+        int code = run_daemon(daemonAddr, scene, numThreads);
+        delete_scene(scene);
+        return code;
+    }
+
+    if (!coordinatorAddr.empty() || !workerAddr.empty()) {
+        int code = workerAddr.empty()
+            ? run_coordinator(coordinatorAddr, w, h, scene, sceneHash, "result." + format, tile, spawn)
+            : run_worker(workerAddr, scene, sceneHash);
+        delete_scene(scene);
+        return code;
+    }
+
+    if (verify) {
+        cv::Mat img(region.height(), region.width(), CV_32FC3), ref(h, w, CV_32FC3);
+        render_region(w, h, region, scene, img, numThreads);
+        render_reference(w, h, scene, ref);
+        std::cout << "Verify: pthread load-balanced" << (use_wavefront ? " wavefront" : static_dispatch ? " static dispatch" : "") << " (" << numThreads << " threads) vs sequential";
+        if (!use_wavefront) {
+            Shader shader = select_shader(scene);
+            std::cout << ", shading kernel " << (shader.reflective ? "reflective" : "no reflection")
+                      << (shader.textured ? ", textured" : ", solid") << ", specular_k ";
+            if (shader.specular_k) std::cout << shader.specular_k;
+            else std::cout << "per object";
+            std::cout << ", " << isa_name(isa) << " kernels";
+        }
+        if (replicate_scene) std::cout << ", replicated scene";
+        if (!regionText.empty()) std::cout << ", region " << regionText;
+        std::cout << std::endl;
+        ImageDiff diff = compare_images(img, ref(cv::Rect(region.x0, region.y0, region.width(), region.height())));
+        print_image_diff(diff);
+        delete_scene(scene);
+        return diff.identical() ? 0 : 1;
+    }
 
     auto start_time = std::chrono::high_resolution_clock::now();
     rendering(
         w, h,
         scene,
-        "result.png",
-        numThreads
+        "result." + format,
+        numThreads,
+        &region,
+        baseImage
     );
     auto end_time = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
     std::cout << "Rendering completed in " << duration.count() << " milliseconds." << std::endl;
-    
-    for (auto obj : scene) {
-        delete obj;
+    if (texture_cache.reads()) {
+        std::cout << "Texture cache: " << texture_cache.reads() << " tiles read, " << texture_cache.evictions()
+                  << " evicted, " << (texture_cache.resident() * TEXTURE_TILE_BYTES >> 20) << " of "
+                  << (texture_cache.budget() >> 20) << " MB used" << std::endl;
     }
+    
+    delete_scene(scene);
 
     return 0;
 }
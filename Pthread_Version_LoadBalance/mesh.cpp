@@ -0,0 +1,782 @@
+# include "mesh.h"
+
+# include <algorithm>
+# include <cmath>
+# include <cstring>
+# include <limits>
+# include <sstream>
+# include <fcntl.h>
+# include <pthread.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+# if defined(__SSE__)
+# include <xmmintrin.h>
+# endif
+
+/* Memory-mapped input file */
+class MappedFile {
+public:
+
+    explicit MappedFile(const std::string &filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                base = static_cast<const char*>(p);
+                length = st.st_size;
+            }
+        }
+        close(fd);
+    }
+
+    ~MappedFile() {
+        if (base) munmap(const_cast<char*>(base), length);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool ok() const { return base != nullptr; }
+    const char *begin() const { return base; }
+    const char *end() const { return base + length; }
+    size_t size() const { return length; }
+
+private:
+    const char *base = nullptr;
+    size_t length = 0;
+};
+
+/* Number parsing on [p, end); the mapping is not NUL-terminated */
+static inline bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+static inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+static void skip_spaces(const char *&p, const char *end) {
+    while (p < end && is_space(*p)) ++p;
+}
+
+static void skip_line(const char *&p, const char *end) {
+    while (p < end && *p != '\n') ++p;
+    if (p < end) ++p;
+}
+
+static bool parse_int(const char *&p, const char *end, long &out) {
+    const char *q = p;
+    bool negative = false;
+    if (q < end && (*q == '-' || *q == '+')) negative = *q++ == '-';
+    if (q >= end || !is_digit(*q)) return false;
+    long value = 0;
+    while (q < end && is_digit(*q)) value = value * 10 + (*q++ - '0');
+    out = negative ? -value : value;
+    p = q;
+    return true;
+}
+
+static bool parse_double(const char *&p, const char *end, double &out) {
+    static const double pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char *q = p;
+    bool negative = false, digits = false;
+    if (q < end && (*q == '-' || *q == '+')) negative = *q++ == '-';
+    double mantissa = 0.;
+    int exponent = 0;
+    while (q < end && is_digit(*q)) {
+        mantissa = mantissa * 10. + (*q++ - '0');
+        digits = true;
+    }
+    if (q < end && *q == '.') {
+        ++q;
+        while (q < end && is_digit(*q)) {
+            mantissa = mantissa * 10. + (*q++ - '0');
+            --exponent;
+            digits = true;
+        }
+    }
+    if (!digits) return false;
+    if (q < end && (*q == 'e' || *q == 'E')) {
+        const char *r = q + 1;
+        long e;
+        if (parse_int(r, end, e)) {
+            exponent += int(e);
+            q = r;
+        }
+    }
+    double value;
+    if (exponent >= 0 && exponent <= 22) value = mantissa * pow10[exponent];
+    else if (exponent < 0 && exponent >= -22) value = mantissa / pow10[-exponent];
+    else value = mantissa * std::pow(10., exponent);
+    out = negative ? -value : value;
+    p = q;
+    return true;
+}
+
+static bool parse_vec3(const char *&p, const char *end, vec3 &out) {
+    double x, y, z;
+    skip_spaces(p, end);
+    if (!parse_double(p, end, x)) return false;
+    skip_spaces(p, end);
+    if (!parse_double(p, end, y)) return false;
+    skip_spaces(p, end);
+    if (!parse_double(p, end, z)) return false;
+    out = vec3(x, y, z);
+    return true;
+}
+
+static bool has_extension(const std::string &filename, const std::string &ext) {
+    if (filename.size() < ext.size()) return false;
+    std::string tail = filename.substr(filename.size() - ext.size());
+    std::transform(tail.begin(), tail.end(), tail.begin(), ::tolower);
+    return tail == ext;
+}
+
+/* OBJ */
+
+// A face corner. Negative OBJ indices are relative to the vertices read so
+// far, which a chunk only knows locally; they are resolved after merging.
+struct ObjCorner {
+    long v, n;
+    bool v_relative, n_relative, has_normal;
+};
+
+struct ObjChunk {
+    const char *begin;
+    const char *end;
+    std::vector<vec3> positions;
+    std::vector<vec3> normals;
+    std::vector<ObjCorner> corners;     // 3 per triangle
+    bool ok;
+};
+
+static bool parse_obj_corner(const char *&p, const char *end, const ObjChunk &chunk, ObjCorner &corner) {
+    long index;
+    if (!parse_int(p, end, index) || index == 0) return false;
+    corner.v_relative = index < 0;
+    corner.v = index < 0 ? long(chunk.positions.size()) + index : index - 1;
+    corner.has_normal = false;
+    if (p < end && *p == '/') {
+        ++p;
+        long texcoord;
+        parse_int(p, end, texcoord);  // texture coordinates are not used
+        if (p < end && *p == '/') {
+            ++p;
+            if (!parse_int(p, end, index) || index == 0) return false;
+            corner.has_normal = true;
+            corner.n_relative = index < 0;
+            corner.n = index < 0 ? long(chunk.normals.size()) + index : index - 1;
+        }
+    }
+    return p >= end || is_space(*p) || *p == '\n';
+}
+
+static void* parse_obj_chunk(void* arg) {
+    ObjChunk* chunk = static_cast<ObjChunk*>(arg);
+    const char *p = chunk->begin, *end = chunk->end;
+    std::vector<ObjCorner> polygon;
+    chunk->ok = true;
+
+    while (p < end && chunk->ok) {
+        skip_spaces(p, end);
+        if (end - p > 2 && p[0] == 'v' && is_space(p[1])) {
+            p += 2;
+            vec3 v;
+            if (!parse_vec3(p, end, v)) chunk->ok = false;
+            chunk->positions.push_back(v);
+        }
+        else if (end - p > 3 && p[0] == 'v' && p[1] == 'n' && is_space(p[2])) {
+            p += 3;
+            vec3 n;
+            if (!parse_vec3(p, end, n)) chunk->ok = false;
+            chunk->normals.push_back(n);
+        }
+        else if (end - p > 2 && p[0] == 'f' && is_space(p[1])) {
+            p += 2;
+            polygon.clear();
+            while (true) {
+                skip_spaces(p, end);
+                if (p >= end || *p == '\n' || *p == '#') break;
+                ObjCorner corner;
+                if (!parse_obj_corner(p, end, *chunk, corner)) {
+                    chunk->ok = false;
+                    break;
+                }
+                polygon.push_back(corner);
+            }
+            if (polygon.size() < 3) chunk->ok = false;
+            // Triangulate as a fan around the first corner
+            for (size_t k = 1; chunk->ok && k + 1 < polygon.size(); ++k) {
+                chunk->corners.push_back(polygon[0]);
+                chunk->corners.push_back(polygon[k]);
+                chunk->corners.push_back(polygon[k + 1]);
+            }
+        }
+        skip_line(p, end);
+    }
+    return nullptr;
+}
+
+bool load_obj(const std::string &filename, MeshData &mesh, int numThreads) {
+    MappedFile file(filename);
+    if (!file.ok()) {
+        std::cerr << "Error: Could not read " << filename << std::endl;
+        return false;
+    }
+
+    // Split into line-aligned chunks, one per thread
+    numThreads = std::max(1, std::min<int>(numThreads, int(file.size() / 4096) + 1));
+    std::vector<ObjChunk> chunks(numThreads);
+    for (int i = 0; i < numThreads; ++i) {
+        const char *p = file.begin() + file.size() * i / numThreads;
+        if (i > 0) {
+            while (p < file.end() && p[-1] != '\n') ++p;
+        }
+        chunks[i].begin = p;
+        if (i > 0) chunks[i - 1].end = p;
+    }
+    chunks[numThreads - 1].end = file.end();
+
+    if (numThreads == 1) {
+        parse_obj_chunk(&chunks[0]);
+    } else {
+        std::vector<pthread_t> threads(numThreads);
+        for (int i = 0; i < numThreads; ++i) {
+            pthread_create(&threads[i], nullptr, parse_obj_chunk, &chunks[i]);
+        }
+        for (int i = 0; i < numThreads; ++i) {
+            pthread_join(threads[i], nullptr);
+        }
+    }
+
+    // Merge in file order, resolving relative and out-of-range indices
+    mesh = MeshData();
+    size_t triangles = 0;
+    for (const ObjChunk &chunk : chunks) {
+        if (!chunk.ok) {
+            std::cerr << "Error: Malformed vertex or face line in " << filename << std::endl;
+            return false;
+        }
+        triangles += chunk.corners.size() / 3;
+    }
+    mesh.indices.reserve(3 * triangles);
+    mesh.normal_indices.reserve(3 * triangles);
+    for (const ObjChunk &chunk : chunks) {
+        mesh.positions.insert(mesh.positions.end(), chunk.positions.begin(), chunk.positions.end());
+        mesh.normals.insert(mesh.normals.end(), chunk.normals.begin(), chunk.normals.end());
+    }
+    long v_offset = 0, n_offset = 0;
+    for (const ObjChunk &chunk : chunks) {
+        for (size_t k = 0; k < chunk.corners.size(); k += 3) {
+            bool normals = true;
+            for (int c = 0; c < 3; ++c) {
+                const ObjCorner &corner = chunk.corners[k + c];
+                long v = corner.v + (corner.v_relative ? v_offset : 0);
+                if (v < 0 || v >= long(mesh.positions.size())) {
+                    std::cerr << "Error: Vertex index out of range in " << filename << std::endl;
+                    return false;
+                }
+                mesh.indices.push_back(uint32_t(v));
+                normals = normals && corner.has_normal;
+            }
+            for (int c = 0; c < 3; ++c) {
+                const ObjCorner &corner = chunk.corners[k + c];
+                long n = normals ? corner.n + (corner.n_relative ? n_offset : 0) : -1;
+                if (normals && (n < 0 || n >= long(mesh.normals.size()))) {
+                    std::cerr << "Error: Normal index out of range in " << filename << std::endl;
+                    return false;
+                }
+                mesh.normal_indices.push_back(normals ? uint32_t(n) : NO_NORMAL);
+            }
+        }
+        v_offset += long(chunk.positions.size());
+        n_offset += long(chunk.normals.size());
+    }
+    return true;
+}
+
+/* PLY */
+
+enum PlyType { PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64, PLY_INVALID };
+
+struct PlyProperty {
+    std::string name;
+    PlyType type;
+    PlyType count_type;     // PLY_INVALID unless this is a list
+};
+
+struct PlyElement {
+    std::string name;
+    long count;
+    std::vector<PlyProperty> properties;
+};
+
+static PlyType ply_type(const std::string &name) {
+    if (name == "char" || name == "int8") return PLY_INT8;
+    if (name == "uchar" || name == "uint8") return PLY_UINT8;
+    if (name == "short" || name == "int16") return PLY_INT16;
+    if (name == "ushort" || name == "uint16") return PLY_UINT16;
+    if (name == "int" || name == "int32") return PLY_INT32;
+    if (name == "uint" || name == "uint32") return PLY_UINT32;
+    if (name == "float" || name == "float32") return PLY_FLOAT32;
+    if (name == "double" || name == "float64") return PLY_FLOAT64;
+    return PLY_INVALID;
+}
+
+static size_t ply_size(PlyType type) {
+    static const size_t sizes[] = {1, 1, 2, 2, 4, 4, 4, 8, 0};
+    return sizes[type];
+}
+
+// Reads one value of a binary or ASCII body, advancing p
+class PlyReader {
+public:
+
+    PlyReader(const char *p, const char *end, bool ascii, bool swap): p(p), end(end), ascii(ascii), swap(swap), ok(true) {}
+
+    double read(PlyType type) {
+        if (ascii) {
+            double value = 0.;
+            while (p < end && (is_space(*p) || *p == '\n')) ++p;
+            if (!parse_double(p, end, value)) ok = false;
+            return value;
+        }
+        size_t size = ply_size(type);
+        if (size_t(end - p) < size) {
+            ok = false;
+            return 0.;
+        }
+        unsigned char bytes[8];
+        std::memcpy(bytes, p, size);
+        p += size;
+        if (swap) std::reverse(bytes, bytes + size);
+        switch (type) {
+            case PLY_INT8: { int8_t v; std::memcpy(&v, bytes, 1); return v; }
+            case PLY_UINT8: { uint8_t v; std::memcpy(&v, bytes, 1); return v; }
+            case PLY_INT16: { int16_t v; std::memcpy(&v, bytes, 2); return v; }
+            case PLY_UINT16: { uint16_t v; std::memcpy(&v, bytes, 2); return v; }
+            case PLY_INT32: { int32_t v; std::memcpy(&v, bytes, 4); return v; }
+            case PLY_UINT32: { uint32_t v; std::memcpy(&v, bytes, 4); return v; }
+            case PLY_FLOAT32: { float v; std::memcpy(&v, bytes, 4); return v; }
+            case PLY_FLOAT64: { double v; std::memcpy(&v, bytes, 8); return v; }
+            default: ok = false; return 0.;
+        }
+    }
+
+    const char *p;
+    const char *end;
+    bool ascii;
+    bool swap;
+    bool ok;
+};
+
+bool load_ply(const std::string &filename, MeshData &mesh) {
+    MappedFile file(filename);
+    if (!file.ok()) {
+        std::cerr << "Error: Could not read " << filename << std::endl;
+        return false;
+    }
+
+    // Header
+    const char *p = file.begin();
+    std::vector<PlyElement> elements;
+    std::string format;
+    bool header_done = false;
+    for (int line_no = 0; p < file.end() && !header_done; ++line_no) {
+        const char *line_end = p;
+        while (line_end < file.end() && *line_end != '\n') ++line_end;
+        std::istringstream line(std::string(p, line_end));
+        p = line_end < file.end() ? line_end + 1 : line_end;
+
+        std::string keyword;
+        line >> keyword;
+        if (line_no == 0 && keyword != "ply") break;
+        if (keyword == "format") {
+            line >> format;
+        }
+        else if (keyword == "element") {
+            PlyElement element;
+            line >> element.name >> element.count;
+            elements.push_back(element);
+        }
+        else if (keyword == "property" && !elements.empty()) {
+            std::string type;
+            PlyProperty property;
+            line >> type;
+            property.count_type = PLY_INVALID;
+            if (type == "list") {
+                std::string count_type;
+                line >> count_type >> type;
+                property.count_type = ply_type(count_type);
+            }
+            line >> property.name;
+            property.type = ply_type(type);
+            elements.back().properties.push_back(property);
+        }
+        else if (keyword == "end_header") {
+            header_done = true;
+        }
+    }
+    bool ascii = format == "ascii";
+    bool big_endian = format == "binary_big_endian";
+    if (!header_done || (!ascii && !big_endian && format != "binary_little_endian")) {
+        std::cerr << "Error: Unsupported or malformed PLY header in " << filename << std::endl;
+        return false;
+    }
+    const uint16_t probe = 1;
+    bool host_little = *reinterpret_cast<const uint8_t*>(&probe) == 1;
+
+    // Body
+    mesh = MeshData();
+    PlyReader reader(p, file.end(), ascii, big_endian == host_little);
+    bool has_normals = false;
+    for (const PlyElement &element : elements) {
+        int x = -1, y = -1, z = -1, nx = -1, ny = -1, nz = -1, face = -1;
+        for (size_t k = 0; k < element.properties.size(); ++k) {
+            const std::string &name = element.properties[k].name;
+            if (name == "x") x = int(k);
+            else if (name == "y") y = int(k);
+            else if (name == "z") z = int(k);
+            else if (name == "nx") nx = int(k);
+            else if (name == "ny") ny = int(k);
+            else if (name == "nz") nz = int(k);
+            else if (name == "vertex_indices" || name == "vertex_index") face = int(k);
+        }
+        bool vertices = element.name == "vertex" && x >= 0 && y >= 0 && z >= 0;
+        bool normals = vertices && nx >= 0 && ny >= 0 && nz >= 0;
+        has_normals = has_normals || normals;
+
+        std::vector<double> values(element.properties.size());
+        std::vector<long> polygon;
+        for (long i = 0; i < element.count && reader.ok; ++i) {
+            for (size_t k = 0; k < element.properties.size(); ++k) {
+                const PlyProperty &property = element.properties[k];
+                if (property.count_type == PLY_INVALID) {
+                    values[k] = reader.read(property.type);
+                    continue;
+                }
+                long count = long(reader.read(property.count_type));
+                if (int(k) == face) polygon.clear();
+                for (long c = 0; c < count && reader.ok; ++c) {
+                    double index = reader.read(property.type);
+                    if (int(k) == face) polygon.push_back(long(index));
+                }
+            }
+            if (vertices) {
+                mesh.positions.push_back(vec3(values[x], values[y], values[z]));
+                if (normals) mesh.normals.push_back(vec3(values[nx], values[ny], values[nz]));
+            }
+            if (element.name == "face" && face >= 0) {
+                for (size_t c = 1; c + 1 < polygon.size(); ++c) {
+                    mesh.indices.push_back(uint32_t(polygon[0]));
+                    mesh.indices.push_back(uint32_t(polygon[c]));
+                    mesh.indices.push_back(uint32_t(polygon[c + 1]));
+                }
+            }
+        }
+    }
+    if (!reader.ok) {
+        std::cerr << "Error: Truncated or malformed PLY body in " << filename << std::endl;
+        return false;
+    }
+    for (uint32_t index : mesh.indices) {
+        if (index >= mesh.positions.size()) {
+            std::cerr << "Error: Vertex index out of range in " << filename << std::endl;
+            return false;
+        }
+    }
+    if (has_normals && mesh.normals.size() == mesh.positions.size()) {
+        mesh.normal_indices = mesh.indices;
+    } else {
+        mesh.normals.clear();
+        mesh.normal_indices.assign(mesh.indices.size(), NO_NORMAL);
+    }
+    return true;
+}
+
+bool load_mesh(const std::string &filename, MeshData &mesh, int numThreads) {
+    if (has_extension(filename, ".obj")) return load_obj(filename, mesh, numThreads);
+    if (has_extension(filename, ".ply")) return load_ply(filename, mesh);
+    std::cerr << "Error: Unknown mesh format " << filename << " (expected .obj or .ply)" << std::endl;
+    return false;
+}
+
+/* class TriangleGeometry */
+TriangleGeometry::TriangleGeometry(const MeshData &mesh): data(mesh) {
+    size_t n = data.triangle_count();
+    if (data.normal_indices.size() != data.indices.size()) {
+        data.normal_indices.assign(data.indices.size(), NO_NORMAL);
+    }
+    if (n == 0) return;
+
+    std::vector<uint32_t> order(n);
+    std::vector<vec3> centroids(n);
+    for (size_t i = 0; i < n; ++i) {
+        order[i] = uint32_t(i);
+        centroids[i] = (vertex(i, 0) + vertex(i, 1) + vertex(i, 2)) / 3.f;
+    }
+    packets.reserve(n / 4 + 1);
+    nodes.reserve(n / 2 + 1);
+    build(order, centroids, 0, n);
+}
+
+uint32_t TriangleGeometry::build(std::vector<uint32_t> &order, std::vector<vec3> &centroids, size_t begin, size_t end) {
+    uint32_t index = uint32_t(nodes.size());
+    nodes.push_back(Node());
+
+    Node node;
+    vec3 lo(std::numeric_limits<float>::infinity()), hi(-std::numeric_limits<float>::infinity());
+    vec3 clo = lo, chi = hi;
+    for (size_t k = begin; k < end; ++k) {
+        for (int c = 0; c < 3; ++c) {
+            lo = glm::min(lo, vertex(order[k], c));
+            hi = glm::max(hi, vertex(order[k], c));
+        }
+        clo = glm::min(clo, centroids[order[k]]);
+        chi = glm::max(chi, centroids[order[k]]);
+    }
+    for (int a = 0; a < 3; ++a) {
+        node.lo[a] = lo[a];
+        node.hi[a] = hi[a];
+    }
+
+    if (end - begin <= 4) {
+        Packet packet;
+        std::memset(&packet, 0, sizeof packet);
+        for (int lane = 0; lane < 4; ++lane) {
+            packet.id[lane] = std::numeric_limits<uint32_t>::max();
+            if (begin + lane >= end) continue;  // zero edges: never hit
+            uint32_t triangle = order[begin + lane];
+            vec3 v0 = vertex(triangle, 0), e1 = vertex(triangle, 1) - v0, e2 = vertex(triangle, 2) - v0;
+            for (int a = 0; a < 3; ++a) {
+                packet.v0[a][lane] = v0[a];
+                packet.e1[a][lane] = e1[a];
+                packet.e2[a][lane] = e2[a];
+            }
+            packet.id[lane] = triangle;
+        }
+        node.offset = uint32_t(packets.size());
+        node.count = 1;
+        node.axis = 0;
+        packets.push_back(packet);
+        nodes[index] = node;
+        return index;
+    }
+
+    // Median split on the widest centroid axis; the left half is a multiple
+    // of 4 triangles so leaf packets stay full
+    vec3 extent = chi - clo;
+    int axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z ? 1 : 2);
+    size_t mid = begin + ((end - begin) / 2 + 3) / 4 * 4;
+    std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+        [&](uint32_t a, uint32_t b) { return centroids[a][axis] < centroids[b][axis]; });
+
+    build(order, centroids, begin, mid);
+    node.offset = build(order, centroids, mid, end);
+    node.count = 0;
+    node.axis = uint16_t(axis);
+    nodes[index] = node;
+    return index;
+}
+
+vec3 TriangleGeometry::bounds_min() const {
+    if (nodes.empty()) return vec3(0., 0., 0.);
+    return vec3(nodes[0].lo[0], nodes[0].lo[1], nodes[0].lo[2]);
+}
+
+vec3 TriangleGeometry::bounds_max() const {
+    if (nodes.empty()) return vec3(0., 0., 0.);
+    return vec3(nodes[0].hi[0], nodes[0].hi[1], nodes[0].hi[2]);
+}
+
+static inline bool hit_box(const float lo[3], const float hi[3], const float org[3], const float inv[3], float t_max) {
+    float t0 = 0.f, t1 = t_max;
+    for (int a = 0; a < 3; ++a) {
+        float ta = (lo[a] - org[a]) * inv[a], tb = (hi[a] - org[a]) * inv[a];
+        if (ta > tb) std::swap(ta, tb);
+        t0 = std::max(t0, ta);
+        t1 = std::min(t1, tb);
+    }
+    return t0 <= t1;
+}
+
+// Moller-Trumbore against the 4 triangles of a packet at once. Updates
+// best/triangle/u/v if one of them is closer than best.
+template <class Packet>
+static inline void intersect_packet(const Packet &p, const vec3 &o, const vec3 &d, float &best, uint32_t &triangle, float &u, float &v) {
+# if defined(__SSE__)
+    const __m128 dx = _mm_set1_ps(d.x), dy = _mm_set1_ps(d.y), dz = _mm_set1_ps(d.z);
+    const __m128 e1x = _mm_loadu_ps(p.e1[0]), e1y = _mm_loadu_ps(p.e1[1]), e1z = _mm_loadu_ps(p.e1[2]);
+    const __m128 e2x = _mm_loadu_ps(p.e2[0]), e2y = _mm_loadu_ps(p.e2[1]), e2z = _mm_loadu_ps(p.e2[2]);
+
+    // pvec = d x e2, det = e1 . pvec
+    __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+    __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.f), det);
+
+    // tvec = o - v0, u = tvec . pvec
+    __m128 tx = _mm_sub_ps(_mm_set1_ps(o.x), _mm_loadu_ps(p.v0[0]));
+    __m128 ty = _mm_sub_ps(_mm_set1_ps(o.y), _mm_loadu_ps(p.v0[1]));
+    __m128 tz = _mm_sub_ps(_mm_set1_ps(o.z), _mm_loadu_ps(p.v0[2]));
+    __m128 uu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv_det);
+
+    // qvec = tvec x e1, v = d . qvec, t = e2 . qvec
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+    __m128 vv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+    __m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+
+    const __m128 zero = _mm_setzero_ps();
+    __m128 abs_det = _mm_andnot_ps(_mm_set1_ps(-0.f), det);
+    __m128 mask = _mm_cmpgt_ps(abs_det, _mm_set1_ps(1e-12f));
+    mask = _mm_and_ps(mask, _mm_cmpge_ps(uu, zero));
+    mask = _mm_and_ps(mask, _mm_cmpge_ps(vv, zero));
+    mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(uu, vv), _mm_set1_ps(1.f)));
+    mask = _mm_and_ps(mask, _mm_cmpgt_ps(tt, _mm_set1_ps(1e-6f)));
+    mask = _mm_and_ps(mask, _mm_cmplt_ps(tt, _mm_set1_ps(best)));
+    int bits = _mm_movemask_ps(mask);
+    if (!bits) return;
+
+    float ts[4], us[4], vs[4];
+    _mm_storeu_ps(ts, tt);
+    _mm_storeu_ps(us, uu);
+    _mm_storeu_ps(vs, vv);
+    for (int lane = 0; lane < 4; ++lane) {
+        if ((bits >> lane & 1) && ts[lane] < best) {
+            best = ts[lane];
+            triangle = p.id[lane];
+            u = us[lane];
+            v = vs[lane];
+        }
+    }
+# else
+    for (int lane = 0; lane < 4; ++lane) {
+        vec3 e1(p.e1[0][lane], p.e1[1][lane], p.e1[2][lane]);
+        vec3 e2(p.e2[0][lane], p.e2[1][lane], p.e2[2][lane]);
+        vec3 pvec = glm::cross(d, e2);
+        float det = glm::dot(e1, pvec);
+        if (std::abs(det) <= 1e-12f) continue;
+        float inv_det = 1.f / det;
+        vec3 tvec = o - vec3(p.v0[0][lane], p.v0[1][lane], p.v0[2][lane]);
+        float uu = glm::dot(tvec, pvec) * inv_det;
+        vec3 qvec = glm::cross(tvec, e1);
+        float vv = glm::dot(d, qvec) * inv_det;
+        float tt = glm::dot(e2, qvec) * inv_det;
+        if (uu >= 0 && vv >= 0 && uu + vv <= 1 && tt > 1e-6f && tt < best) {
+            best = tt;
+            triangle = p.id[lane];
+            u = uu;
+            v = vv;
+        }
+    }
+# endif
+}
+
+float TriangleGeometry::intersect(const vec3& origin, const vec3& dir, uint32_t &triangle, float &u, float &v) const {
+    float best = std::numeric_limits<float>::infinity();
+    if (nodes.empty()) return best;
+
+    const float org[3] = {origin.x, origin.y, origin.z};
+    const float inv[3] = {1.f / dir.x, 1.f / dir.y, 1.f / dir.z};
+    uint32_t stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        uint32_t index = stack[--top];
+        const Node &node = nodes[index];
+        if (!hit_box(node.lo, node.hi, org, inv, best)) continue;
+        if (node.count > 0) {
+            for (uint32_t k = 0; k < node.count; ++k) {
+                intersect_packet(packets[node.offset + k], origin, dir, best, triangle, u, v);
+            }
+            continue;
+        }
+        // Push the far child first so the near one is visited first
+        uint32_t near_child = index + 1, far_child = node.offset;
+        if (inv[node.axis] < 0) std::swap(near_child, far_child);
+        stack[top++] = far_child;
+        stack[top++] = near_child;
+    }
+    return best;
+}
+
+vec3 TriangleGeometry::normal(uint32_t triangle, float u, float v) const {
+    uint32_t n0 = data.normal_indices[3 * triangle];
+    if (n0 != NO_NORMAL) {
+        const vec3 &a = data.normals[n0];
+        const vec3 &b = data.normals[data.normal_indices[3 * triangle + 1]];
+        const vec3 &c = data.normals[data.normal_indices[3 * triangle + 2]];
+        return normalizes(a * (1.f - u - v) + b * u + c * v);
+    }
+    vec3 v0 = vertex(triangle, 0);
+    return normalizes(glm::cross(vertex(triangle, 1) - v0, vertex(triangle, 2) - v0));
+}
+
+vec3 TriangleGeometry::normal_at(const vec3& point) const {
+    float best = std::numeric_limits<float>::infinity();
+    uint32_t best_triangle = 0;
+    float best_u = 0.f, best_v = 0.f;
+    for (uint32_t i = 0; i < triangle_count(); ++i) {
+        vec3 a = vertex(i, 0), e1 = vertex(i, 1) - a, e2 = vertex(i, 2) - a, ap = point - a;
+        float d00 = glm::dot(e1, e1), d01 = glm::dot(e1, e2), d11 = glm::dot(e2, e2);
+        float d20 = glm::dot(ap, e1), d21 = glm::dot(ap, e2);
+        float denom = d00 * d11 - d01 * d01;
+        if (denom <= 0) continue;
+        float u = (d11 * d20 - d01 * d21) / denom, v = (d00 * d21 - d01 * d20) / denom;
+        u = std::min(std::max(u, 0.f), 1.f);
+        v = std::min(std::max(v, 0.f), 1.f - u);
+        vec3 closest = a + e1 * u + e2 * v;
+        float distance = glm::dot(point - closest, point - closest);
+        if (distance < best) {
+            best = distance;
+            best_triangle = i;
+            best_u = u;
+            best_v = v;
+        }
+    }
+    return normal(best_triangle, best_u, best_v);
+}
+
+/* class TriangleMesh */
+TriangleMesh::TriangleMesh(
+    std::shared_ptr<const TriangleGeometry> geometry,
+    vec3 color,
+    float reflection,
+    float diffuse,
+    float specular_c,
+    float specular_k
+): Object((geometry->bounds_min() + geometry->bounds_max()) * .5f, color, reflection, diffuse, specular_c, specular_k), geometry(geometry) {}
+
+float TriangleMesh::intersect(const vec3& origin, const vec3& dir) {
+    uint32_t triangle;
+    float u, v;
+    return geometry->intersect(origin, dir, triangle, u, v);
+}
+
+float TriangleMesh::intersect_hit(const vec3& origin, const vec3& dir, HitRecord &record) {
+    return geometry->intersect(origin, dir, record.triangle, record.u, record.v);
+}
+
+vec3 TriangleMesh::get_normal(const vec3& point) { return geometry->normal_at(point); }
+
+vec3 TriangleMesh::get_hit_normal(const vec3& point, const vec3& dir, const HitRecord &record) {
+    vec3 n = geometry->normal(record.triangle, record.u, record.v);
+    return glm::dot(n, dir) > 0 ? -n : n;
+}
+
+bool TriangleMesh::bounds(vec3 &lo, vec3 &hi) const {
+    lo = geometry->bounds_min();
+    hi = geometry->bounds_max();
+    return geometry->triangle_count() > 0;
+}
+
+Object* TriangleMesh::clone() const {
+    TriangleMesh* copy = new TriangleMesh(std::make_shared<const TriangleGeometry>(*geometry), color, reflection, diffuse,
+                                          specular_c, specular_k);
+    copy->texture = texture;
+    return copy;
+}
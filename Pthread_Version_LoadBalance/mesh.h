@@ -0,0 +1,107 @@
+#ifndef MESH_H
+#define MESH_H
+
+# include "graph.h"
+# include <cstdint>
+# include <memory>
+# include <string>
+# include <vector>
+
+// Marks a triangle without vertex normals in MeshData::normal_indices
+const uint32_t NO_NORMAL = 0xffffffffu;
+
+// Indexed triangle data as read from an OBJ or PLY file
+struct MeshData {
+    std::vector<vec3> positions;
+    std::vector<vec3> normals;
+    std::vector<uint32_t> indices;          // 3 per triangle, into positions
+    std::vector<uint32_t> normal_indices;   // 3 per triangle, into normals; NO_NORMAL if absent
+
+    size_t triangle_count() const { return indices.size() / 3; }
+};
+
+// Loads an .obj or .ply file (chosen by extension) through mmap. OBJ files
+// are parsed in numThreads line-aligned chunks. Returns false and reports
+// the reason on std::cerr if the file cannot be read or parsed.
+bool load_mesh(const std::string &filename, MeshData &mesh, int numThreads = 1);
+bool load_obj(const std::string &filename, MeshData &mesh, int numThreads = 1);
+bool load_ply(const std::string &filename, MeshData &mesh);
+
+// Triangle soup with a BVH whose leaves are packets of 4 triangles, tested
+// together with a 4-wide Moller-Trumbore kernel. Immutable once built, so
+// one instance can back any number of objects.
+class TriangleGeometry {
+public:
+
+    explicit TriangleGeometry(const MeshData &data);
+
+    // Closest hit distance along (origin, dir), or infinity. On a hit,
+    // triangle and the barycentrics (u, v) of the hit point are set.
+    float intersect(const vec3& origin, const vec3& dir, uint32_t &triangle, float &u, float &v) const;
+
+    // Interpolated vertex normal, or the face normal if the triangle has none
+    vec3 normal(uint32_t triangle, float u, float v) const;
+
+    // Normal of the triangle closest to point; brute force, not on the render path
+    vec3 normal_at(const vec3& point) const;
+
+    size_t triangle_count() const { return data.triangle_count(); }
+    vec3 bounds_min() const;
+    vec3 bounds_max() const;
+
+private:
+
+    struct Packet {
+        float v0[3][4];     // [axis][lane]
+        float e1[3][4];
+        float e2[3][4];
+        uint32_t id[4];     // triangle index; padding lanes are degenerate
+    };
+
+    struct Node {
+        float lo[3], hi[3];
+        uint32_t offset;    // leaf: first packet, inner: right child (left is next)
+        uint16_t count;     // packets in a leaf, 0 for inner nodes
+        uint16_t axis;      // split axis of an inner node
+    };
+
+    MeshData data;
+    std::vector<Packet> packets;
+    std::vector<Node> nodes;
+
+    vec3 vertex(uint32_t triangle, int corner) const { return data.positions[data.indices[3 * triangle + corner]]; }
+    uint32_t build(std::vector<uint32_t> &order, std::vector<vec3> &centroids, size_t begin, size_t end);
+};
+
+class TriangleMesh : public Object {
+public:
+
+    const std::shared_ptr<const TriangleGeometry> geometry;
+
+    TriangleMesh(
+        std::shared_ptr<const TriangleGeometry> geometry,
+        vec3 color,
+        float reflection = .15,
+        float diffuse = 1.,
+        float specular_c = .6,
+        float specular_k = 50
+    );
+
+    float intersect(const vec3& origin, const vec3& dir) override;
+
+    // Records the triangle hit and the barycentrics of the hit point
+    float intersect_hit(const vec3& origin, const vec3& dir, HitRecord &record) override;
+
+    // Brute force over all triangles, see normal_at; shading uses get_hit_normal
+    vec3 get_normal(const vec3& point) override;
+
+    // Normal of the triangle in record, facing back towards the ray
+    vec3 get_hit_normal(const vec3& point, const vec3& dir, const HitRecord &record) override;
+
+    bool bounds(vec3 &lo, vec3 &hi) const override;
+
+    // Copies the geometry too, so a replica does not read another node's memory
+    Object* clone() const override;
+};
+
+#endif // MESH_H
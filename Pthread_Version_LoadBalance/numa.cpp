@@ -0,0 +1,131 @@
+# include "numa.h"
+
+# include <algorithm>
+# include <cstdio>
+# include <fstream>
+# include <map>
+# include <set>
+# include <sstream>
+# include <string>
+# include <dirent.h>
+# include <sched.h>
+
+// Parses a kernel cpulist such as "0-3,8-11"
+static std::vector<int> parse_cpulist(const std::string &list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        int first, last;
+        int fields = std::sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (fields < 1) continue;
+        if (fields == 1) last = first;
+        for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+static bool read_line(const std::string &path, std::string &line) {
+    std::ifstream file(path);
+    return static_cast<bool>(std::getline(file, line));
+}
+
+static int read_int(const std::string &path, int fallback) {
+    std::string line;
+    if (!read_line(path, line)) return fallback;
+    try {
+        return std::stoi(line);
+    } catch (const std::exception&) {
+        return fallback;
+    }
+}
+
+Topology discover_topology() {
+    // CPUs we are allowed on; taskset and cgroup cpusets shrink this
+    std::set<int> allowed;
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (sched_getaffinity(0, sizeof mask, &mask) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &mask)) allowed.insert(cpu);
+        }
+    }
+
+    // Kernel node id of every CPU
+    std::map<int, int> os_node_of;
+    if (DIR *dir = opendir("/sys/devices/system/node")) {
+        while (dirent *entry = readdir(dir)) {
+            int node;
+            char tail;
+            if (std::sscanf(entry->d_name, "node%d%c", &node, &tail) != 1) continue;
+            std::string list;
+            if (!read_line(std::string("/sys/devices/system/node/") + entry->d_name + "/cpulist", list)) continue;
+            for (int cpu : parse_cpulist(list)) os_node_of[cpu] = node;
+        }
+        closedir(dir);
+    }
+    if (allowed.empty()) {
+        std::string list;
+        if (read_line("/sys/devices/system/cpu/online", list)) {
+            for (int cpu : parse_cpulist(list)) allowed.insert(cpu);
+        }
+    }
+
+    // Dense node indices in kernel order
+    std::map<int, int> dense;
+    for (int cpu : allowed) {
+        dense[os_node_of.count(cpu) ? os_node_of[cpu] : 0] = 0;
+    }
+    int nodes = 0;
+    for (auto &entry : dense) entry.second = nodes++;
+
+    Topology topology;
+    topology.nodes = std::max(nodes, 1);
+    for (int cpu : allowed) {
+        const std::string base = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+        CpuInfo info;
+        info.cpu = cpu;
+        info.os_node = os_node_of.count(cpu) ? os_node_of[cpu] : 0;
+        info.node = dense[info.os_node];
+        info.package = read_int(base + "physical_package_id", 0);
+        info.core = read_int(base + "core_id", cpu);
+        topology.cpus.push_back(info);
+    }
+    return topology;
+}
+
+std::vector<CpuInfo> place_threads(const Topology &topology, int numThreads) {
+    // Per node: first CPU of every core, then the SMT siblings
+    std::vector<std::vector<CpuInfo>> per_node(topology.nodes);
+    for (int pass = 0; pass < 2; ++pass) {
+        std::set<std::pair<int, int>> seen;
+        for (const CpuInfo &info : topology.cpus) {
+            bool first = seen.insert(std::make_pair(info.package, info.core)).second;
+            if (first == (pass == 0)) per_node[info.node].push_back(info);
+        }
+    }
+    per_node.erase(std::remove_if(per_node.begin(), per_node.end(),
+        [](const std::vector<CpuInfo> &cpus) { return cpus.empty(); }), per_node.end());
+
+    std::vector<CpuInfo> placement;
+    if (per_node.empty()) return placement;
+    std::vector<size_t> next(per_node.size(), 0);
+    for (int i = 0; i < numThreads; ++i) {
+        size_t node = i % per_node.size();
+        placement.push_back(per_node[node][next[node]++ % per_node[node].size()]);
+    }
+    return placement;
+}
+
+bool pin_attr(pthread_attr_t *attr, int cpu) {
+# if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_attr_setaffinity_np(attr, sizeof set, &set) == 0;
+# else
+    (void)attr;
+    (void)cpu;
+    return false;
+# endif
+}
@@ -0,0 +1,35 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+# include <pthread.h>
+# include <vector>
+
+// A CPU this process may run on, located in the machine topology. node is a
+// dense index (0 .. Topology::nodes - 1); os_node is the kernel's node id.
+struct CpuInfo {
+    int cpu;
+    int node;
+    int os_node;
+    int package;
+    int core;
+};
+
+struct Topology {
+    std::vector<CpuInfo> cpus;   // only CPUs in the process affinity mask
+    int nodes;
+};
+
+// Reads the topology from /sys/devices/system/{node,cpu}. Machines (or
+// containers) without NUMA information come back as a single node.
+Topology discover_topology();
+
+// CPU for each of numThreads workers: threads are dealt round-robin over the
+// nodes, and within a node every physical core gets a thread before any SMT
+// sibling does. Wraps around when there are more threads than CPUs.
+std::vector<CpuInfo> place_threads(const Topology &topology, int numThreads);
+
+// Sets attr so the thread it creates starts on cpu. Returns false if the
+// platform does not support it.
+bool pin_attr(pthread_attr_t *attr, int cpu);
+
+#endif // NUMA_H
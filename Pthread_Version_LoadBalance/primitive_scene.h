@@ -0,0 +1,89 @@
+#ifndef PRIMITIVE_SCENE_H
+#define PRIMITIVE_SCENE_H
+
+# include "graph.h"
+# include <limits>
+# include <typeinfo>
+# include <vector>
+
+/* Scene for --dispatch static: the objects copied into one array per
+   primitive type of a compile-time type list, so the traversal loops in
+   kernels.h call the intersect kernels non-virtually and can inline them. Objects of a
+   type not in the list (meshes) stay behind Object* in a last array and are
+   called virtually.
+
+   The closest hit keeps the lowest scene index among equal distances, as the
+   loop over std::vector<Object*> does, so images are bit-identical to the
+   virtual path. Hit objects are the copies, for shading; their index is
+   the one in the original scene. */
+
+// Closest hit so far of a ray
+struct PrimitiveHit {
+    float distance = std::numeric_limits<float>::infinity();
+    size_t index = size_t(-1);
+    Object* object = nullptr;
+    HitRecord record;
+
+    void update(float t, size_t i, Object* obj, const HitRecord &part) {
+        if (t < distance || (t == distance && i < index)) {
+            distance = t;
+            index = i;
+            object = obj;
+            record = part;
+        }
+    }
+};
+
+template <typename... Types>
+struct PrimitiveArrays;
+
+// End of the list: everything else, dispatched virtually
+template <>
+struct PrimitiveArrays<> {
+    std::vector<Object*> objects;
+    std::vector<size_t> index;
+
+    void add(Object* obj, size_t i) {
+        objects.push_back(obj);
+        index.push_back(i);
+    }
+};
+
+// Objects whose dynamic type is exactly T, then the rest of the list. A
+// subclass of T does not match; it needs its own entry.
+template <typename T, typename... Rest>
+struct PrimitiveArrays<T, Rest...> : PrimitiveArrays<Rest...> {
+    typedef PrimitiveArrays<Rest...> Next;
+
+    std::vector<T> objects;
+    std::vector<size_t> index;
+
+    void add(Object* obj, size_t i) {
+        if (typeid(*obj) != typeid(T)) {
+            Next::add(obj, i);
+            return;
+        }
+        objects.push_back(static_cast<const T&>(*obj));
+        index.push_back(i);
+    }
+};
+
+// The primitive types of the built-in scenes. Its members are defined in
+// graph.cpp with the baseline kernels.
+class PrimitiveScene {
+public:
+    // Copies the objects of scene, which must outlive this for the objects
+    // dispatched virtually
+    explicit PrimitiveScene(const std::vector<Object*> &scene);
+
+    // Closest object hit by the ray, nullptr on a miss
+    Object* closest(const vec3 &origin, const vec3 &dir, float &distance, size_t &index, HitRecord &record);
+
+    // Same test as in_shadow
+    bool shadowed(const vec3 &P, const vec3 &N, const vec3 &PL, size_t index);
+
+    // Traversed by every instruction set's kernels, see kernels.h
+    PrimitiveArrays<Sphere, CheckerboardPlane, Plane, Instance> arrays;
+};
+
+#endif // PRIMITIVE_SCENE_H
@@ -0,0 +1,58 @@
+# include "scene.h"
+# include "mesh.h"
+
+# include <algorithm>
+# include <chrono>
+# include <cmath>
+# include <iostream>
+# include <memory>
+
+bool build_scene(const std::string &meshFile, int instances, int numThreads, std::vector<Object*> &scene) {
+    scene.insert(scene.end(), {
+        new Sphere(vec3(.75, .1, 1.), .6, vec3(.8, .3, 0.)),
+        new Sphere(vec3(-.3, .01, .2), .3, vec3(.0, .0, .9)),
+        new Sphere(vec3(-2.75, .1, 3.5), .6, vec3(.1, .572, .184)),
+        new Sphere(vec3(.0, 1., 3.5), .6, vec3(.580, .082, .666)),
+        //new Plane(vec3(0., -.5, 0.), vec3(0., 1., 0.))
+        new CheckerboardPlane(vec3(0., -.5, 0.), vec3(0., 1., 0.), vec3(1., 1., 1.), vec3(0., 0., 0.), 0.2)
+    });
+
+    if (!meshFile.empty()) {
+        MeshData data;
+        auto load_start = std::chrono::high_resolution_clock::now();
+        if (!load_mesh(meshFile, data, numThreads)) {
+            return false;
+        }
+        auto geometry = std::make_shared<const TriangleGeometry>(data);
+        auto load_end = std::chrono::high_resolution_clock::now();
+        std::cout << "Loaded " << meshFile << ": " << geometry->triangle_count() << " triangles in "
+                  << std::chrono::duration_cast<std::chrono::milliseconds>(load_end - load_start).count()
+                  << " milliseconds." << std::endl;
+        if (instances <= 1) {
+            scene.push_back(new TriangleMesh(geometry, vec3(.7, .7, .7)));
+        } else {
+            // A grid of copies going away from the camera, each turned and
+            // tinted differently, all sharing one geometry
+            std::shared_ptr<Object> prototype = std::make_shared<TriangleMesh>(geometry, vec3(.7, .7, .7));
+            const vec3 extent = geometry->bounds_max() - geometry->bounds_min();
+            const float spacing = 1.25f * std::max(extent.x, extent.z);
+            const int side = static_cast<int>(std::ceil(std::sqrt(float(instances))));
+            for (int k = 0; k < instances; ++k) {
+                const float x = (k % side - (side - 1) * .5f) * spacing, z = (k / side) * spacing;
+                const Transform placement = Transform::translate(prototype->position + vec3(x, 0., z))
+                    * Transform::rotate(.7f * k, vec3(0., 1., 0.))
+                    * Transform::translate(-prototype->position);
+                const vec3 tint = vec3(.4 + .3 * (k % 3), .4 + .15 * (k % 5), .4 + .1 * (k % 7));
+                scene.push_back(new Instance(prototype, placement, tint, .15, 1., .6, 50));
+            }
+        }
+    }
+    return true;
+}
+
+void delete_scene(std::vector<Object*> &scene) {
+    for (auto obj : scene) {
+        delete obj;
+    }
+    scene.clear();
+}
@@ -0,0 +1,16 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+# include "graph.h"
+# include <string>
+# include <vector>
+
+// Appends the built-in scene (four spheres on a checkerboard) to scene, and
+// meshFile if it is not empty: one mesh, or with instances > 1 a grid of
+// that many instances of it sharing one BVH. Returns false and reports the
+// reason on std::cerr if the mesh cannot be loaded.
+bool build_scene(const std::string &meshFile, int instances, int numThreads, std::vector<Object*> &scene);
+
+void delete_scene(std::vector<Object*> &scene);
+
+#endif // SCENE_H
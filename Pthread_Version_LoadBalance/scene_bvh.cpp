@@ -0,0 +1,68 @@
+# include "scene_bvh.h"
+
+# include <algorithm>
+# include <limits>
+
+bool SceneBvh::worthwhile(const std::vector<Object*> &scene) {
+    size_t bounded = 0;
+    vec3 lo, hi;
+    for (const Object* obj : scene) {
+        if (obj->bounds(lo, hi) && ++bounded >= SCENE_BVH_MIN_OBJECTS) return true;
+    }
+    return false;
+}
+
+SceneBvh::SceneBvh(std::vector<Object*> &scene): scene(scene) {
+    // Boxes by scene index
+    std::vector<vec3> lo(scene.size()), hi(scene.size());
+    for (size_t i = 0; i < scene.size(); ++i) {
+        if (scene[i]->bounds(lo[i], hi[i])) {
+            pad_bounds(lo[i], hi[i]);
+            items.push_back(uint32_t(i));
+        } else {
+            unbounded.push_back(uint32_t(i));
+        }
+    }
+    if (items.empty()) return;
+    nodes.reserve(items.size());
+    build(lo, hi, 0, items.size());
+}
+
+uint32_t SceneBvh::build(std::vector<vec3> &lo, std::vector<vec3> &hi, size_t begin, size_t end) {
+    uint32_t index = uint32_t(nodes.size());
+    nodes.push_back(Node());
+
+    Node node;
+    node.lo = vec3(std::numeric_limits<float>::infinity());
+    node.hi = vec3(-std::numeric_limits<float>::infinity());
+    vec3 clo = node.lo, chi = node.hi;
+    for (size_t k = begin; k < end; ++k) {
+        const uint32_t i = items[k];
+        node.lo = glm::min(node.lo, lo[i]);
+        node.hi = glm::max(node.hi, hi[i]);
+        clo = glm::min(clo, lo[i] + hi[i]);
+        chi = glm::max(chi, lo[i] + hi[i]);
+    }
+
+    if (end - begin <= 2) {
+        node.offset = uint32_t(begin);
+        node.count = uint16_t(end - begin);
+        node.axis = 0;
+        nodes[index] = node;
+        return index;
+    }
+
+    // Median split on the widest axis of the box centres (kept doubled)
+    vec3 extent = chi - clo;
+    int axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z ? 1 : 2);
+    size_t mid = begin + (end - begin) / 2;
+    std::nth_element(items.begin() + begin, items.begin() + mid, items.begin() + end,
+        [&](uint32_t a, uint32_t b) { return lo[a][axis] + hi[a][axis] < lo[b][axis] + hi[b][axis]; });
+
+    build(lo, hi, begin, mid);
+    node.offset = build(lo, hi, mid, end);
+    node.count = 0;
+    node.axis = uint16_t(axis);
+    nodes[index] = node;
+    return index;
+}
@@ -0,0 +1,46 @@
+#ifndef SCENE_BVH_H
+#define SCENE_BVH_H
+
+# include "graph.h"
+# include <cstdint>
+# include <vector>
+
+/* Top-level BVH over the bounded objects of a scene (spheres, meshes and
+   instances, see Object::bounds), so that a ray only tests the objects
+   whose boxes it passes through instead of every object. Unbounded objects
+   (planes) are tested against every ray.
+
+   Built once per render, like a PrimitiveScene, when the scene has at
+   least SCENE_BVH_MIN_OBJECTS bounded objects; the traversal is BvhScene in
+   kernels.h. Boxes are widened by pad_bounds, a subtree is only skipped
+   when its box starts beyond the closest hit so far, and equal distances
+   keep the lowest scene index, so images are bit-identical to the loop
+   over std::vector<Object*>. */
+
+const size_t SCENE_BVH_MIN_OBJECTS = 16;
+
+class SceneBvh {
+public:
+    struct Node {
+        vec3 lo, hi;
+        uint32_t offset;    // leaf: first entry of items, inner: right child (left is next)
+        uint16_t count;     // items in a leaf, 0 for inner nodes
+        uint16_t axis;      // split axis of an inner node
+    };
+
+    // scene must outlive this and keep its objects while it is used
+    explicit SceneBvh(std::vector<Object*> &scene);
+
+    // True if scene has enough bounded objects for the tree to pay off
+    static bool worthwhile(const std::vector<Object*> &scene);
+
+    std::vector<Object*> &scene;
+    std::vector<Node> nodes;
+    std::vector<uint32_t> items;        // scene indices of the bounded objects, leaf by leaf
+    std::vector<uint32_t> unbounded;    // scene indices of the others
+
+private:
+    uint32_t build(std::vector<vec3> &lo, std::vector<vec3> &hi, size_t begin, size_t end);
+};
+
+#endif // SCENE_BVH_H
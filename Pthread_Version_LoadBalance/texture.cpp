@@ -0,0 +1,436 @@
+# include "texture.h"
+
+# include <algorithm>
+# include <atomic>
+# include <cmath>
+# include <cstdio>
+# include <iostream>
+
+// Runs f(k) for k in [0, n): groups of 16 have a fixed trip count, which is
+// what GCC vectorizes at -O2, then the remainder one by one
+template <typename F>
+static inline void for_each_point(size_t n, F f) {
+    size_t k = 0;
+    for (; k + 16 <= n; k += 16) {
+        for (size_t l = 0; l < 16; ++l) f(k + l);
+    }
+    for (; k < n; ++k) f(k);
+}
+
+// floor for |v| < 2^31, without the libm call std::floor is at -O2
+static inline int ifloor(float v) {
+    const int i = static_cast<int>(v);
+    return i - (v < static_cast<float>(i));
+}
+
+static inline float lerp(float a, float b, float t) { return a + (b - a) * t; }
+
+static inline float clamp01(float v) { return std::min(std::max(v, 0.f), 1.f); }
+
+// Quintic fade of Perlin's improved noise
+static inline float fade(float t) { return t * t * t * (t * (t * 6.f - 15.f) + 10.f); }
+
+static inline unsigned lattice_hash(int x, int y, int z, unsigned seed) {
+    unsigned h = seed ^ unsigned(x) * 0x8da6b343u ^ unsigned(y) * 0xd8163841u ^ unsigned(z) * 0xcb1ab31fu;
+    h ^= h >> 13;
+    h *= 0x5bd1e995u;
+    h ^= h >> 15;
+    return h;
+}
+
+// Top 24 bits of h in [0, 1)
+static inline float unit_float(unsigned h) { return float(int(h >> 8)) * (1.f / 16777216.f); }
+
+// Value noise in [0, 1): random values at the lattice points, interpolated
+static inline float value_noise(float x, float y, float z, unsigned seed) {
+    const int ix = ifloor(x), iy = ifloor(y), iz = ifloor(z);
+    const float u = fade(x - ix), v = fade(y - iy), w = fade(z - iz);
+    const float c000 = unit_float(lattice_hash(ix, iy, iz, seed));
+    const float c100 = unit_float(lattice_hash(ix + 1, iy, iz, seed));
+    const float c010 = unit_float(lattice_hash(ix, iy + 1, iz, seed));
+    const float c110 = unit_float(lattice_hash(ix + 1, iy + 1, iz, seed));
+    const float c001 = unit_float(lattice_hash(ix, iy, iz + 1, seed));
+    const float c101 = unit_float(lattice_hash(ix + 1, iy, iz + 1, seed));
+    const float c011 = unit_float(lattice_hash(ix, iy + 1, iz + 1, seed));
+    const float c111 = unit_float(lattice_hash(ix + 1, iy + 1, iz + 1, seed));
+    return lerp(lerp(lerp(c000, c100, u), lerp(c010, c110, u), v),
+                lerp(lerp(c001, c101, u), lerp(c011, c111, u), v), w);
+}
+
+// Dot product of the offset (dx, dy, dz) with the gradient of a lattice
+// point, whose components are three bytes of its hash mapped to [-1, 1]
+static inline float gradient_dot(unsigned h, float dx, float dy, float dz) {
+    const float gx = float(int(h & 0xff)) * (1.f / 127.5f) - 1.f;
+    const float gy = float(int((h >> 8) & 0xff)) * (1.f / 127.5f) - 1.f;
+    const float gz = float(int((h >> 16) & 0xff)) * (1.f / 127.5f) - 1.f;
+    return gx * dx + gy * dy + gz * dz;
+}
+
+// Perlin (gradient) noise, mostly within [-.5, .5]
+static inline float perlin_noise(float x, float y, float z, unsigned seed) {
+    const int ix = ifloor(x), iy = ifloor(y), iz = ifloor(z);
+    const float fx = x - ix, fy = y - iy, fz = z - iz;
+    const float u = fade(fx), v = fade(fy), w = fade(fz);
+    const float c000 = gradient_dot(lattice_hash(ix, iy, iz, seed), fx, fy, fz);
+    const float c100 = gradient_dot(lattice_hash(ix + 1, iy, iz, seed), fx - 1.f, fy, fz);
+    const float c010 = gradient_dot(lattice_hash(ix, iy + 1, iz, seed), fx, fy - 1.f, fz);
+    const float c110 = gradient_dot(lattice_hash(ix + 1, iy + 1, iz, seed), fx - 1.f, fy - 1.f, fz);
+    const float c001 = gradient_dot(lattice_hash(ix, iy, iz + 1, seed), fx, fy, fz - 1.f);
+    const float c101 = gradient_dot(lattice_hash(ix + 1, iy, iz + 1, seed), fx - 1.f, fy, fz - 1.f);
+    const float c011 = gradient_dot(lattice_hash(ix, iy + 1, iz + 1, seed), fx, fy - 1.f, fz - 1.f);
+    const float c111 = gradient_dot(lattice_hash(ix + 1, iy + 1, iz + 1, seed), fx - 1.f, fy - 1.f, fz - 1.f);
+    return lerp(lerp(lerp(c000, c100, u), lerp(c010, c110, u), v),
+                lerp(lerp(c001, c101, u), lerp(c011, c111, u), v), w);
+}
+
+// Channel kernels; the batch arrays are distinct, which GCC only assumes
+// (and so only vectorizes) with __restrict parameters
+
+// out = odd ? b : a, both loaded first so the select has no branch
+static void select_channel(size_t n, const int* __restrict odd, const float* __restrict a,
+                           const float* __restrict b, float* __restrict out) {
+    for_each_point(n, [=](size_t k) {
+        const float a_k = a[k], b_k = b[k];
+        out[k] = odd[k] ? b_k : a_k;
+    });
+}
+
+static void blend_channel(size_t n, const float* __restrict w, const float* __restrict a,
+                          const float* __restrict b, float* __restrict out) {
+    for_each_point(n, [=](size_t k) { out[k] = lerp(a[k], b[k], w[k]); });
+}
+
+// Unclamped: clamping a computed float is a branch GCC does not convert
+// under -ftrapping-math, clamping a loaded one (clamp_channel) is not.
+// Callers pass a local out array; through parameters alone the restrict
+// qualifiers are lost once this is inlined.
+static void ramp(size_t n, const float* __restrict x, const float* __restrict y, const float* __restrict z,
+                 const vec3 from, const vec3 step, float* __restrict w) {
+    const float x0 = from.x, y0 = from.y, z0 = from.z, sx = step.x, sy = step.y, sz = step.z;
+    for_each_point(n, [=](size_t k) { w[k] = (x[k] - x0) * sx + (y[k] - y0) * sy + (z[k] - z0) * sz; });
+}
+
+static void clamp_channel(size_t n, const float* __restrict v, float* __restrict out) {
+    for_each_point(n, [=](size_t k) { out[k] = clamp01(v[k]); });
+}
+
+// Flattened so Noise is inlined into the loop, which can then vectorize
+template <float (*Noise)(float, float, float, unsigned)>
+__attribute__((flatten))
+static void add_octave(size_t n, const float* __restrict x, const float* __restrict y, const float* __restrict z,
+                       float frequency, float amplitude, unsigned seed, float* __restrict w) {
+    for_each_point(n, [=](size_t k) { w[k] += amplitude * Noise(x[k] * frequency, y[k] * frequency, z[k] * frequency, seed); });
+}
+
+/* class Texture */
+vec3 Texture::color(const vec3 &p) const {
+    float r, g, b;
+    evaluate(&p.x, &p.y, &p.z, 1, &r, &g, &b);
+    return vec3(r, g, b);
+}
+
+void Texture::colors(const float* x, const float* y, const float* z, size_t n, float* r, float* g, float* b) const {
+    for (size_t k = 0; k < n; k += TEXTURE_BATCH) {
+        const size_t m = std::min(TEXTURE_BATCH, n - k);
+        evaluate(x + k, y + k, z + k, m, r + k, g + k, b + k);
+    }
+}
+
+/* class SolidTexture */
+SolidTexture::SolidTexture(const vec3 &color): value(color) {}
+
+void SolidTexture::evaluate(const float*, const float*, const float*, size_t n, float* r, float* g, float* b) const {
+    std::fill(r, r + n, value.x);
+    std::fill(g, g + n, value.y);
+    std::fill(b, b + n, value.z);
+}
+
+/* class CellTexture */
+CellTexture::CellTexture(std::shared_ptr<const Texture> even, std::shared_ptr<const Texture> odd)
+    : even(even), odd(odd) {}
+
+void CellTexture::evaluate(const float* x, const float* y, const float* z, size_t n, float* r, float* g, float* b) const {
+    float er[TEXTURE_BATCH], eg[TEXTURE_BATCH], eb[TEXTURE_BATCH];
+    float orr[TEXTURE_BATCH], og[TEXTURE_BATCH], ob[TEXTURE_BATCH];
+    int cell[TEXTURE_BATCH];
+    even->evaluate(x, y, z, n, er, eg, eb);
+    odd->evaluate(x, y, z, n, orr, og, ob);
+    parity(x, y, z, n, cell);
+    select_channel(n, cell, er, orr, r);
+    select_channel(n, cell, eg, og, g);
+    select_channel(n, cell, eb, ob, b);
+}
+
+/* class CheckerTexture */
+CheckerTexture::CheckerTexture(std::shared_ptr<const Texture> even, std::shared_ptr<const Texture> odd, float size)
+    : CellTexture(even, odd), size(size) {}
+
+void CheckerTexture::parity(const float* x, const float* y, const float* z, size_t n, int* odd) const {
+    const float size = this->size;
+    for_each_point(n, [=](size_t k) {
+        odd[k] = (ifloor(x[k] / size + .5f) + ifloor(y[k] / size + .5f) + ifloor(z[k] / size + .5f)) & 1;
+    });
+}
+
+/* class StripeTexture */
+StripeTexture::StripeTexture(std::shared_ptr<const Texture> even, std::shared_ptr<const Texture> odd, const vec3 &axis, float width)
+    : CellTexture(even, odd), axis(axis), width(width) {}
+
+void StripeTexture::parity(const float* x, const float* y, const float* z, size_t n, int* odd) const {
+    const vec3 axis = this->axis;
+    const float width = this->width;
+    for_each_point(n, [=](size_t k) {
+        odd[k] = ifloor((x[k] * axis.x + y[k] * axis.y + z[k] * axis.z) / width) & 1;
+    });
+}
+
+/* class BlendTexture */
+BlendTexture::BlendTexture(std::shared_ptr<const Texture> a, std::shared_ptr<const Texture> b): a(a), b(b) {}
+
+void BlendTexture::evaluate(const float* x, const float* y, const float* z, size_t n, float* r, float* g, float* b) const {
+    float ar[TEXTURE_BATCH], ag[TEXTURE_BATCH], ab[TEXTURE_BATCH];
+    float br[TEXTURE_BATCH], bg[TEXTURE_BATCH], bb[TEXTURE_BATCH];
+    float w[TEXTURE_BATCH];
+    this->a->evaluate(x, y, z, n, ar, ag, ab);
+    this->b->evaluate(x, y, z, n, br, bg, bb);
+    weight(x, y, z, n, w);
+    blend_channel(n, w, ar, br, r);
+    blend_channel(n, w, ag, bg, g);
+    blend_channel(n, w, ab, bb, b);
+}
+
+/* class GradientTexture */
+GradientTexture::GradientTexture(std::shared_ptr<const Texture> a, std::shared_ptr<const Texture> b, const vec3 &from, const vec3 &to)
+    : BlendTexture(a, b), from(from), step((to - from) / glm::dot(to - from, to - from)) {}
+
+void GradientTexture::weight(const float* x, const float* y, const float* z, size_t n, float* w) const {
+    float t[TEXTURE_BATCH];
+    ramp(n, x, y, z, from, step, t);
+    clamp_channel(n, t, w);
+}
+
+/* class NoiseTexture */
+NoiseTexture::NoiseTexture(std::shared_ptr<const Texture> a, std::shared_ptr<const Texture> b, NoiseKind kind,
+                           float scale, int octaves, unsigned seed)
+    : BlendTexture(a, b), kind(kind), frequency(1.f / scale), octaves(std::max(octaves, 1)), seed(seed) {}
+
+// Octaves in the outer loop, so the inner one is a flat loop over the batch
+void NoiseTexture::weight(const float* x, const float* y, const float* z, size_t n, float* w) const {
+    std::fill(w, w + n, 0.f);
+    float amplitude = 1.f, total = 0.f, f = frequency;
+    for (int octave = 0; octave < octaves; ++octave) {
+        const unsigned s = seed + unsigned(octave);
+        if (kind == NOISE_VALUE) add_octave<value_noise>(n, x, y, z, f, amplitude, s, w);
+        else add_octave<perlin_noise>(n, x, y, z, f, amplitude, s, w);
+        total += amplitude;
+        amplitude *= .5f;
+        f *= 2.f;
+    }
+    if (kind == NOISE_VALUE) {
+        for_each_point(n, [=](size_t k) { w[k] = w[k] / total; });
+    } else {
+        for_each_point(n, [=](size_t k) { w[k] = clamp01(.5f + w[k] / total); });
+    }
+}
+
+/* class MixTexture */
+MixTexture::MixTexture(std::shared_ptr<const Texture> a, std::shared_ptr<const Texture> b, std::shared_ptr<const Texture> mask)
+    : BlendTexture(a, b), mask(mask) {}
+
+void MixTexture::weight(const float* x, const float* y, const float* z, size_t n, float* w) const {
+    float mr[TEXTURE_BATCH], mg[TEXTURE_BATCH], mb[TEXTURE_BATCH];
+    mask->evaluate(x, y, z, n, mr, mg, mb);
+    clamp_channel(n, mr, w);
+}
+
+/* class CachedTexture */
+
+// Direct-mapped, per thread; 28 KB
+static const size_t TEXEL_CACHE_SIZE = 1024;
+
+struct TexelCache {
+    unsigned tag[TEXEL_CACHE_SIZE];    // id of the owning CachedTexture, 0 when empty
+    int key[TEXEL_CACHE_SIZE][3];
+    float rgb[TEXEL_CACHE_SIZE][3];
+};
+
+static thread_local TexelCache texel_cache;
+
+static std::atomic<unsigned> next_cache_id(1);
+
+CachedTexture::CachedTexture(std::shared_ptr<const Texture> texture, float texel)
+    : texture(texture), texel(texel), id(next_cache_id++) {}
+
+void CachedTexture::evaluate(const float* x, const float* y, const float* z, size_t n, float* r, float* g, float* b) const {
+    TexelCache &cache = texel_cache;
+    // Texel centers of the misses, and where their colors go
+    float mx[TEXTURE_BATCH], my[TEXTURE_BATCH], mz[TEXTURE_BATCH];
+    float mr[TEXTURE_BATCH], mg[TEXTURE_BATCH], mb[TEXTURE_BATCH];
+    size_t point[TEXTURE_BATCH], slot[TEXTURE_BATCH];
+    int texels[TEXTURE_BATCH][3];
+    size_t misses = 0;
+    for (size_t k = 0; k < n; ++k) {
+        const int ix = ifloor(x[k] / texel), iy = ifloor(y[k] / texel), iz = ifloor(z[k] / texel);
+        const size_t s = lattice_hash(ix, iy, iz, 0) % TEXEL_CACHE_SIZE;
+        if (cache.tag[s] == id && cache.key[s][0] == ix && cache.key[s][1] == iy && cache.key[s][2] == iz) {
+            r[k] = cache.rgb[s][0];
+            g[k] = cache.rgb[s][1];
+            b[k] = cache.rgb[s][2];
+            continue;
+        }
+        mx[misses] = (float(ix) + .5f) * texel;
+        my[misses] = (float(iy) + .5f) * texel;
+        mz[misses] = (float(iz) + .5f) * texel;
+        texels[misses][0] = ix;
+        texels[misses][1] = iy;
+        texels[misses][2] = iz;
+        point[misses] = k;
+        slot[misses] = s;
+        ++misses;
+    }
+    if (!misses) return;
+    texture->evaluate(mx, my, mz, misses, mr, mg, mb);
+    for (size_t q = 0; q < misses; ++q) {
+        const size_t s = slot[q];
+        cache.tag[s] = id;
+        std::copy(texels[q], texels[q] + 3, cache.key[s]);
+        cache.rgb[s][0] = r[point[q]] = mr[q];
+        cache.rgb[s][1] = g[point[q]] = mg[q];
+        cache.rgb[s][2] = b[point[q]] = mb[q];
+    }
+}
+
+/* class ImageTexture */
+ImageTexture::ImageTexture(std::shared_ptr<TiledImage> image, const vec3 &origin, const vec3 &u, const vec3 &v, float size)
+    : image(image), spherical(false), origin(origin), u(u), v(v), normal(glm::cross(u, v)), size(size) {
+    texels_per_unit = float(std::max(image->level(0).width, image->level(0).height)) / size;
+}
+
+ImageTexture::ImageTexture(std::shared_ptr<TiledImage> image, const vec3 &center, float radius)
+    : image(image), spherical(true), origin(center), size(radius) {
+    const TextureLevel &level = image->level(0);
+    texels_per_unit = std::max(level.width / (2.f * float(M_PI)), level.height / float(M_PI)) / radius;
+}
+
+vec3 ImageTexture::sample(int l, float s, float t) const {
+    const TextureLevel &level = image->level(l);
+    const float fx = s * level.width - .5f, fy = t * level.height - .5f;
+    const int x0 = ifloor(fx), y0 = ifloor(fy);
+    const float ax = fx - x0, ay = fy - y0;
+    // Wrap around in x, and in y on a plane; clamp at the sphere's poles
+    auto column = [&](int x) { return ((x % level.width) + level.width) % level.width; };
+    auto row = [&](int y) {
+        return spherical ? std::min(std::max(y, 0), level.height - 1) : ((y % level.height) + level.height) % level.height;
+    };
+    const int xa = column(x0), xb = column(x0 + 1), ya = row(y0), yb = row(y0 + 1);
+    vec3 c00, c10, c01, c11;
+    image->texel(l, xa, ya, c00.x, c00.y, c00.z);
+    image->texel(l, xb, ya, c10.x, c10.y, c10.z);
+    image->texel(l, xa, yb, c01.x, c01.y, c01.z);
+    image->texel(l, xb, yb, c11.x, c11.y, c11.z);
+    const vec3 top = c00 + (c10 - c00) * ax, bottom = c01 + (c11 - c01) * ax;
+    return top + (bottom - top) * ay;
+}
+
+void ImageTexture::evaluate(const float* x, const float* y, const float* z, size_t n, float* r, float* g, float* b) const {
+    const int top = image->levels() - 1;
+    for (size_t k = 0; k < n; ++k) {
+        const vec3 P(x[k], y[k], z[k]);
+        float s, t;
+        vec3 N = normal;
+        if (spherical) {
+            N = (P - origin) / size;
+            s = std::atan2(N.z, N.x) * float(.5 / M_PI) + .5f;
+            t = std::acos(std::min(std::max(N.y, -1.f), 1.f)) * float(1. / M_PI);
+        } else {
+            s = glm::dot(P - origin, u) / size;
+            t = glm::dot(P - origin, v) / size;
+            s -= std::floor(s);
+            t -= std::floor(t);
+        }
+        // Texels of level 0 across the footprint, as a level of detail
+        const vec3 view = P - O;
+        const float distance = glm::length(view);
+        const float cosine = std::max(std::fabs(glm::dot(N, view)) / distance, 1e-3f);
+        const float texels = pixel_spread * distance / std::sqrt(cosine) * texels_per_unit;
+        const float lod = std::min(std::log2(std::max(texels, 1.f)), float(top));
+        const int l = int(lod);
+        vec3 color = sample(l, s, t);
+        if (l < top && lod > float(l)) color += (sample(l + 1, s, t) - color) * (lod - float(l));
+        r[k] = color.x;
+        g[k] = color.y;
+        b[k] = color.z;
+    }
+}
+
+std::shared_ptr<const Texture> make_texture(const std::string &name, const vec3 &color) {
+    auto solid = [](const vec3 &c) { return std::make_shared<SolidTexture>(c); };
+    if (name == "checker") return std::make_shared<CheckerTexture>(solid(color), solid(color * .25f), .25f);
+    if (name == "stripes") {
+        return std::make_shared<StripeTexture>(solid(color), solid(vec3(1.)), glm::normalize(vec3(1., 0., 1.)), .1f);
+    }
+    if (name == "gradient") {
+        return std::make_shared<GradientTexture>(solid(color * .2f), solid(color), vec3(0., -.5, -1.), vec3(0., 1.6, 3.));
+    }
+    if (name == "value") return std::make_shared<NoiseTexture>(solid(color * .2f), solid(color), NOISE_VALUE, .1f, 4);
+    if (name == "perlin") return std::make_shared<NoiseTexture>(solid(color * .2f), solid(color), NOISE_PERLIN, .15f, 5);
+    if (name == "marble" || name == "baked") {
+        auto veins = std::make_shared<StripeTexture>(solid(color), solid(vec3(.95)), vec3(1., 0., 0.), .05f);
+        auto mask = std::make_shared<NoiseTexture>(solid(vec3(0.)), solid(vec3(1.)), NOISE_PERLIN, .25f, 6, 7);
+        std::shared_ptr<const Texture> marble = std::make_shared<MixTexture>(veins, solid(color * .3f), mask);
+        if (name == "marble") return marble;
+        return std::make_shared<CachedTexture>(marble, 1.f / 64);
+    }
+    return nullptr;
+}
+
+// An ImageTexture of the tiled file path over obj, or nullptr with an error
+static std::shared_ptr<const Texture> image_texture(const std::string &path, const Object* obj) {
+    const Sphere* sphere = dynamic_cast<const Sphere*>(obj);
+    const Plane* plane = dynamic_cast<const Plane*>(obj);
+    if (!sphere && !plane) {
+        std::cerr << "Error: --texture " << path << ": image textures go on spheres and planes." << std::endl;
+        return nullptr;
+    }
+    std::shared_ptr<TiledImage> image = TiledImage::open(path, texture_cache);
+    if (!image) return nullptr;
+    if (sphere) return std::make_shared<ImageTexture>(image, sphere->position, sphere->radius);
+    // u across the plane, v toward the camera side (-z when it can be)
+    const vec3 N = glm::normalize(plane->normal);
+    const vec3 axis = std::fabs(N.z) < .9f ? vec3(0., 0., 1.) : vec3(1., 0., 0.);
+    const vec3 u = glm::normalize(glm::cross(N, axis));
+    return std::make_shared<ImageTexture>(image, plane->position, u, glm::cross(N, u), 1.f);
+}
+
+bool attach_texture(const std::string &spec, std::vector<Object*> &scene) {
+    const size_t equals = spec.find('=');
+    size_t end = 0;
+    unsigned long index = 0;
+    try {
+        if (equals != std::string::npos) index = std::stoul(spec.substr(0, equals), &end);
+    } catch (const std::exception&) {
+        end = 0;
+    }
+    if (equals == std::string::npos || end == 0 || end != equals || equals + 1 == spec.size()) {
+        std::cerr << "Error: --texture must be INDEX=NAME, not " << spec << std::endl;
+        return false;
+    }
+    if (index >= scene.size()) {
+        std::cerr << "Error: --texture " << spec << ": the scene has objects 0-" << scene.size() - 1 << std::endl;
+        return false;
+    }
+    const std::string name = spec.substr(equals + 1);
+    if (name.find_first_of("./") != std::string::npos) {
+        std::shared_ptr<const Texture> texture = image_texture(name, scene[index]);
+        if (!texture) return false;
+        scene[index]->texture = texture;
+        return true;
+    }
+    std::shared_ptr<const Texture> texture = make_texture(name, scene[index]->color);
+    if (!texture) {
+        std::cerr << "Error: --texture " << spec << ": NAME must be checker, stripes, gradient, value, perlin, marble or baked." << std::endl;
+        return false;
+    }
+    scene[index]->texture = texture;
+    return true;
+}
@@ -0,0 +1,227 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+# include "graph.h"
+# include "texture_cache.h"
+# include <cstddef>
+# include <memory>
+# include <string>
+# include <vector>
+
+/* Textures, evaluated at the world-space hit point. Any object
+   gets one through Object::texture, which replaces its flat color (the
+   material's other terms are unchanged):
+
+     SolidTexture     one color
+     CheckerTexture   3D checker of two textures, cubes of a given size
+     StripeTexture    slabs of two textures across an axis
+     GradientTexture  linear ramp between two textures from one point to another
+     NoiseTexture     blend of two textures by fractal value or Perlin noise
+     MixTexture       blend of two textures weighted by a third one's red channel
+     CachedTexture    another texture sampled at texel centers and memoized
+     ImageTexture     an image file mapped onto a plane or a sphere
+
+   Patterns take textures rather than colors, so they compose: a checker of
+   noise and stripes, noise mixed over a gradient, and so on.
+
+   Textures evaluate batches of points, structure of arrays in and out. The
+   loops run in fixed-size groups of points without branches, which GCC
+   vectorizes at -O2; the wavefront renderer shades each object's hits of a
+   wave in one batch. color() is a batch of one, so the recursive renderer
+   gets the same bits. Cell indices are integer floors, so coordinates over
+   a cell size must stay within int range. */
+
+// Points per Texture::evaluate call; colors() splits larger batches
+const size_t TEXTURE_BATCH = 64;
+
+class Texture {
+public:
+    virtual ~Texture() {}
+
+    vec3 color(const vec3 &p) const;
+
+    // Colors at points (x[k], y[k], z[k]) into (r[k], g[k], b[k]), k < n
+    void colors(const float* x, const float* y, const float* z, size_t n, float* r, float* g, float* b) const;
+
+    // Same for n <= TEXTURE_BATCH. The outputs must not overlap the inputs.
+    virtual void evaluate(const float* x, const float* y, const float* z, size_t n,
+                          float* r, float* g, float* b) const = 0;
+};
+
+class SolidTexture : public Texture {
+public:
+    explicit SolidTexture(const vec3 &color);
+    void evaluate(const float* x, const float* y, const float* z, size_t n,
+                  float* r, float* g, float* b) const override;
+
+private:
+    const vec3 value;
+};
+
+// Two textures selected per point by the parity of a cell index
+class CellTexture : public Texture {
+public:
+    void evaluate(const float* x, const float* y, const float* z, size_t n,
+                  float* r, float* g, float* b) const override;
+
+protected:
+    CellTexture(std::shared_ptr<const Texture> even, std::shared_ptr<const Texture> odd);
+
+    // 1 where odd is shown, 0 where even is
+    virtual void parity(const float* x, const float* y, const float* z, size_t n, int* odd) const = 0;
+
+private:
+    const std::shared_ptr<const Texture> even, odd;
+};
+
+class CheckerTexture : public CellTexture {
+public:
+    // Cubes of side size centered on multiples of size, the one on the
+    // origin even's; axis-aligned planes through multiples of size (the
+    // floor) cut the cubes in the middle, not along a face, so they do not
+    // speckle with rounding
+    CheckerTexture(std::shared_ptr<const Texture> even, std::shared_ptr<const Texture> odd, float size);
+
+protected:
+    void parity(const float* x, const float* y, const float* z, size_t n, int* odd) const override;
+
+private:
+    const float size;
+};
+
+class StripeTexture : public CellTexture {
+public:
+    // Slabs width thick across axis, a unit vector
+    StripeTexture(std::shared_ptr<const Texture> even, std::shared_ptr<const Texture> odd,
+                  const vec3 &axis, float width);
+
+protected:
+    void parity(const float* x, const float* y, const float* z, size_t n, int* odd) const override;
+
+private:
+    const vec3 axis;
+    const float width;
+};
+
+// Two textures blended per point by a weight in [0, 1]: a + (b - a) * w
+class BlendTexture : public Texture {
+public:
+    void evaluate(const float* x, const float* y, const float* z, size_t n,
+                  float* r, float* g, float* b) const override;
+
+protected:
+    BlendTexture(std::shared_ptr<const Texture> a, std::shared_ptr<const Texture> b);
+
+    virtual void weight(const float* x, const float* y, const float* z, size_t n, float* w) const = 0;
+
+private:
+    const std::shared_ptr<const Texture> a, b;
+};
+
+class GradientTexture : public BlendTexture {
+public:
+    // a at from and before it, b at to and past it
+    GradientTexture(std::shared_ptr<const Texture> a, std::shared_ptr<const Texture> b,
+                    const vec3 &from, const vec3 &to);
+
+protected:
+    void weight(const float* x, const float* y, const float* z, size_t n, float* w) const override;
+
+private:
+    const vec3 from;
+    const vec3 step;   // (to - from) / |to - from|^2
+};
+
+enum NoiseKind { NOISE_VALUE, NOISE_PERLIN };
+
+class NoiseTexture : public BlendTexture {
+public:
+    // Fractal sum of octaves of noise with lattice spacing scale, each
+    // octave at twice the frequency and half the amplitude of the previous
+    // one, normalized to [0, 1]. seed picks another noise field.
+    NoiseTexture(std::shared_ptr<const Texture> a, std::shared_ptr<const Texture> b, NoiseKind kind,
+                 float scale, int octaves = 4, unsigned seed = 0);
+
+protected:
+    void weight(const float* x, const float* y, const float* z, size_t n, float* w) const override;
+
+private:
+    const NoiseKind kind;
+    const float frequency;   // 1 / scale
+    const int octaves;
+    const unsigned seed;
+};
+
+class MixTexture : public BlendTexture {
+public:
+    // The red channel of mask, clamped to [0, 1], is the weight of b
+    MixTexture(std::shared_ptr<const Texture> a, std::shared_ptr<const Texture> b, std::shared_ptr<const Texture> mask);
+
+protected:
+    void weight(const float* x, const float* y, const float* z, size_t n, float* w) const override;
+
+private:
+    const std::shared_ptr<const Texture> mask;
+};
+
+/* A texture sampled at the center of the texel (a cube of side texel) that
+   holds the point, so it looks like a raster of that resolution. Each thread
+   keeps a direct-mapped cache of recent texels; hits of a tile land on a
+   few texels of an object, so a costly texture (fractal noise) is
+   evaluated about once per texel instead of once per hit. Only the misses
+   of a batch go to texture, batched. Results do not depend on what is
+   cached. */
+class CachedTexture : public Texture {
+public:
+    CachedTexture(std::shared_ptr<const Texture> texture, float texel);
+    void evaluate(const float* x, const float* y, const float* z, size_t n,
+                  float* r, float* g, float* b) const override;
+
+private:
+    const std::shared_ptr<const Texture> texture;
+    const float texel;
+    const unsigned id;   // tags this texture's cache entries
+};
+
+/* A tiled texture file (texture_cache.h), filtered trilinearly between the
+   two mip levels that bracket the footprint of the hit: pixel_spread times
+   its distance from O, stretched by the incidence angle (by the geometric
+   mean of the footprint's axes, 1 / sqrt(cos)). Distant and grazing hits
+   thus read small levels, and only their tiles are loaded. Reflected hits
+   use the same distance from O, so they are filtered as if seen directly. */
+class ImageTexture : public Texture {
+public:
+    // On a plane: the image spans size x size from origin along u and v, two
+    // orthogonal unit vectors in the plane, and repeats
+    ImageTexture(std::shared_ptr<TiledImage> image, const vec3 &origin, const vec3 &u, const vec3 &v, float size);
+    // On a sphere: longitude along the image's width, from the -x side,
+    // latitude down its height, from the +y pole
+    ImageTexture(std::shared_ptr<TiledImage> image, const vec3 &center, float radius);
+
+    void evaluate(const float* x, const float* y, const float* z, size_t n,
+                  float* r, float* g, float* b) const override;
+
+private:
+    // Bilinear sample of level l at (s, t) in image widths and heights
+    vec3 sample(int l, float s, float t) const;
+
+    const std::shared_ptr<TiledImage> image;
+    const bool spherical;
+    const vec3 origin;      // or the center
+    const vec3 u, v, normal;
+    const float size;       // or the radius
+    float texels_per_unit;  // of level 0, along the image's longer axis
+};
+
+// The textures of --texture, built around color: checker, stripes,
+// gradient, value, perlin, marble (perlin noise over stripes) and baked
+// (marble cached at 1/64 texels). nullptr for another name.
+std::shared_ptr<const Texture> make_texture(const std::string &name, const vec3 &color);
+
+// Applies an --texture INDEX=NAME to scene[INDEX]; a NAME with a dot or a
+// slash is a tiled texture file for a sphere or a plane, which spans one
+// unit square on a plane. Prints an error and returns false if the index,
+// the name or the file is invalid.
+bool attach_texture(const std::string &spec, std::vector<Object*> &scene);
+
+#endif // TEXTURE_H
@@ -0,0 +1,319 @@
+# include "texture_cache.h"
+
+# include <algorithm>
+# include <cerrno>
+# include <cmath>
+# include <cstdio>
+# include <cstring>
+# include <iostream>
+# include <fcntl.h>
+# include <sys/stat.h>
+# include <unistd.h>
+
+TileCache texture_cache(size_t(64) << 20);
+
+static const char TEXTURE_MAGIC[8] = {'R', 'T', 'T', 'E', 'X', '1', '\0', '\0'};
+
+struct TextureHeader {
+    char magic[8];
+    int32_t width;
+    int32_t height;
+    int32_t tile;
+    int32_t levels;
+};
+
+// Box-filtered half of a CV_32FC3 level, rounding the size up; the last
+// column and row of an odd level are averaged with themselves
+static cv::Mat half_level(const cv::Mat &level) {
+    cv::Mat half((level.rows + 1) / 2, (level.cols + 1) / 2, CV_32FC3);
+    for (int y = 0; y < half.rows; ++y) {
+        const float* top = level.ptr<float>(2 * y);
+        const float* bottom = level.ptr<float>(std::min(2 * y + 1, level.rows - 1));
+        float* out = half.ptr<float>(y);
+        for (int x = 0; x < half.cols; ++x) {
+            const int x0 = 3 * (2 * x), x1 = 3 * std::min(2 * x + 1, level.cols - 1);
+            for (int c = 0; c < 3; ++c) {
+                out[3 * x + c] = (top[x0 + c] + top[x1 + c] + bottom[x0 + c] + bottom[x1 + c]) * .25f;
+            }
+        }
+    }
+    return half;
+}
+
+bool write_tiled_texture(const cv::Mat &image, const std::string &path) {
+    if (image.empty() || image.type() != CV_8UC3) {
+        std::cerr << "Error: " << path << ": a texture needs an 8-bit, 3-channel image." << std::endl;
+        return false;
+    }
+    std::vector<cv::Mat> mips(1);
+    image.convertTo(mips[0], CV_32FC3);
+    while (mips.back().rows > 1 || mips.back().cols > 1) mips.push_back(half_level(mips.back()));
+
+    TextureHeader header;
+    std::memcpy(header.magic, TEXTURE_MAGIC, sizeof header.magic);
+    header.width = image.cols;
+    header.height = image.rows;
+    header.tile = TEXTURE_TILE;
+    header.levels = int32_t(mips.size());
+    std::vector<TextureLevel> levels(mips.size());
+    uint64_t offset = sizeof header + sizeof(TextureLevel) * levels.size();
+    for (size_t l = 0; l < mips.size(); ++l) {
+        TextureLevel &level = levels[l];
+        level.width = mips[l].cols;
+        level.height = mips[l].rows;
+        level.tiles_x = (level.width + TEXTURE_TILE - 1) / TEXTURE_TILE;
+        level.tiles_y = (level.height + TEXTURE_TILE - 1) / TEXTURE_TILE;
+        level.offset = offset;
+        offset += uint64_t(level.tiles_x) * level.tiles_y * TEXTURE_TILE_BYTES;
+    }
+
+    FILE* file = std::fopen(path.c_str(), "wb");
+    if (!file) {
+        std::cerr << "Error: Could not create " << path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    bool ok = std::fwrite(&header, sizeof header, 1, file) == 1
+           && std::fwrite(levels.data(), sizeof(TextureLevel), levels.size(), file) == levels.size();
+    std::vector<uint8_t> tile(TEXTURE_TILE_BYTES);
+    for (size_t l = 0; ok && l < mips.size(); ++l) {
+        const TextureLevel &level = levels[l];
+        for (int ty = 0; ok && ty < level.tiles_y; ++ty) {
+            for (int tx = 0; ok && tx < level.tiles_x; ++tx) {
+                uint8_t* out = tile.data();
+                for (int y = 0; y < TEXTURE_TILE; ++y) {
+                    const float* row = mips[l].ptr<float>(std::min(ty * TEXTURE_TILE + y, level.height - 1));
+                    for (int x = 0; x < TEXTURE_TILE; ++x, out += 4) {
+                        const float* texel = row + 3 * std::min(tx * TEXTURE_TILE + x, level.width - 1);
+                        for (int c = 0; c < 3; ++c) out[c] = uint8_t(std::lround(std::min(std::max(texel[c], 0.f), 255.f)));
+                        out[3] = 255;
+                    }
+                }
+                ok = std::fwrite(tile.data(), 1, tile.size(), file) == tile.size();
+            }
+        }
+    }
+    if (std::fclose(file) != 0 || !ok) {
+        std::cerr << "Error: Could not write " << path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/* class TiledImage */
+std::shared_ptr<TiledImage> TiledImage::open(const std::string &path, TileCache &cache) {
+    std::shared_ptr<TiledImage> image(new TiledImage());
+    image->path_ = path;
+    image->fd_ = ::open(path.c_str(), O_RDONLY);
+    if (image->fd_ < 0) {
+        std::cerr << "Error: Could not open " << path << ": " << std::strerror(errno) << std::endl;
+        return nullptr;
+    }
+    TextureHeader header;
+    struct stat st;
+    bool ok = fstat(image->fd_, &st) == 0 && pread(image->fd_, &header, sizeof header, 0) == ssize_t(sizeof header)
+           && std::memcmp(header.magic, TEXTURE_MAGIC, sizeof header.magic) == 0
+           && header.tile == TEXTURE_TILE && header.levels > 0 && header.levels <= 32;
+    if (ok) {
+        image->levels_.resize(header.levels);
+        const size_t bytes = sizeof(TextureLevel) * image->levels_.size();
+        ok = pread(image->fd_, image->levels_.data(), bytes, sizeof header) == ssize_t(bytes);
+    }
+    size_t tiles = 0;
+    for (size_t l = 0; ok && l < image->levels_.size(); ++l) {
+        const TextureLevel &level = image->levels_[l];
+        const uint64_t count = uint64_t(level.tiles_x) * level.tiles_y;
+        ok = level.width > 0 && level.height > 0
+            && level.tiles_x == (level.width + TEXTURE_TILE - 1) / TEXTURE_TILE
+            && level.tiles_y == (level.height + TEXTURE_TILE - 1) / TEXTURE_TILE
+            && level.offset + count * TEXTURE_TILE_BYTES <= uint64_t(st.st_size);
+        image->first_tile_.push_back(tiles);
+        tiles += count;
+    }
+    if (!ok || tiles >= (size_t(1) << 40)) {
+        std::cerr << "Error: " << path << " is not a tiled texture; convert it with --make-texture." << std::endl;
+        return nullptr;
+    }
+    image->slots_.reset(new std::atomic<uint32_t>[tiles]);
+    for (size_t k = 0; k < tiles; ++k) image->slots_[k].store(0, std::memory_order_relaxed);
+    image->cache_ = &cache;
+    image->id_ = cache.add_image();
+    return image;
+}
+
+TiledImage::~TiledImage() {
+    if (cache_) cache_->remove_image(*this);
+    if (fd_ >= 0) ::close(fd_);
+}
+
+void TiledImage::texel(int l, int x, int y, float &b, float &g, float &r) const {
+    const int tx = x / TEXTURE_TILE, ty = y / TEXTURE_TILE;
+    const size_t offset = size_t(y % TEXTURE_TILE) * TEXTURE_TILE + x % TEXTURE_TILE;
+    const uint32_t v = cache_->texel(*this, tile_index(l, tx, ty), l, tx, ty, offset);
+    b = float(v & 0xff) * (1.f / 255);
+    g = float((v >> 8) & 0xff) * (1.f / 255);
+    r = float((v >> 16) & 0xff) * (1.f / 255);
+}
+
+/* class TileCache */
+
+// Per thread, the tiles used last: the buffer that held each one and the
+// buffer's sequence number then
+static const size_t MICRO_CACHE_SIZE = 16;
+
+struct MicroCache {
+    const TileCache* cache = nullptr;
+    uint32_t epoch = 0;
+    uint64_t key[MICRO_CACHE_SIZE] = {};
+    const void* buffer[MICRO_CACHE_SIZE] = {};
+    uint32_t sequence[MICRO_CACHE_SIZE] = {};
+};
+
+static thread_local MicroCache micro;
+
+TileCache::TileCache(size_t budget): allocated_(0), next_image_(1), epoch_(1), reads_(0), evictions_(0) {
+    set_budget(budget);
+}
+
+TileCache::~TileCache() {
+    clear();
+}
+
+void TileCache::set_budget(size_t budget) {
+    std::lock_guard<std::mutex> guard(lock_);
+    clear();
+    capacity_ = std::max<size_t>(budget / TEXTURE_TILE_BYTES, 1);
+    buffers_.reset(new std::atomic<Buffer*>[capacity_]);
+    for (size_t k = 0; k < capacity_; ++k) buffers_[k].store(nullptr, std::memory_order_relaxed);
+    epoch_.fetch_add(1, std::memory_order_release);
+}
+
+size_t TileCache::resident() const {
+    return allocated_.load(std::memory_order_relaxed);
+}
+
+void TileCache::clear() {
+    const size_t n = allocated_.load(std::memory_order_relaxed);
+    for (size_t k = 0; k < n; ++k) {
+        Buffer* buffer = buffers_[k].load(std::memory_order_relaxed);
+        if (buffer->slot) buffer->slot->store(0, std::memory_order_relaxed);
+        delete buffer;
+    }
+    allocated_.store(0, std::memory_order_relaxed);
+    hand_ = 0;
+}
+
+uint32_t TileCache::add_image() {
+    return next_image_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void TileCache::remove_image(TiledImage &image) {
+    std::lock_guard<std::mutex> guard(lock_);
+    const size_t n = allocated_.load(std::memory_order_relaxed);
+    for (size_t k = 0; k < n; ++k) {
+        Buffer* buffer = buffers_[k].load(std::memory_order_relaxed);
+        if (buffer->key.load(std::memory_order_relaxed) >> 40 != image.id_) continue;
+        const uint32_t sequence = buffer->sequence.load(std::memory_order_relaxed);
+        buffer->sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        buffer->key.store(0, std::memory_order_relaxed);
+        buffer->sequence.store(sequence + 2, std::memory_order_release);
+        buffer->slot = nullptr;
+        buffer->referenced.store(false, std::memory_order_relaxed);
+    }
+}
+
+uint32_t TileCache::texel(const TiledImage &image, size_t tile, int l, int tx, int ty, size_t offset) {
+    const uint64_t key = tile_key(image.id_, tile);
+    MicroCache &m = micro;
+    const uint32_t epoch = epoch_.load(std::memory_order_acquire);
+    if (m.cache != this || m.epoch != epoch) {
+        m = MicroCache();
+        m.cache = this;
+        m.epoch = epoch;
+    }
+    const size_t entry = (key ^ key >> 7) % MICRO_CACHE_SIZE;
+    if (m.key[entry] == key) {
+        const Buffer* buffer = static_cast<const Buffer*>(m.buffer[entry]);
+        const uint32_t v = buffer->texels[offset].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (buffer->sequence.load(std::memory_order_relaxed) == m.sequence[entry]) return v;
+    }
+    for (;;) {
+        uint32_t slot = image.slots_[tile].load(std::memory_order_acquire);
+        if (slot == 0) slot = load(image, tile, l, tx, ty);
+        Buffer* buffer = buffers_[slot - 1].load(std::memory_order_acquire);
+        const uint32_t sequence = buffer->sequence.load(std::memory_order_acquire);
+        if (sequence & 1 || buffer->key.load(std::memory_order_relaxed) != key) continue;
+        const uint32_t v = buffer->texels[offset].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (buffer->sequence.load(std::memory_order_relaxed) != sequence) continue;
+        // Test first, so hits on a hot tile do not keep writing its line
+        if (!buffer->referenced.load(std::memory_order_relaxed)) {
+            buffer->referenced.store(true, std::memory_order_relaxed);
+        }
+        m.key[entry] = key;
+        m.buffer[entry] = buffer;
+        m.sequence[entry] = sequence;
+        return v;
+    }
+}
+
+uint32_t TileCache::load(const TiledImage &image, size_t tile, int l, int tx, int ty) {
+    // Read and decode outside the lock; another thread may load the same
+    // tile meanwhile, the loser's copy is dropped
+    static thread_local uint8_t bytes[TEXTURE_TILE_BYTES];
+    const TextureLevel &level = image.levels_[l];
+    const uint64_t position = level.offset + (uint64_t(ty) * level.tiles_x + tx) * TEXTURE_TILE_BYTES;
+    if (pread(image.fd_, bytes, sizeof bytes, off_t(position)) != ssize_t(sizeof bytes)) {
+        // open() checked the size, so only an I/O error gets here; the tile
+        // reads as black rather than stopping the render
+        std::memset(bytes, 0, sizeof bytes);
+    }
+
+    std::lock_guard<std::mutex> guard(lock_);
+    uint32_t slot = image.slots_[tile].load(std::memory_order_relaxed);
+    if (slot != 0) return slot;
+    slot = victim();
+    Buffer* buffer = buffers_[slot - 1].load(std::memory_order_relaxed);
+    if (buffer->slot) {
+        buffer->slot->store(0, std::memory_order_relaxed);
+        evictions_.fetch_add(1, std::memory_order_relaxed);
+    }
+    const uint32_t sequence = buffer->sequence.load(std::memory_order_relaxed);
+    buffer->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    buffer->key.store(tile_key(image.id_, tile), std::memory_order_relaxed);
+    for (size_t k = 0; k < size_t(TEXTURE_TILE) * TEXTURE_TILE; ++k) {
+        const uint8_t* texel = bytes + 4 * k;
+        buffer->texels[k].store(uint32_t(texel[0]) | uint32_t(texel[1]) << 8 | uint32_t(texel[2]) << 16,
+                                std::memory_order_relaxed);
+    }
+    buffer->sequence.store(sequence + 2, std::memory_order_release);
+    buffer->referenced.store(true, std::memory_order_relaxed);
+    buffer->slot = &image.slots_[tile];
+    image.slots_[tile].store(slot, std::memory_order_release);
+    reads_.fetch_add(1, std::memory_order_relaxed);
+    return slot;
+}
+
+// Called with lock_ held
+uint32_t TileCache::victim() {
+    const size_t n = allocated_.load(std::memory_order_relaxed);
+    if (n < capacity_) {
+        Buffer* buffer = new Buffer();
+        buffer->sequence.store(0, std::memory_order_relaxed);
+        buffer->key.store(0, std::memory_order_relaxed);
+        buffer->referenced.store(false, std::memory_order_relaxed);
+        buffer->slot = nullptr;
+        buffers_[n].store(buffer, std::memory_order_release);
+        allocated_.store(n + 1, std::memory_order_relaxed);
+        return uint32_t(n + 1);
+    }
+    for (;;) {
+        const size_t k = hand_;
+        hand_ = (hand_ + 1) % capacity_;
+        Buffer* buffer = buffers_[k].load(std::memory_order_relaxed);
+        if (!buffer->referenced.load(std::memory_order_relaxed)) return uint32_t(k + 1);
+        buffer->referenced.store(false, std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,155 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+# include <atomic>
+# include <cstddef>
+# include <cstdint>
+# include <memory>
+# include <mutex>
+# include <string>
+# include <vector>
+# include <opencv2/opencv.hpp>
+
+/* Image textures are read from a tiled, mip-mapped file (--make-texture
+   converts any image OpenCV reads):
+
+     header | level table | tiles of level 0 | tiles of level 1 | ... | 1 x 1
+
+   Each level halves the one before (rounding up) with a 2 x 2 box filter,
+   down to 1 x 1. Levels are cut into TEXTURE_TILE x TEXTURE_TILE tiles of
+   BGRA8 texels, row by row; edge tiles are padded by repeating the last
+   column and row. Texels are in the renderer's channel order, so texel
+   (b, g, r) / 255 is the color vec3(b, g, r).
+
+   Nothing of an image is kept in memory but its level table: tiles are read
+   on demand into the process-wide TileCache, whose memory is bounded by
+   --texture-cache, and evicted when it is full. A render touches the tiles
+   of the mip levels its footprints select, so distant and small objects
+   only ever load the small levels. */
+
+// Texels per tile edge; 64 x 64 BGRA8 is 16 KB
+const int TEXTURE_TILE = 64;
+const size_t TEXTURE_TILE_BYTES = size_t(TEXTURE_TILE) * TEXTURE_TILE * 4;
+
+// Writes image (CV_8UC3, as cv::imread returns it) to path in the tiled
+// format. Prints an error and returns false on failure.
+bool write_tiled_texture(const cv::Mat &image, const std::string &path);
+
+struct TextureLevel {
+    int width, height;
+    int tiles_x, tiles_y;
+    uint64_t offset;    // of the level's first tile in the file
+};
+
+class TileCache;
+
+// An open tiled texture file; tiles come through the cache
+class TiledImage {
+public:
+    ~TiledImage();
+    TiledImage(const TiledImage&) = delete;
+    TiledImage& operator=(const TiledImage&) = delete;
+
+    // Prints an error and returns nullptr if path is not a tiled texture
+    static std::shared_ptr<TiledImage> open(const std::string &path, TileCache &cache);
+
+    int levels() const { return int(levels_.size()); }
+    const TextureLevel& level(int l) const { return levels_[l]; }
+
+    // Texel (x, y) of level l, which must be inside the level, as a color
+    // in [0, 1]. Lock-free unless the tile has to be read from the file.
+    void texel(int l, int x, int y, float &b, float &g, float &r) const;
+
+private:
+    friend class TileCache;
+
+    TiledImage() = default;
+
+    // Index of tile (tx, ty) of level l in slots_
+    size_t tile_index(int l, int tx, int ty) const {
+        return first_tile_[l] + size_t(ty) * levels_[l].tiles_x + tx;
+    }
+
+    std::string path_;
+    int fd_ = -1;
+    uint32_t id_ = 0;
+    std::vector<TextureLevel> levels_;
+    std::vector<size_t> first_tile_;
+    // Per tile, 1 + the cache buffer holding it, 0 when not resident
+    std::unique_ptr<std::atomic<uint32_t>[]> slots_;
+    TileCache* cache_ = nullptr;
+};
+
+/* Tiles of every open TiledImage, in at most budget bytes of 16 KB buffers
+   allocated as they are first needed.
+
+   Lookups do not lock. A buffer's contents are guarded by a sequence
+   number (a seqlock): it is odd while the buffer is being refilled, and a
+   texel read from the buffer is only used if the number did not change
+   around the read. Buffers are never freed while the cache lives, so a
+   reader that races with an eviction sees a changed number and retries,
+   never freed memory. Each thread also keeps a small direct-mapped micro
+   cache of the tiles it used last, so most texel reads are one load plus
+   the sequence check, without touching shared state.
+
+   Misses read the tile from the file without the lock, then take it to
+   install the tile. Once the budget is used up the victim is chosen by the
+   CLOCK algorithm, the usual lock-free-lookup approximation of LRU: a hit
+   sets the buffer's referenced bit, and the clock hand clears set bits and
+   evicts the first buffer whose bit is already clear. */
+class TileCache {
+public:
+    explicit TileCache(size_t budget);
+    ~TileCache();
+    TileCache(const TileCache&) = delete;
+    TileCache& operator=(const TileCache&) = delete;
+
+    // Changes the budget (at least one tile) and empties the cache; only
+    // between renders
+    void set_budget(size_t budget);
+    size_t budget() const { return capacity_ * TEXTURE_TILE_BYTES; }
+
+    // Buffers allocated so far, and tiles read from files
+    size_t resident() const;
+    uint64_t reads() const { return reads_.load(std::memory_order_relaxed); }
+    uint64_t evictions() const { return evictions_.load(std::memory_order_relaxed); }
+
+private:
+    friend class TiledImage;
+
+    struct Buffer {
+        std::atomic<uint32_t> sequence;     // odd while refilled
+        std::atomic<uint64_t> key;          // tile_key of the tile held, 0 when none
+        std::atomic<uint32_t> texels[TEXTURE_TILE * TEXTURE_TILE];
+        std::atomic<bool> referenced;
+        std::atomic<uint32_t>* slot;        // the TiledImage slot pointing here, under lock_
+    };
+
+    static uint64_t tile_key(uint32_t image, size_t tile) { return uint64_t(image) << 40 | tile; }
+
+    uint32_t add_image();
+    // Drops the tiles of an image being closed
+    void remove_image(TiledImage &image);
+
+    // Texel of tile index of image, at offset texel within the tile
+    uint32_t texel(const TiledImage &image, size_t tile, int l, int tx, int ty, size_t offset);
+    // Reads the tile into a buffer and returns the buffer's number + 1
+    uint32_t load(const TiledImage &image, size_t tile, int l, int tx, int ty);
+    uint32_t victim();
+    void clear();
+
+    size_t capacity_ = 0;
+    std::unique_ptr<std::atomic<Buffer*>[]> buffers_;
+    std::atomic<size_t> allocated_;
+    size_t hand_ = 0;
+    std::mutex lock_;
+    std::atomic<uint32_t> next_image_;
+    std::atomic<uint32_t> epoch_;   // bumped by set_budget, invalidates micro caches
+    std::atomic<uint64_t> reads_, evictions_;
+};
+
+// Shared by all image textures; --texture-cache MB sets its budget
+// (default 64 MB)
+extern TileCache texture_cache;
+
+#endif // TEXTURE_CACHE_H
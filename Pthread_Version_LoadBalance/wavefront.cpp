@@ -0,0 +1,334 @@
+# include "graph.h"
+# include "aov.h"
+# include "texture.h"
+
+# include <algorithm>
+# include <cstdint>
+# include <limits>
+
+/* Wavefront renderer
+
+   Instead of recursing per pixel through intersect_color, a worker takes a
+   batch of rows and pushes all of their rays through one stage at a time:
+
+     intersect -> sort hits by object -> shade -> shadow -> light,
+     queueing reflection rays for the next wave
+
+   until no rays are left. Each stage is a flat loop over SoA queues. The
+   intersect and shadow stages run objects in the outer loop and hand each
+   object the whole queue (Object::intersect_batch and occluded_batch), so
+   there is one virtual call per object and wave, and spheres and planes run
+   their distance kernel inline over the arrays. The local color of every bounce is kept, and the
+   pixels are combined from the deepest wave up with the same clamps as the
+   recursion, so the output is bit-identical to the default renderer.
+
+   With --sort-rays the reflection rays of a wave are sorted by direction
+   octant and then by the Morton code of their origin before they are traced,
+   so neighbouring rays in the queue start close together and head the same
+   way. Paths are tracked per ray, so the order does not change the result.
+
+   AOVs come from the first wave, whose hits are the primary hits, and the
+   reflection term from the combine step of that wave. */
+
+// Rows are taken from the bands until a batch has at least this many rays
+static const size_t BATCH_RAYS = 4096;
+
+struct Vec3Array {
+    std::vector<float> x, y, z;
+
+    void resize(size_t n) { x.resize(n); y.resize(n); z.resize(n); }
+    void clear() { x.clear(); y.clear(); z.clear(); }
+    void push(const vec3 &v) { x.push_back(v.x); y.push_back(v.y); z.push_back(v.z); }
+    vec3 get(size_t k) const { return vec3(x[k], y[k], z[k]); }
+    void set(size_t k, const vec3 &v) { x[k] = v.x; y[k] = v.y; z[k] = v.z; }
+};
+
+// Rays of one wave
+struct RayQueue {
+    Vec3Array origin;
+    Vec3Array dir;
+    std::vector<float> intensity;
+    std::vector<int> path;      // pixel of the batch the ray belongs to
+
+    size_t size() const { return path.size(); }
+
+    void clear() {
+        origin.clear();
+        dir.clear();
+        intensity.clear();
+        path.clear();
+    }
+
+    void push(const vec3 &o, const vec3 &d, float i, int p) {
+        origin.push(o);
+        dir.push(d);
+        intensity.push_back(i);
+        path.push_back(p);
+    }
+};
+
+// What a wave contributes: c = clamp(local + reflection * c_deeper) per path
+struct WaveRecord {
+    std::vector<int> path;
+    Vec3Array local;
+    std::vector<float> reflection;
+
+    void clear() {
+        path.clear();
+        local.clear();
+        reflection.clear();
+    }
+};
+
+// Per-worker stage buffers, reused across waves and batches
+struct HitQueue {
+    std::vector<float> t;
+    std::vector<int> object;
+    std::vector<HitRecord> record;
+    std::vector<size_t> counts;
+    std::vector<size_t> order;  // ray indices of the hits, grouped by object
+    Vec3Array P, N, PL, PO, color;
+    Vec3Array shadow_origin;
+    std::vector<float> light_distance;
+    std::vector<int> self;      // object of each hit, in hit order
+    std::vector<char> lit;
+};
+
+static RayBatch batch(const Vec3Array &origin, const Vec3Array &dir, size_t n) {
+    RayBatch rays = {origin.x.data(), origin.y.data(), origin.z.data(), dir.x.data(), dir.y.data(), dir.z.data(), n};
+    return rays;
+}
+
+static void intersect_stage(const RayQueue &rays, std::vector<Object*> &scene, HitQueue &hits) {
+    const size_t n = rays.size();
+    hits.t.assign(n, std::numeric_limits<float>::infinity());
+    hits.object.assign(n, -1);
+    hits.record.resize(n);
+    const RayBatch queue = batch(rays.origin, rays.dir, n);
+    for (size_t i = 0; i < scene.size(); ++i) {
+        scene[i]->intersect_batch(queue, int(i), hits.t.data(), hits.object.data(), hits.record.data());
+    }
+}
+
+// Counting sort of the rays that hit something, by object
+static void sort_stage(const RayQueue &rays, const std::vector<Object*> &scene, HitQueue &hits) {
+    hits.counts.assign(scene.size() + 1, 0);
+    for (size_t k = 0; k < rays.size(); ++k) {
+        if (hits.object[k] >= 0) ++hits.counts[hits.object[k] + 1];
+    }
+    for (size_t i = 1; i < hits.counts.size(); ++i) {
+        hits.counts[i] += hits.counts[i - 1];
+    }
+    hits.order.resize(hits.counts.back());
+    for (size_t k = 0; k < rays.size(); ++k) {
+        if (hits.object[k] >= 0) hits.order[hits.counts[hits.object[k]]++] = k;
+    }
+}
+
+static void shade_stage(const RayQueue &rays, std::vector<Object*> &scene, HitQueue &hits) {
+    const size_t m = hits.order.size();
+    hits.P.resize(m);
+    hits.N.resize(m);
+    hits.PL.resize(m);
+    hits.PO.resize(m);
+    hits.color.resize(m);
+    for (size_t q = 0; q < m; ++q) {
+        const size_t k = hits.order[q];
+        Object* obj = scene[hits.object[k]];
+        const vec3 origin = rays.origin.get(k), dir = rays.dir.get(k);
+        const vec3 P = origin + dir * hits.t[k];
+        hits.P.set(q, P);
+        hits.N.set(q, obj->get_hit_normal(P, dir, hits.record[k]));
+        hits.PL.set(q, normalizes(light_point - P));
+        hits.PO.set(q, normalizes(origin - P));
+        if (!obj->texture) hits.color.set(q, surface_color(obj, P));
+    }
+    // Hits are grouped by object, so each textured object's hits are one batch
+    for (size_t q0 = 0, q1; q0 < m; q0 = q1) {
+        const int i = hits.object[hits.order[q0]];
+        for (q1 = q0 + 1; q1 < m && hits.object[hits.order[q1]] == i; ++q1) {}
+        if (const Texture* texture = scene[i]->texture.get()) {
+            texture->colors(hits.P.x.data() + q0, hits.P.y.data() + q0, hits.P.z.data() + q0, q1 - q0,
+                            hits.color.x.data() + q0, hits.color.y.data() + q0, hits.color.z.data() + q0);
+        }
+    }
+}
+
+// Same test as in_shadow, one object at a time over all the hits
+static void shadow_stage(std::vector<Object*> &scene, HitQueue &hits) {
+    const size_t m = hits.order.size();
+    hits.shadow_origin.resize(m);
+    hits.light_distance.resize(m);
+    hits.self.resize(m);
+    for (size_t q = 0; q < m; ++q) {
+        const vec3 P = hits.P.get(q);
+        hits.shadow_origin.set(q, P + hits.N.get(q) * .0001f);
+        hits.light_distance[q] = glm::length(light_point - P);
+        hits.self[q] = hits.object[hits.order[q]];
+    }
+    hits.lit.assign(m, 0);  // blocked until inverted below
+    const RayBatch queue = batch(hits.shadow_origin, hits.PL, m);
+    for (size_t i = 0; i < scene.size(); ++i) {
+        scene[i]->occluded_batch(queue, hits.light_distance.data(), scene[i]->convex() ? hits.self.data() : nullptr,
+                                 int(i), hits.lit.data());
+    }
+    for (size_t q = 0; q < m; ++q) {
+        hits.lit[q] = !hits.lit[q];
+    }
+}
+
+// Local color of every hit, and its reflection ray for the next wave. Rays
+// below the intensity cutoff are dropped here: intersect_color returns black
+// for them whether they hit or not.
+static void light_stage(const RayQueue &rays, std::vector<Object*> &scene, const HitQueue &hits, WaveRecord &wave, RayQueue &next) {
+    wave.clear();
+    next.clear();
+    for (size_t q = 0; q < hits.order.size(); ++q) {
+        const size_t k = hits.order[q];
+        const Object* obj = scene[hits.object[k]];
+        const vec3 color = hits.color.get(q), N = hits.N.get(q);
+        vec3 c = ambient * color;
+        if (hits.lit[q]) {
+            c += diffuse_term(obj, color, N, hits.PL.get(q));
+            c += specular_term(obj, N, hits.PL.get(q), hits.PO.get(q));
+        }
+        wave.path.push_back(rays.path[k]);
+        wave.local.push(c);
+        wave.reflection.push_back(obj->reflection);
+
+        const float intensity = obj->reflection * rays.intensity[k];
+        if (intensity < 0.01) continue;
+        const vec3 dir = rays.dir.get(k);
+        vec3 reflect_ray = dir - 2 * glm::dot(dir, N) * N;
+        next.push(hits.P.get(q) + N * .0001f, reflect_ray, intensity, rays.path[k]);
+    }
+}
+
+// Spreads the low 8 bits of v so there are two zero bits between each
+static inline uint32_t part1by2(uint32_t v) {
+    v &= 0xff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// Waves smaller than this are traced in the order they were queued
+static const size_t SORT_MIN_RAYS = 64;
+
+// Reorders rays by (direction octant, Morton code of the origin on a 256^3
+// grid over the origins' bounding box). The 27-bit key sits above the ray
+// index in one 64-bit word and is LSD radix sorted, 9 bits per pass.
+static void sort_rays(RayQueue &rays, RayQueue &scratch, std::vector<uint64_t> &keys, std::vector<uint64_t> &tmp) {
+    const size_t n = rays.size();
+    if (n < SORT_MIN_RAYS) return;
+    vec3 lo(std::numeric_limits<float>::infinity()), hi(-std::numeric_limits<float>::infinity());
+    for (size_t k = 0; k < n; ++k) {
+        lo = glm::min(lo, rays.origin.get(k));
+        hi = glm::max(hi, rays.origin.get(k));
+    }
+    const vec3 extent = glm::max(hi - lo, vec3(1e-6f));
+    const vec3 scale = vec3(255.f / extent.x, 255.f / extent.y, 255.f / extent.z);
+
+    keys.resize(n);
+    for (size_t k = 0; k < n; ++k) {
+        const vec3 cell = (rays.origin.get(k) - lo) * scale;
+        const uint64_t octant = (rays.dir.x[k] < 0) | (rays.dir.y[k] < 0) << 1 | (rays.dir.z[k] < 0) << 2;
+        const uint64_t morton = part1by2(uint32_t(cell.x)) | part1by2(uint32_t(cell.y)) << 1 | part1by2(uint32_t(cell.z)) << 2;
+        keys[k] = (octant << 24 | morton) << 32 | k;
+    }
+    tmp.resize(n);
+    for (int shift = 32; shift < 59; shift += 9) {
+        size_t count[513] = {0};
+        for (uint64_t key : keys) ++count[((key >> shift) & 511) + 1];
+        for (int b = 1; b < 513; ++b) count[b] += count[b - 1];
+        for (uint64_t key : keys) tmp[count[(key >> shift) & 511]++] = key;
+        keys.swap(tmp);
+    }
+
+    scratch.clear();
+    for (uint64_t key : keys) {
+        const size_t k = uint32_t(key);
+        scratch.push(rays.origin.get(k), rays.dir.get(k), rays.intensity[k], rays.path[k]);
+    }
+    std::swap(rays, scratch);
+}
+
+void render_wavefront(ThreadData* data) {
+    const int w = data->width, h = data->height;
+    const Region &region = data->region;
+    const int cw = region.width();
+    std::vector<Object*> &scene = *data->scene;
+    std::vector<int> rows;
+    RayQueue rays, next, scratch;
+    HitQueue hits;
+    std::vector<uint64_t> keys, tmp;
+    std::vector<WaveRecord> waves;
+    Vec3Array pixels;
+    std::vector<AovSample> samples;
+
+    while (true) {
+        rows.clear();
+        while (rows.size() * cw < BATCH_RAYS) {
+            int row = next_row(data);
+            if (row < 0) break;
+            rows.push_back(row);
+        }
+        if (rows.empty()) break;
+
+        // Primary rays, one path per pixel
+        rays.clear();
+        for (size_t r = 0; r < rows.size(); ++r) {
+            for (int i = 0; i < cw; ++i) {
+                rays.push(O, primary_dir(region.x0 + i, rows[r], w, h), 1.f, int(r * cw + i));
+            }
+        }
+
+        size_t depth = 0;
+        while (rays.size() > 0) {
+            if (waves.size() <= depth) waves.emplace_back();
+            intersect_stage(rays, scene, hits);
+            sort_stage(rays, scene, hits);
+            shade_stage(rays, scene, hits);
+            shadow_stage(scene, hits);
+            if (depth == 0 && data->aovs) {
+                samples.assign(rays.size(), AovSample());
+                for (size_t q = 0; q < hits.order.size(); ++q) {
+                    const size_t k = hits.order[q];
+                    AovSample &sample = samples[rays.path[k]];
+                    sample.depth = hits.t[k];
+                    sample.normal = hits.N.get(q);
+                    sample.id = float(hits.object[k] + 1);
+                    sample.albedo = hits.color.get(q);
+                    sample.shadow = hits.lit[q] ? 0.f : 1.f;
+                }
+            }
+            light_stage(rays, scene, hits, waves[depth], next);
+            std::swap(rays, next);
+            if (sort_secondary) sort_rays(rays, scratch, keys, tmp);
+            ++depth;
+        }
+
+        // Combine from the deepest wave up, as the recursion unwinds
+        pixels.clear();
+        pixels.resize(rows.size() * cw);
+        for (size_t d = depth; d-- > 0;) {
+            const WaveRecord &wave = waves[d];
+            for (size_t e = 0; e < wave.path.size(); ++e) {
+                const int p = wave.path[e];
+                const vec3 reflected = wave.reflection[e] * pixels.get(p);
+                if (d == 0 && data->aovs) samples[p].reflection = reflected;
+                pixels.set(p, glm::clamp(wave.local.get(e) + reflected, 0.f, 1.f));
+            }
+        }
+
+        for (size_t r = 0; r < rows.size(); ++r) {
+            for (int i = 0; i < cw; ++i) {
+                const vec3 color = pixels.get(r * cw + i);
+                data->image->at<cv::Vec3f>(h - rows[r] - 1 - region.y0, i) = cv::Vec3f(color.x, color.y, color.z);
+                if (data->aovs) data->aovs->store(h - rows[r] - 1 - region.y0, i, samples[r * cw + i]);
+            }
+            finish_row(data, rows[r]);
+        }
+    }
+}
@@ -0,0 +1,108 @@
+# include "camera_path.h"
+
+# include <algorithm>
+# include <cmath>
+# include <fstream>
+# include <iostream>
+# include <sstream>
+
+bool CameraPath::load(const std::string &path) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "Error: Could not open camera path " << path << std::endl;
+        return false;
+    }
+    keys.clear();
+    std::string line;
+    for (int number = 1; std::getline(in, line); ++number) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream fields(line);
+        Key key;
+        if (!(fields >> key.frame)) {
+            if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+            std::cerr << "Error: " << path << ":" << number << ": expected a frame number" << std::endl;
+            return false;
+        }
+        if (!(fields >> key.position.x >> key.position.y >> key.position.z
+                     >> key.target.x >> key.target.y >> key.target.z)) {
+            std::cerr << "Error: " << path << ":" << number << ": expected position and target" << std::endl;
+            return false;
+        }
+        if (!(fields >> key.fov)) {
+            key.fov = 90.f;
+            fields.clear();
+        }
+        std::string rest;
+        if (fields >> rest) {
+            std::cerr << "Error: " << path << ":" << number << ": unexpected '" << rest << "'" << std::endl;
+            return false;
+        }
+        if (key.frame < 0 || (!keys.empty() && key.frame <= keys.back().frame)) {
+            std::cerr << "Error: " << path << ":" << number << ": frame numbers must increase from 0" << std::endl;
+            return false;
+        }
+        if (!(key.fov > 0.f && key.fov < 180.f)) {
+            std::cerr << "Error: " << path << ":" << number << ": fov must be between 0 and 180 degrees" << std::endl;
+            return false;
+        }
+        if (key.position == key.target) {
+            std::cerr << "Error: " << path << ":" << number << ": position and target coincide" << std::endl;
+            return false;
+        }
+        keys.push_back(key);
+    }
+    if (keys.empty()) {
+        std::cerr << "Error: " << path << " has no keyframes" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Cubic Hermite between a and b over a segment of length d; ma and mb are
+// per-frame tangents
+template <typename T>
+static T hermite(const T &a, const T &b, const T &ma, const T &mb, float d, float s) {
+    float s2 = s * s, s3 = s2 * s;
+    return (2 * s3 - 3 * s2 + 1) * a + (s3 - 2 * s2 + s) * d * ma
+         + (-2 * s3 + 3 * s2) * b + (s3 - s2) * d * mb;
+}
+
+// tan(fov / 2), exactly 1 for the built-in 90 degrees
+static float fov_scale(float fov) {
+    if (fov == 90.f) return 1.f;
+    return std::tan(std::min(std::max(fov, 1.f), 179.f) * float(M_PI) / 360);
+}
+
+void CameraPath::apply(int frame) const {
+    const Key* key = nullptr;
+    if (frame <= keys.front().frame) {
+        key = &keys.front();
+    } else if (frame >= keys.back().frame) {
+        key = &keys.back();
+    } else {
+        size_t i = 0;
+        while (keys[i + 1].frame <= frame) ++i;
+
+        // Catmull-Rom tangent at key k, one-sided at the ends
+        auto tangent = [&](size_t k, Key &m) {
+            size_t lo = k > 0 ? k - 1 : k, hi = k + 1 < keys.size() ? k + 1 : k;
+            float dt = float(keys[hi].frame - keys[lo].frame);
+            m.position = (keys[hi].position - keys[lo].position) / dt;
+            m.target = (keys[hi].target - keys[lo].target) / dt;
+            m.fov = (keys[hi].fov - keys[lo].fov) / dt;
+        };
+        Key m0, m1;
+        tangent(i, m0);
+        tangent(i + 1, m1);
+        const Key &a = keys[i], &b = keys[i + 1];
+        float d = float(b.frame - a.frame);
+        float s = (frame - a.frame) / d;
+        camera_position = hermite(a.position, b.position, m0.position, m1.position, d, s);
+        camera_target = hermite(a.target, b.target, m0.target, m1.target, d, s);
+        camera_scale = fov_scale(hermite(a.fov, b.fov, m0.fov, m1.fov, d, s));
+        return;
+    }
+    camera_position = key->position;
+    camera_target = key->target;
+    camera_scale = fov_scale(key->fov);
+}
@@ -0,0 +1,46 @@
+#ifndef CAMERA_PATH_H
+#define CAMERA_PATH_H
+
+# include "graph.h"
+# include <string>
+# include <vector>
+
+/* Camera animation loaded from a keyframe file, one key per line:
+
+     # frame   position        target      fov
+     0         1 .35 0         0 0 0       90
+     120       0 .8 -2         0 .2 0      60
+     300       -1 .35 .5       0 0 0
+
+   The frame numbers must increase; the path lasts until the last key. fov is
+   the horizontal field of view in degrees and may be left out (90, the
+   built-in view). Between keys position, target and fov follow a cubic
+   Hermite spline with Catmull-Rom tangents taken per frame, so the camera
+   keeps its speed across unevenly spaced keys; the path stops at the end
+   keys. Like any Catmull-Rom spline it passes through every key but can
+   overshoot between them where the motion reverses, so keep keys that
+   change direction away from walls; fov is clamped to 1-179 degrees.
+
+   The camera keeps world up, so it must not look straight up or down. */
+
+class CameraPath {
+public:
+    // Prints an error naming the line and returns false on a malformed file
+    bool load(const std::string &path);
+
+    int frames() const { return keys.empty() ? 0 : keys.back().frame + 1; }
+
+    // Sets camera_position, camera_target and camera_scale for frame
+    void apply(int frame) const;
+
+private:
+    struct Key {
+        int frame;
+        vec3 position;
+        vec3 target;
+        float fov;
+    };
+    std::vector<Key> keys;
+};
+
+#endif // CAMERA_PATH_H
@@ -0,0 +1,250 @@
+# include "mjpeg.h"
+
+# include <algorithm>
+# include <cerrno>
+# include <cstring>
+# include <iostream>
+
+static const uint32_t AVIF_HASINDEX = 0x10;
+static const uint32_t AVIIF_KEYFRAME = 0x10;
+
+MjpegWriter::~MjpegWriter() {
+    if (file) close();
+}
+
+bool MjpegWriter::put(const void* data, size_t size) {
+    if (size > 0 && std::fwrite(data, 1, size, file) != size) writeFailed = true;
+    return !writeFailed;
+}
+
+bool MjpegWriter::put32(uint32_t v) {
+    const unsigned char bytes[4] = {
+        (unsigned char)v, (unsigned char)(v >> 8), (unsigned char)(v >> 16), (unsigned char)(v >> 24)
+    };
+    return put(bytes, 4);
+}
+
+bool MjpegWriter::patch32(long position, uint32_t v) {
+    if (std::fseek(file, position, SEEK_SET) != 0) writeFailed = true;
+    return put32(v);
+}
+
+bool MjpegWriter::open(const std::string &path, int w, int h, int framesPerSecond, int jpegQuality, int numThreads) {
+    file = std::fopen(path.c_str(), "wb");
+    if (!file) {
+        std::cerr << "Error: Could not create " << path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    width = w;
+    height = h;
+    fps = framesPerSecond;
+    quality = jpegQuality;
+
+    // Fields that are only known at the end are written as 0 and their
+    // positions kept for close()
+    put("RIFF", 4);
+    riffSize = std::ftell(file);
+    put32(0);
+    put("AVI ", 4);
+
+    put("LIST", 4);
+    put32(4 + (8 + 56) + (8 + 4 + (8 + 56) + (8 + 40)));
+    put("hdrl", 4);
+
+    put("avih", 4);
+    put32(56);
+    put32(uint32_t(1000000 / fps));     // microseconds per frame
+    put32(0);                           // max bytes per second
+    put32(0);                           // padding granularity
+    put32(AVIF_HASINDEX);
+    avihFrames = std::ftell(file);
+    put32(0);                           // total frames
+    put32(0);                           // initial frames
+    put32(1);                           // streams
+    avihBuffer = std::ftell(file);
+    put32(0);                           // suggested buffer size
+    put32(uint32_t(w));
+    put32(uint32_t(h));
+    for (int k = 0; k < 4; ++k) put32(0);
+
+    put("LIST", 4);
+    put32(4 + (8 + 56) + (8 + 40));
+    put("strl", 4);
+
+    put("strh", 4);
+    put32(56);
+    put("vids", 4);
+    put("MJPG", 4);
+    put32(0);                           // flags
+    put32(0);                           // priority, language
+    put32(0);                           // initial frames
+    put32(1);                           // scale
+    put32(uint32_t(fps));               // rate
+    put32(0);                           // start
+    strhLength = std::ftell(file);
+    put32(0);                           // length in frames
+    strhBuffer = std::ftell(file);
+    put32(0);                           // suggested buffer size
+    put32(0xffffffffu);                 // quality: default
+    put32(0);                           // sample size: varies
+    put32(0);                           // frame rectangle left, top
+    put32(uint32_t(w & 0xffff) | uint32_t(h & 0xffff) << 16);
+
+    put("strf", 4);                     // BITMAPINFOHEADER
+    put32(40);
+    put32(40);
+    put32(uint32_t(w));
+    put32(uint32_t(h));
+    put32(1 | 24 << 16);                // planes, bits per pixel
+    put("MJPG", 4);
+    put32(uint32_t(w * h * 3));
+    for (int k = 0; k < 4; ++k) put32(0);
+
+    put("LIST", 4);
+    moviSize = std::ftell(file);
+    put32(0);
+    moviStart = std::ftell(file);
+    put("movi", 4);
+    if (writeFailed) {
+        std::cerr << "Error: Could not write " << path << std::endl;
+        std::fclose(file);
+        file = nullptr;
+        return false;
+    }
+
+    numThreads = std::max(numThreads, 1);
+    maxInFlight = 2 * size_t(numThreads);
+    encoders.resize(numThreads);
+    for (pthread_t &thread : encoders) {
+        pthread_create(&thread, nullptr, encoder, this);
+    }
+    pthread_create(&muxerThread, nullptr, muxer, this);
+    return true;
+}
+
+bool MjpegWriter::write(const cv::Mat &frame, const std::string &png) {
+    if (!file || frame.cols != width || frame.rows != height) return false;
+    Frame copy = {frame.clone(), png};
+    pthread_mutex_lock(&lock);
+    while (size_t(nextFrame - nextWritten) >= maxInFlight && !failed) pthread_cond_wait(&changed, &lock);
+    if (!failed) {
+        pending[nextFrame++] = copy;
+        pthread_cond_broadcast(&changed);
+    }
+    bool ok = !failed;
+    pthread_mutex_unlock(&lock);
+    return ok;
+}
+
+void* MjpegWriter::encoder(void* arg) {
+    MjpegWriter* writer = static_cast<MjpegWriter*>(arg);
+    const std::vector<int> params = {cv::IMWRITE_JPEG_QUALITY, writer->quality};
+    pthread_mutex_lock(&writer->lock);
+    while (true) {
+        while (writer->pending.empty() && !writer->closing && !writer->failed) {
+            pthread_cond_wait(&writer->changed, &writer->lock);
+        }
+        if (writer->pending.empty() || writer->failed) break;
+        auto first = writer->pending.begin();
+        const int frame = first->first;
+        Frame image = first->second;
+        writer->pending.erase(first);
+        pthread_mutex_unlock(&writer->lock);
+
+        Encoded out;
+        bool ok = cv::imencode(".jpg", image.image, out.jpeg, params);
+        out.saved = !image.png.empty();
+        if (ok && out.saved && !cv::imwrite(image.png, image.image)) {
+            std::cerr << "Error: Could not write " << image.png << std::endl;
+            ok = false;
+        }
+
+        pthread_mutex_lock(&writer->lock);
+        if (ok) writer->encoded[frame] = std::move(out);
+        else writer->failed = true;
+        pthread_cond_broadcast(&writer->changed);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return nullptr;
+}
+
+void* MjpegWriter::muxer(void* arg) {
+    MjpegWriter* writer = static_cast<MjpegWriter*>(arg);
+    pthread_mutex_lock(&writer->lock);
+    while (true) {
+        auto next = writer->encoded.find(writer->nextWritten);
+        while (next == writer->encoded.end() && !writer->failed
+               && !(writer->closing && writer->nextWritten == writer->nextFrame)) {
+            pthread_cond_wait(&writer->changed, &writer->lock);
+            next = writer->encoded.find(writer->nextWritten);
+        }
+        if (next == writer->encoded.end() || writer->failed) break;
+        const int frame = next->first;
+        const bool saved = next->second.saved;
+        std::vector<unsigned char> jpeg;
+        jpeg.swap(next->second.jpeg);
+        writer->encoded.erase(next);
+        pthread_mutex_unlock(&writer->lock);
+
+        // Only this thread touches the file until close() joins it
+        // 16 MB stay free for the index of up to a million frames
+        const long position = std::ftell(writer->file);
+        if (position + 8 + long(jpeg.size()) > 0xff000000L) {
+            std::cerr << "Error: the video reached the 4 GB limit of AVI 1.0" << std::endl;
+            writer->writeFailed = true;
+        }
+        Index entry;
+        entry.offset = uint32_t(position - writer->moviStart);
+        entry.size = uint32_t(jpeg.size());
+        if (!writer->writeFailed) {
+            writer->put("00dc", 4);
+            writer->put32(entry.size);
+            writer->put(jpeg.data(), jpeg.size());
+            if (jpeg.size() % 2) writer->put("", 1);
+            writer->index.push_back(entry);
+            writer->largest = std::max(writer->largest, entry.size);
+            if (saved && writer->saved) writer->saved(frame);
+        }
+
+        pthread_mutex_lock(&writer->lock);
+        ++writer->nextWritten;
+        if (writer->writeFailed) writer->failed = true;
+        pthread_cond_broadcast(&writer->changed);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return nullptr;
+}
+
+bool MjpegWriter::close() {
+    if (!file) return false;
+    pthread_mutex_lock(&lock);
+    closing = true;
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+    for (pthread_t thread : encoders) {
+        pthread_join(thread, nullptr);
+    }
+    pthread_join(muxerThread, nullptr);
+    encoders.clear();
+
+    const long indexStart = std::ftell(file);
+    put("idx1", 4);
+    put32(uint32_t(16 * index.size()));
+    for (const Index &entry : index) {
+        put("00dc", 4);
+        put32(AVIIF_KEYFRAME);
+        put32(entry.offset);
+        put32(entry.size);
+    }
+    const long end = std::ftell(file);
+
+    patch32(riffSize, uint32_t(end - 8));
+    patch32(moviSize, uint32_t(indexStart - moviStart));
+    patch32(avihFrames, uint32_t(index.size()));
+    patch32(avihBuffer, largest);
+    patch32(strhLength, uint32_t(index.size()));
+    patch32(strhBuffer, largest);
+    if (std::fclose(file) != 0) writeFailed = true;
+    file = nullptr;
+    return !failed && !writeFailed;
+}
@@ -0,0 +1,87 @@
+#ifndef MJPEG_H
+#define MJPEG_H
+
+# include <opencv2/opencv.hpp>
+# include <cstdint>
+# include <cstdio>
+# include <functional>
+# include <map>
+# include <string>
+# include <vector>
+# include <pthread.h>
+
+/* Motion-JPEG AVI writer that replaces cv::VideoWriter. MJPEG frames are
+   intra-only, so write() just hands the frame to a pool of encoder threads
+   (cv::imencode) and returns; a muxer thread writes the finished JPEGs to
+   the AVI in frame order. At most 2 x threads frames are in flight, after
+   which write() waits for the muxer.
+
+   A frame can also be saved as a PNG, which the encoder thread writes next
+   to its JPEG; saved is then called for it, in frame order, once the PNG
+   is on disk (--checkpoint relies on that to only list finished frames).
+
+   The file is a plain AVI 1.0 (RIFF, one MJPG video stream, idx1 index), so
+   it must stay under 4 GB. */
+
+class MjpegWriter {
+public:
+    // Prints an error and returns false if path cannot be created
+    bool open(const std::string &path, int w, int h, int fps, int quality, int numThreads);
+
+    // Queues an 8-bit BGR frame of the opened size, and its PNG copy if png
+    // is not empty. Returns false once encoding or writing has failed.
+    bool write(const cv::Mat &frame, const std::string &png = std::string());
+
+    // Called on the muxer thread with the number (from 0, in write order)
+    // of each frame whose PNG has been written; set before open
+    std::function<void(int frame)> saved;
+
+    // Writes the remaining frames, the index and the final header fields.
+    // Returns false if anything failed along the way.
+    bool close();
+
+    ~MjpegWriter();
+
+private:
+    struct Frame {
+        cv::Mat image;
+        std::string png;    // where to save it too, empty for none
+    };
+    struct Encoded {
+        std::vector<unsigned char> jpeg;
+        bool saved;         // the PNG was written
+    };
+
+    struct Index {
+        uint32_t offset;    // from the "movi" list type
+        uint32_t size;
+    };
+
+    static void* encoder(void* arg);
+    static void* muxer(void* arg);
+    bool put(const void* data, size_t size);
+    bool put32(uint32_t v);
+    bool patch32(long position, uint32_t v);
+
+    FILE* file = nullptr;
+    int width = 0, height = 0, fps = 30, quality = 95;
+    long riffSize = 0, moviSize = 0, avihFrames = 0, avihBuffer = 0, strhLength = 0, strhBuffer = 0;
+    long moviStart = 0;
+    std::vector<Index> index;
+    uint32_t largest = 0;
+    bool writeFailed = false;   // only touched by whichever thread owns the file
+
+    std::vector<pthread_t> encoders;
+    pthread_t muxerThread;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+    std::map<int, Frame> pending;       // frames waiting for an encoder
+    std::map<int, Encoded> encoded;     // JPEGs waiting for the muxer
+    int nextFrame = 0;      // number of the next frame written
+    int nextWritten = 0;    // next frame the muxer writes
+    size_t maxInFlight = 0;
+    bool closing = false;
+    bool failed = false;
+};
+
+#endif // MJPEG_H
@@ -0,0 +1,131 @@
+# include "stream.h"
+
+# include <cerrno>
+# include <csignal>
+# include <cstring>
+# include <iostream>
+# include <vector>
+# include <fcntl.h>
+# include <unistd.h>
+
+bool FrameStream::open(const std::string &path, const std::string &format, int w, int h, int fps) {
+    y4m = format == "y4m";
+    width = w;
+    height = h;
+    if (path == "-") {
+        // Frames own stdout from here on; everything printed goes to stderr
+        std::cout.flush();
+        fd = dup(STDOUT_FILENO);
+        if (fd >= 0) dup2(STDERR_FILENO, STDOUT_FILENO);
+    } else {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (fd < 0) {
+        std::cerr << "Error: Could not open " << path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    // A reader that goes away should fail the stream, not kill the process
+    std::signal(SIGPIPE, SIG_IGN);
+
+    if (y4m) {
+        const std::string header = "YUV4MPEG2 W" + std::to_string(w) + " H" + std::to_string(h)
+                                 + " F" + std::to_string(fps) + ":1 Ip A1:1 C444\n";
+        if (!write_all(header.data(), header.size())) {
+            std::cerr << "Error: Could not write to " << path << ": " << std::strerror(errno) << std::endl;
+            ::close(fd);
+            fd = -1;
+            return false;
+        }
+    }
+    pthread_create(&thread, nullptr, writer, this);
+    return true;
+}
+
+bool FrameStream::push(const cv::Mat &frame) {
+    pthread_mutex_lock(&lock);
+    while (queue.size() >= QUEUE_DEPTH && !failed) pthread_cond_wait(&changed, &lock);
+    if (!failed) {
+        queue.push_back(frame);
+        pthread_cond_broadcast(&changed);
+    }
+    bool ok = !failed;
+    pthread_mutex_unlock(&lock);
+    return ok;
+}
+
+bool FrameStream::close() {
+    if (fd < 0) return false;
+    pthread_mutex_lock(&lock);
+    closing = true;
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, nullptr);
+    bool ok = ::close(fd) == 0 && !failed;
+    fd = -1;
+    return ok;
+}
+
+bool FrameStream::write_all(const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = ::write(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+void* FrameStream::writer(void* arg) {
+    FrameStream* stream = static_cast<FrameStream*>(arg);
+    const size_t pixels = size_t(stream->width) * stream->height;
+    std::vector<unsigned char> out(stream->y4m ? 6 + 3 * pixels : 3 * pixels);
+    if (stream->y4m) std::memcpy(out.data(), "FRAME\n", 6);
+
+    pthread_mutex_lock(&stream->lock);
+    while (true) {
+        while (stream->queue.empty() && !stream->closing) pthread_cond_wait(&stream->changed, &stream->lock);
+        if (stream->queue.empty()) break;
+        cv::Mat frame = stream->queue.front();
+        pthread_mutex_unlock(&stream->lock);
+
+        if (stream->y4m) {
+            // Planar Y, Cb, Cr from BGR, BT.601 limited range in integers
+            unsigned char* Y = &out[6];
+            unsigned char* U = Y + pixels;
+            unsigned char* V = U + pixels;
+            for (int row = 0; row < frame.rows; ++row) {
+                const unsigned char* in = frame.ptr<unsigned char>(row);
+                for (int col = 0; col < frame.cols; ++col, ++Y, ++U, ++V) {
+                    const int b = in[3 * col], g = in[3 * col + 1], r = in[3 * col + 2];
+                    *Y = (unsigned char)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+                    *U = (unsigned char)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+                    *V = (unsigned char)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+                }
+            }
+        } else {
+            unsigned char* p = out.data();
+            for (int row = 0; row < frame.rows; ++row) {
+                const unsigned char* in = frame.ptr<unsigned char>(row);
+                for (int col = 0; col < frame.cols; ++col, p += 3) {
+                    p[0] = in[3 * col + 2];
+                    p[1] = in[3 * col + 1];
+                    p[2] = in[3 * col];
+                }
+            }
+        }
+        bool ok = stream->write_all(out.data(), out.size());
+
+        pthread_mutex_lock(&stream->lock);
+        stream->queue.pop_front();
+        if (!ok) {
+            stream->failed = true;
+            stream->queue.clear();
+        }
+        pthread_cond_broadcast(&stream->changed);
+        if (!ok) break;
+    }
+    pthread_mutex_unlock(&stream->lock);
+    return nullptr;
+}
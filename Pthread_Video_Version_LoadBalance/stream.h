@@ -0,0 +1,51 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+# include <opencv2/opencv.hpp>
+# include <deque>
+# include <string>
+# include <pthread.h>
+
+/* Frames written to stdout or a file/named pipe as they are rendered, for an
+   external encoder, e.g.
+
+     raytracing --stream y4m | ffmpeg -i - out.mp4
+     raytracing --stream raw | ffmpeg -f rawvideo -pix_fmt rgb24 -s WxH -r 30 -i - out.mp4
+
+   y4m is YUV4MPEG2 with full-resolution chroma (C444), BT.601 limited
+   range; raw is packed 8-bit RGB with no header. A writer thread does the
+   conversion and the writes, so the next frame renders meanwhile. At most
+   QUEUE_DEPTH frames wait for it: when the reader falls behind, push blocks
+   and rendering waits. */
+
+class FrameStream {
+public:
+    static const size_t QUEUE_DEPTH = 2;
+
+    // path "-" is stdout; anything else is opened for writing, which for a
+    // named pipe waits for a reader. Prints an error and returns false on
+    // failure.
+    bool open(const std::string &path, const std::string &format, int w, int h, int fps);
+
+    // Queues an 8-bit BGR frame. Returns false once a write has failed.
+    bool push(const cv::Mat &frame);
+
+    // Writes what is queued and closes. Returns false if any write failed.
+    bool close();
+
+private:
+    static void* writer(void* arg);
+    bool write_all(const void* data, size_t size);
+
+    int fd = -1;
+    bool y4m = false;
+    int width = 0, height = 0;
+    pthread_t thread;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+    std::deque<cv::Mat> queue;
+    bool closing = false;
+    bool failed = false;
+};
+
+#endif // STREAM_H
@@ -13,6 +13,7 @@ int main(int argc, char *argv[]) {
 
     int w = 6400, h = 6400;
     bool wSet = false, hSet = false;
+    std::string compareA, compareB;
     try{
         for (int i = 1; i<argc; i++ ) {
             std::string arg = argv[i];
@@ -24,6 +25,16 @@ int main(int argc, char *argv[]) {
                 h = std::stoi(argv[++i]);
                 hSet = true;
             }
+            else if (arg == "--precision" && i + 1 < argc) {
+                if (!parse_precision(argv[++i], precision)) {
+                    std::cerr << "Error: --precision must be exact, fast or approx." << std::endl;
+                    std::exit(EXIT_FAILURE);
+                }
+            }
+            else if (arg == "--compare" && i + 2 < argc) {
+                compareA = argv[++i];
+                compareB = argv[++i];
+            }
         }
     } catch (const std::invalid_argument& e) {
         std::cerr << "Error: Invalid argument for width or height." << std::endl;
@@ -35,6 +46,18 @@ int main(int argc, char *argv[]) {
         std::exit(EXIT_FAILURE);
     }
 
+    if (!compareA.empty()) {
+        cv::Mat a = cv::imread(compareA), b = cv::imread(compareB);
+        if (a.empty() || b.empty()) {
+            std::cerr << "Error: Could not read " << (a.empty() ? compareA : compareB) << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        std::cout << "Compare: " << compareA << " vs " << compareB << std::endl;
+        ImageDiff diff = compare_images(a, b);
+        print_image_diff(diff);
+        return diff.identical() ? 0 : 1;
+    }
+
     std::vector<Object*> scene = {
         new Sphere(vec3(.75, .1, 1.), .6, vec3(.8, .3, 0.)),
         new Sphere(vec3(-.3, .01, .2), .3, vec3(.0, .0, .9)),